@@ -219,10 +219,24 @@ static const char * irq_names[ACOMP_IRQ_COUNT] = {
 	[ACOMP_IRQ_OUT] = ">out"
 };
 
-static avr_io_t _io = {
+// connects the clone to its own timer, if the original was connected
+static void
+avr_acomp_clone(avr_io_t * port, const avr_io_t * own)
+{
+	avr_acomp_t * p = (avr_acomp_t *)port;
+
+	if (!p->timer_irq)
+		return;
+	p->timer_irq = avr_io_getirq(p->io.avr, AVR_IOCTL_TIMER_GETIRQ(p->timer_name), TIMER_IRQ_IN_ICP);
+	if (p->timer_irq)
+		avr_connect_irq(p->io.irq + ACOMP_IRQ_OUT, p->timer_irq);
+}
+
+static const avr_io_t _io = {
 	.kind = "ac",
 	.reset = avr_acomp_reset,
 	.irq_names = irq_names,
+	.clone = avr_acomp_clone,
 };
 
 void
@@ -158,7 +158,7 @@ avr_adc_configure_trigger(
 	uint8_t adate = avr_regbit_get(avr, p->adate);
 	uint8_t old_adts = p->adts_mode;
 	
-	static char * auto_trigger_names[] = {
+	static const char * const auto_trigger_names[] = {
 		"none",
 		"free_running",
 		"analog_comparator_0",
@@ -330,7 +330,7 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_OUT_TRIGGER] = ">trigger_out",
 };
 
-static	avr_io_t	_io = {
+static const avr_io_t _io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
 	.irq_names = irq_names,
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -125,10 +126,36 @@ static void avr_eeprom_dealloc(struct avr_io_t * port)
 	p->eeprom = NULL;
 }
 
-static	avr_io_t	_io = {
+static void avr_eeprom_serialize(struct avr_io_t * port, struct avr_snapshot_t * s)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+	avr_snapshot_put(s, p->eeprom, p->size);
+}
+
+static int avr_eeprom_deserialize(struct avr_io_t * port, const uint8_t * data, uint32_t size)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+	if (size != p->size)
+		return -1;
+	memcpy(p->eeprom, data, size);
+	return 0;
+}
+
+static void avr_eeprom_clone(struct avr_io_t * port, const struct avr_io_t * own_port)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+	const avr_eeprom_t * own = (const avr_eeprom_t *)own_port;
+	memcpy(own->eeprom, p->eeprom, p->size);
+	p->eeprom = own->eeprom;
+}
+
+static const avr_io_t _io = {
 	.kind = "eeprom",
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.serialize = avr_eeprom_serialize,
+	.deserialize = avr_eeprom_deserialize,
+	.clone = avr_eeprom_clone,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
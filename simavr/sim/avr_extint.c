@@ -26,11 +26,6 @@
 #include "avr_extint.h"
 #include "avr_ioport.h"
 
-typedef struct avr_extint_poll_context_t {
-	uint32_t	eint_no; // index of particular interrupt source we are monitoring
-	avr_extint_t *extint;
-} avr_extint_poll_context_t;
-
 static avr_cycle_count_t avr_extint_poll_level_trig(
 		struct avr_t * avr,
 		avr_cycle_count_t when,
@@ -42,10 +37,10 @@ static avr_cycle_count_t avr_extint_poll_level_trig(
 	char port = p->eint[poll->eint_no].port_ioctl & 0xFF;
 	avr_ioport_state_t iostate;
 	if (avr_ioctl(avr, AVR_IOCTL_IOPORT_GETSTATE( port ), &iostate) < 0)
-		goto terminate_poll;
+		return 0;
 	uint8_t bit = ( iostate.pin >> p->eint[poll->eint_no].port_pin ) & 1;
 	if (bit)
-		goto terminate_poll; // Only poll while pin level remains low
+		return 0; // Only poll while pin level remains low
 
 	if (avr->sreg[S_I]) {
 		uint8_t raised = avr_regbit_get(avr, p->eint[poll->eint_no].vector.raised) || p->eint[poll->eint_no].vector.pending;
@@ -54,10 +49,6 @@ static avr_cycle_count_t avr_extint_poll_level_trig(
 	}
 
 	return when+1;
-
-terminate_poll:
-	free(poll);
-	return 0;
 }
 
 static avr_extint_t * avr_extint_get(avr_t * avr)
@@ -146,12 +137,10 @@ static void avr_extint_irq_notify(struct avr_irq_t * irq, uint32_t value, void *
 							avr_raise_interrupt(avr, &p->eint[irq->irq].vector);
 					}
 					if (p->eint[irq->irq].strict_lvl_trig) {
-						avr_extint_poll_context_t *poll = malloc(sizeof(avr_extint_poll_context_t));
-						if (poll) {
-							poll->eint_no = irq->irq;
-							poll->extint = p;
-							avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, poll);
-						}
+						avr_extint_poll_context_t *poll = &p->eint[irq->irq].poll;
+						poll->eint_no = irq->irq;
+						poll->extint = p;
+						avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, poll);
 					}
 				}
 			}
@@ -200,10 +189,19 @@ static const char * irq_names[EXTINT_COUNT] = {
 	[EXTINT_IRQ_OUT_INT7] = "<int7",
 };
 
-static	avr_io_t	_io = {
+static void avr_extint_clone(avr_io_t * port, const avr_io_t * own)
+{
+	avr_extint_t * p = (avr_extint_t *)port;
+
+	for (int i = 0; i < EXTINT_COUNT; i++)
+		p->eint[i].poll.extint = p;
+}
+
+static const avr_io_t _io = {
 	.kind = "extint",
 	.reset = avr_extint_reset,
 	.irq_names = irq_names,
+	.clone = avr_extint_clone,
 };
 
 void avr_extint_init(avr_t * avr, avr_extint_t * p)
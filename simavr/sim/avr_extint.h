@@ -59,10 +59,18 @@ typedef struct avr_extint_t {
 		uint32_t		port_ioctl;		// ioctl to use to get port
 		uint8_t			port_pin;		// pin number in said port
 		uint8_t			strict_lvl_trig;// enforces a repetitive interrupt triggering while the pin is held low
+		// param of the timer polling the pin in that case, part of the
+		// module so it's saved with it, see sim_snapshot.h
+		struct avr_extint_poll_context_t {
+			uint32_t	eint_no; // index of particular interrupt source we are monitoring
+			struct avr_extint_t *extint;
+		}				poll;
 	}	eint[EXTINT_COUNT];
 
 } avr_extint_t;
 
+typedef struct avr_extint_poll_context_t avr_extint_poll_context_t;
+
 void avr_extint_init(avr_t * avr, avr_extint_t * p);
 int avr_extint_is_strict_lvl_trig(avr_t * avr, uint8_t extint_no);
 void avr_extint_set_strict_lvl_trig(avr_t * avr, uint8_t extint_no, uint8_t strict);
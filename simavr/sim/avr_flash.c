@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -73,11 +74,13 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		if (avr_regbit_get(avr, p->pgers)) {
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_invalidate_code(avr, z, p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
 			z &= ~(p->spm_pagesize - 1);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_invalidate_code(avr, z, p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
 				avr->flash[z++] = p->tmppage[i];
 				avr->flash[z++] = p->tmppage[i] >> 8;
@@ -120,11 +123,48 @@ avr_flash_dealloc(struct avr_io_t * port)
 		free(p->tmppage_used);
 }
 
-static	avr_io_t	_io = {
+// the page being filled by SPM
+static void
+avr_flash_serialize(struct avr_io_t * port, struct avr_snapshot_t * s)
+{
+	avr_flash_t * p = (avr_flash_t *) port;
+
+	avr_snapshot_put(s, p->tmppage, p->spm_pagesize);
+	avr_snapshot_put(s, p->tmppage_used, p->spm_pagesize / 2);
+}
+
+static int
+avr_flash_deserialize(struct avr_io_t * port, const uint8_t * data, uint32_t size)
+{
+	avr_flash_t * p = (avr_flash_t *) port;
+
+	if (size != p->spm_pagesize + (p->spm_pagesize / 2))
+		return -1;
+	memcpy(p->tmppage, data, p->spm_pagesize);
+	memcpy(p->tmppage_used, data + p->spm_pagesize, p->spm_pagesize / 2);
+	return 0;
+}
+
+static void
+avr_flash_clone(struct avr_io_t * port, const struct avr_io_t * own_port)
+{
+	avr_flash_t * p = (avr_flash_t *) port;
+	const avr_flash_t * own = (const avr_flash_t *) own_port;
+
+	memcpy(own->tmppage, p->tmppage, p->spm_pagesize);
+	memcpy(own->tmppage_used, p->tmppage_used, p->spm_pagesize / 2);
+	p->tmppage = own->tmppage;
+	p->tmppage_used = own->tmppage_used;
+}
+
+static const avr_io_t _io = {
 	.kind = "flash",
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.serialize = avr_flash_serialize,
+	.deserialize = avr_flash_deserialize,
+	.clone = avr_flash_clone,
 };
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p)
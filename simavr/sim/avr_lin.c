@@ -87,7 +87,7 @@ avr_lin_reset(
 	avr->data[p->r_linbtr] = 0x20;
 }
 
-static avr_io_t _io = {
+static const avr_io_t _io = {
 		.kind = "lin",
 		.reset = avr_lin_reset,
 };
@@ -90,7 +90,7 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_OUTPUT] = "8<out",
 };
 
-static	avr_io_t	_io = {
+static const avr_io_t _io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
 	.irq_names = irq_names,
@@ -854,11 +854,22 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_COMP + 2] = ">compc",
 };
 
-static	avr_io_t	_io = {
+static void
+avr_timer_clone(
+		avr_io_t * port,
+		const avr_io_t * own)
+{
+	avr_timer_t * p = (avr_timer_t *)port;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		p->comp[compi].timer = ((const avr_timer_t *)own)->comp[compi].timer;
+}
+
+static const avr_io_t _io = {
 	.kind = "timer",
 	.irq_names = irq_names,
 	.reset = avr_timer_reset,
 	.ioctl = avr_timer_ioctl,
+	.clone = avr_timer_clone,
 };
 
 void
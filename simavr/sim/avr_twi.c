@@ -468,7 +468,7 @@ static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_STATUS] = "8>status",
 };
 
-static	avr_io_t	_io = {
+static const avr_io_t _io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
 	.irq_names = irq_names,
@@ -489,11 +489,23 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
-static	avr_io_t	_io = {
+// the console line being printed stays with the original
+static void
+avr_uart_clone(
+		struct avr_io_t *io,
+		const struct avr_io_t *own)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	p->stdio_out = ((const avr_uart_t *)own)->stdio_out;
+	p->stdio_len = 0;
+}
+
+static const avr_io_t _io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.clone = avr_uart_clone,
 };
 
 void
@@ -521,6 +533,8 @@ avr_uart_init(
 	avr_register_io_read(avr, p->r_udr, avr_uart_read, p);
 	// monitor code that reads the rxc flag, and delay it a bit
 	avr_register_io_read(avr, p->rxc.raised.reg, avr_uart_rxc_read, p);
+	// nothing changes when it's polled, save for the XON/XOFF IRQs being raised again
+	avr_register_io_read_idle(avr, p->rxc.raised.reg);
 
 	if (p->udrc.vector)
 		avr_register_io_write(avr, p->udrc.enable.reg, avr_uart_write, p);
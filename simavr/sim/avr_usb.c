@@ -32,6 +32,7 @@
 #include <string.h>
 #include <assert.h>
 #include "avr_usb.h"
+#include "sim_snapshot.h"
 
 enum usb_regs
 {
@@ -725,12 +726,52 @@ avr_usb_dealloc(
 	free(p->state);
 }
 
-static	avr_io_t	_io = {
+static void
+avr_usb_serialize(
+		struct avr_io_t * port,
+		struct avr_snapshot_t * s)
+{
+	avr_usb_t * p = (avr_usb_t *) port;
+	avr_snapshot_put(s, p->state, sizeof *p->state);
+}
+
+// the vectors are in the state too, their IRQs are put back by the snapshot
+static int
+avr_usb_deserialize(
+		struct avr_io_t * port,
+		const uint8_t * data,
+		uint32_t size)
+{
+	avr_usb_t * p = (avr_usb_t *) port;
+	if (size != sizeof *p->state)
+		return -1;
+	memcpy(p->state, data, size);
+	return 0;
+}
+
+// the vectors in the state are the clone's own, only their pending bit is copied
+static void
+avr_usb_clone(
+		struct avr_io_t * port,
+		const struct avr_io_t * own_port)
+{
+	avr_usb_t * p = (avr_usb_t *) port;
+	const avr_usb_t * own = (const avr_usb_t *) own_port;
+	memcpy(own->state->ep_state, p->state->ep_state, sizeof own->state->ep_state);
+	own->state->com_vect.pending = p->state->com_vect.pending;
+	own->state->gen_vect.pending = p->state->gen_vect.pending;
+	p->state = own->state;
+}
+
+static const avr_io_t _io = {
 	.kind = "usb",
 	.reset = avr_usb_reset,
 	.irq_names = irq_names,
 	.ioctl = avr_usb_ioctl,
 	.dealloc = avr_usb_dealloc,
+	.serialize = avr_usb_serialize,
+	.deserialize = avr_usb_deserialize,
+	.clone = avr_usb_clone,
 };
 
 static void
@@ -87,7 +87,7 @@ static void avr_watchdog_set_cycle_count_and_timer(
 	if (!enable_changed && !wdp_changed)
 		return;
 
-	static char *message[2][2] = {
+	static const char * const message[2][2] = {
 			{ 0, "reset" }, { "enabled", "enabled and set" } };
 
 	if (wde || wdie) {
@@ -211,7 +211,7 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
-static	avr_io_t	_io = {
+static const avr_io_t _io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
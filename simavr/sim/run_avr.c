@@ -30,6 +30,7 @@
 #include "sim_gdb.h"
 #include "sim_hex.h"
 #include "sim_vcd_file.h"
+#include "sim_trace.h"
 
 #include "sim_core_decl.h"
 
@@ -44,7 +45,16 @@ display_usage(
 			"       [--help|-h]         Display this usage message and exit\n"
 			"       [--trace, -t]       Run full scale decoder trace\n"
 			"       [-ti <vector>]      Add traces for IRQ vector <vector>\n"
+			"       [--trace-file <file>] Write a binary trace of all the\n"
+			"                           instructions, see trace_avr\n"
 			"       [--gdb|-g]          Listen for gdb connection on port 1234\n"
+			"       [--quantum|-q <n>]  Run up to <n> cycles between checks for\n"
+			"                           external events (1 = every instruction)\n"
+			"       [--fast]            Don't wait in real time when the AVR sleeps\n"
+			"       [--speed <n>]       Run sleeps <n> times faster than real time\n"
+			"       [--idle-skip]       Skip over the idle turns of polling loops\n"
+			"       [--defer-irq]       Update the VCD traces in batches, not\n"
+			"                           inside each instruction\n"
 			"       [-ff <.hex file>]   Load next .hex file as flash\n"
 			"       [-ee <.hex file>]   Load next .hex file as eeprom\n"
 			"       [--input|-i <file>] A .vcd file to use as input signals\n"
@@ -89,12 +99,18 @@ main(
 	uint32_t f_cpu = 0;
 	int trace = 0;
 	int gdb = 0;
+	avr_cycle_count_t quantum = 0;
+	uint8_t time_policy = AVR_TIME_REALTIME;
+	uint32_t time_scale = 1;
+	int idle_skip = 0;
+	int defer_irq = 0;
 	int log = 1;
 	char name[24] = "";
 	uint32_t loadBase = AVR_SEGMENT_OFFSET_FLASH;
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
 	const char *vcd_input = NULL;
+	const char *trace_file = NULL;
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
@@ -119,6 +135,11 @@ main(
 				vcd_input = argv[++pi];
 			else
 				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--trace-file")) {
+			if (pi < argc-1)
+				trace_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-t") || !strcmp(argv[pi], "--trace")) {
 			trace++;
 		} else if (!strcmp(argv[pi], "-ti")) {
@@ -126,6 +147,23 @@ main(
 				trace_vectors[trace_vectors_count++] = atoi(argv[++pi]);
 		} else if (!strcmp(argv[pi], "-g") || !strcmp(argv[pi], "--gdb")) {
 			gdb++;
+		} else if (!strcmp(argv[pi], "-q") || !strcmp(argv[pi], "--quantum")) {
+			if (pi < argc-1)
+				quantum = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--fast")) {
+			time_policy = AVR_TIME_FAST;
+		} else if (!strcmp(argv[pi], "--speed")) {
+			if (pi < argc-1) {
+				time_policy = AVR_TIME_SCALED;
+				time_scale = atoi(argv[++pi]);
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--idle-skip")) {
+			idle_skip = 1;
+		} else if (!strcmp(argv[pi], "--defer-irq")) {
+			defer_irq = 1;
 		} else if (!strcmp(argv[pi], "-v")) {
 			log++;
 		} else if (!strcmp(argv[pi], "-ee")) {
@@ -190,6 +228,12 @@ main(
 	}
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
 	avr->trace = trace;
+	if (quantum)
+		avr_set_run_quantum(avr, quantum);
+	avr_set_time_policy(avr, time_policy, time_scale);
+	avr->idle_skip = idle_skip;
+	if (defer_irq)
+		avr_irq_pool_defer(&avr->irq_pool, 1);
 	for (int ti = 0; ti < trace_vectors_count; ti++) {
 		for (int vi = 0; vi < avr->interrupts.vector_count; vi++)
 			if (avr->interrupts.vector[vi]->vector == trace_vectors[ti])
@@ -202,6 +246,11 @@ main(
 		}
 	}
 
+	if (trace_file && avr_trace_start(avr, trace_file)) {
+		fprintf(stderr, "%s: Unable to trace to %s\n", argv[0], trace_file);
+		exit(1);
+	}
+
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = 1234;
 	if (gdb) {
@@ -0,0 +1,515 @@
+/*
+	run_avr_batch.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs a list of firmware/test vector jobs in one process, on all the CPUs,
+ * for the test suites that would otherwise start run_avr for each of them.
+ *
+ * The manifest has one job per line, made of key=value words:
+ *   name=<name>         job name in the results, defaults to its line number
+ *   firmware=<file>     an ELF file, or a .hex file with mcu= and freq=
+ *   mcu=<device>        overrides the MCU of the firmware
+ *   freq=<hz>           overrides its frequency
+ *   input=<file>        a .vcd file to use as input signals
+ *   stdin=<file>        bytes to send to UART0
+ *   cycles=<n>          stops the job at cycle <n>, see --cycles
+ *   expect=<file>       what UART0 has to send, to pass
+ * Empty lines and lines starting with '#' are skipped, there has to be at
+ * least one job.
+ *
+ * Each firmware file is read once, the jobs that run it share it, without
+ * the VCD trace it may ask for. The worker threads take the next job in
+ * the list as they become free; a job gets its own avr_t, that runs as
+ * fast as it can, on the worker thread.
+ *
+ * The results have one line per job, in the manifest order, tab separated:
+ *   <name> <status> <output> <cycles> <microseconds>
+ * with status "done" (the firmware stopped), "crashed", "limit" (reached
+ * its cycle limit) or "error" (the job couldn't be run), and output "pass"
+ * or "fail" if the job has an expect= file, "-" if not.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_vcd_file.h"
+#include "avr_uart.h"
+
+static void
+display_usage(
+	const char * app)
+{
+	printf("Usage: %s [...] <manifest>\n", app);
+	printf( "       [--jobs|-j <n>]     Run <n> jobs at once, default one per CPU\n"
+			"       [--cycles|-c <n>]   Cycle limit of the jobs without cycles=\n"
+			"                           (default: run until the firmware stops)\n"
+			"       [--output|-o <file>] Write the results there, not on stdout\n"
+			"       [-v]                Raise verbosity level\n"
+			"                           (can be passed more than once)\n"
+			"       [--help|-h]         Display this usage message and exit\n");
+	exit(1);
+}
+
+typedef struct batch_firmware_t {
+	struct batch_firmware_t * next;
+	char *			file;
+	int				loaded;		// 1 read, -1 failed
+	elf_firmware_t	f;
+} batch_firmware_t;
+
+typedef struct batch_job_t {
+	char *		name;
+	batch_firmware_t * firmware;
+	char *		mcu;
+	uint32_t	frequency;
+	char *		input;
+	char *		stdin_file;
+	char *		expect;
+	avr_cycle_count_t cycles;
+
+	// UART0
+	avr_irq_t *	uart;
+	uint8_t *	in;
+	size_t		in_size, in_pos;
+	int			xon;
+	uint8_t *	out;
+	size_t		out_size, out_alloc;
+
+	// results
+	const char *	status;
+	const char *	output;
+	avr_cycle_count_t cycle;
+	uint64_t	usec;
+} batch_job_t;
+
+static batch_job_t * job;
+static int job_count;
+static int next_job;
+static batch_firmware_t * firmware;
+// libelf isn't known to be thread safe, the firmware are read one at a time
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_level = 1;
+static __thread batch_job_t * current;	// job of the worker thread
+
+static uint8_t *
+read_file(
+		const char * filename,
+		size_t * size)
+{
+	FILE * f = fopen(filename, "rb");
+	if (!f)
+		return NULL;
+	uint8_t * data = NULL;
+	size_t alloc = 0;
+	*size = 0;
+	for (;;) {
+		if (*size == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			data = realloc(data, alloc);
+		}
+		size_t r = fread(data + *size, 1, alloc - *size, f);
+		if (!r)
+			break;
+		*size += r;
+	}
+	fclose(f);
+	return data;
+}
+
+// as run_avr does, the chunk under 1MB is the flash, the one at the EEPROM
+// offset the EEPROM
+static int
+read_hex_firmware(
+		const char * filename,
+		elf_firmware_t * f)
+{
+	ihex_chunk_p chunk = NULL;
+	int cnt = read_ihex_chunks(filename, &chunk);
+	if (cnt <= 0)
+		return -1;
+	for (int ci = 0; ci < cnt; ci++) {
+		if (chunk[ci].baseaddr < (1*1024*1024)) {
+			f->flash = chunk[ci].data;
+			f->flashsize = chunk[ci].size;
+			f->flashbase = chunk[ci].baseaddr;
+		} else if (chunk[ci].baseaddr >= AVR_SEGMENT_OFFSET_EEPROM) {
+			f->eeprom = chunk[ci].data;
+			f->eesize = chunk[ci].size;
+		}
+	}
+	return 0;
+}
+
+static batch_firmware_t *
+batch_firmware(
+		const char * file)
+{
+	for (batch_firmware_t * fw = firmware; fw; fw = fw->next)
+		if (!strcmp(fw->file, file))
+			return fw;
+	batch_firmware_t * fw = calloc(1, sizeof(*fw));
+	fw->file = strdup(file);
+	fw->next = firmware;
+	firmware = fw;
+	return fw;
+}
+
+static int
+batch_firmware_load(
+		batch_firmware_t * fw)
+{
+	pthread_mutex_lock(&load_lock);
+	if (!fw->loaded) {
+		char * suffix = strrchr(fw->file, '.');
+		int res;
+		if (suffix && !strcasecmp(suffix, ".hex"))
+			res = read_hex_firmware(fw->file, &fw->f);
+		else
+			res = elf_read_firmware(fw->file, &fw->f);
+		fw->loaded = res ? -1 : 1;
+	}
+	int res = fw->loaded > 0 ? 0 : -1;
+	pthread_mutex_unlock(&load_lock);
+	return res;
+}
+
+static int
+read_manifest(
+		const char * filename)
+{
+	FILE * f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	char line[4096];
+	int alloc = 0;
+	for (int lineno = 1; fgets(line, sizeof(line), f); lineno++) {
+		char * p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p || *p == '\n' || *p == '#')
+			continue;
+		if (job_count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			job = realloc(job, alloc * sizeof(*job));
+		}
+		batch_job_t * j = &job[job_count];
+		memset(j, 0, sizeof(*j));
+
+		for (char * w = strtok(p, " \t\n"); w; w = strtok(NULL, " \t\n")) {
+			char * v = strchr(w, '=');
+			if (!v) {
+				fprintf(stderr, "%s:%d: '%s' isn't key=value\n", filename, lineno, w);
+				goto error;
+			}
+			*v++ = 0;
+			if (!strcmp(w, "name"))
+				j->name = strdup(v);
+			else if (!strcmp(w, "firmware"))
+				j->firmware = batch_firmware(v);
+			else if (!strcmp(w, "mcu"))
+				j->mcu = strdup(v);
+			else if (!strcmp(w, "freq"))
+				j->frequency = strtoul(v, NULL, 0);
+			else if (!strcmp(w, "input"))
+				j->input = strdup(v);
+			else if (!strcmp(w, "stdin"))
+				j->stdin_file = strdup(v);
+			else if (!strcmp(w, "expect"))
+				j->expect = strdup(v);
+			else if (!strcmp(w, "cycles"))
+				j->cycles = strtoull(v, NULL, 0);
+			else {
+				fprintf(stderr, "%s:%d: unknown key '%s'\n", filename, lineno, w);
+				goto error;
+			}
+		}
+		if (!j->firmware) {
+			fprintf(stderr, "%s:%d: no firmware=\n", filename, lineno);
+			goto error;
+		}
+		if (!j->name) {
+			char n[16];
+			sprintf(n, "%d", lineno);
+			j->name = strdup(n);
+		}
+		job_count++;
+	}
+	fclose(f);
+	return 0;
+error:
+	fclose(f);
+	return -1;
+}
+
+// prefixes the messages of the AVRs with the name of their job
+static void
+batch_logger(
+		avr_t * avr,
+		const int level,
+		const char * format,
+		va_list ap)
+{
+	if (avr && avr->log < level)
+		return;
+	char msg[512];
+	vsnprintf(msg, sizeof(msg), format, ap);
+	fprintf(stderr, "%s: %s", current->name, msg);
+}
+
+static void
+uart_out_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	batch_job_t * j = (batch_job_t *)param;
+	if (j->out_size == j->out_alloc) {
+		j->out_alloc = j->out_alloc ? j->out_alloc * 2 : 256;
+		j->out = realloc(j->out, j->out_alloc);
+	}
+	j->out[j->out_size++] = value;
+}
+
+// the UART has room, send what's left of stdin= until it says XOFF
+static void
+uart_xon_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	batch_job_t * j = (batch_job_t *)param;
+	j->xon = 1;
+	while (j->xon && j->in_pos < j->in_size)
+		avr_raise_irq(j->uart + UART_IRQ_INPUT, j->in[j->in_pos++]);
+}
+
+static void
+uart_xoff_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	batch_job_t * j = (batch_job_t *)param;
+	j->xon = 0;
+}
+
+static void
+uart_connect(
+		avr_t * avr,
+		batch_job_t * j)
+{
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~(AVR_UART_FLAG_STDIO | AVR_UART_FLAG_POLL_SLEEP);
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	j->uart = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), 0);
+	if (!j->uart)
+		return;
+	avr_irq_register_notify(j->uart + UART_IRQ_OUTPUT, uart_out_hook, j);
+	if (j->in) {
+		avr_irq_register_notify(j->uart + UART_IRQ_OUT_XON, uart_xon_hook, j);
+		avr_irq_register_notify(j->uart + UART_IRQ_OUT_XOFF, uart_xoff_hook, j);
+	}
+}
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void
+run_job(
+		batch_job_t * j,
+		avr_cycle_count_t cycles)
+{
+	current = j;
+	j->status = "error";
+	j->output = "-";
+	if (batch_firmware_load(j->firmware)) {
+		fprintf(stderr, "%s: Unable to load firmware from file %s\n",
+				j->name, j->firmware->file);
+		return;
+	}
+	/*
+	 * the jobs of a firmware would all write its VCD trace to the same
+	 * file at once, so it goes
+	 */
+	elf_firmware_t fw = j->firmware->f;
+	elf_firmware_t * f = &fw;
+	fw.tracecount = 0;
+	const char * mcu = j->mcu ? j->mcu : f->mmcu;
+	if (j->stdin_file && !(j->in = read_file(j->stdin_file, &j->in_size))) {
+		fprintf(stderr, "%s: Unable to read %s\n", j->name, j->stdin_file);
+		return;
+	}
+	avr_t * avr = avr_make_mcu_by_name(mcu);
+	if (!avr) {
+		fprintf(stderr, "%s: AVR '%s' not known\n", j->name, mcu);
+		return;
+	}
+	avr->logger = batch_logger;
+	uint64_t start = now_usec();
+	avr_init(avr);
+	avr->log = log_level > LOG_TRACE ? LOG_TRACE : log_level;
+	avr_load_firmware(avr, f);
+	if (j->frequency)
+		avr->frequency = j->frequency;
+	if (f->flashbase)
+		avr->pc = f->flashbase;
+	avr_set_time_policy(avr, AVR_TIME_FAST, 1);
+	uart_connect(avr, j);
+	avr_vcd_t input = {0};
+	int vcd = 0;
+	if (j->input) {
+		vcd = !avr_vcd_init_input(avr, j->input, &input);
+		if (!vcd)
+			fprintf(stderr, "%s: Warning: VCD input file %s failed\n",
+					j->name, j->input);
+	}
+
+	if (j->cycles)
+		cycles = j->cycles;
+	int state;
+	if (cycles)
+		state = avr_run_until(avr, cycles, NULL, NULL);
+	else do
+		state = avr_run(avr);
+	while (state != cpu_Done && state != cpu_Crashed);
+	j->status = state == cpu_Done ? "done" :
+			state == cpu_Crashed ? "crashed" : "limit";
+	j->cycle = avr->cycle;
+
+	if (vcd)
+		avr_vcd_close(&input);
+	avr_terminate(avr);
+	j->usec = now_usec() - start;
+
+	if (j->expect) {
+		size_t size;
+		uint8_t * expect = read_file(j->expect, &size);
+		if (!expect)
+			fprintf(stderr, "%s: Unable to read %s\n", j->name, j->expect);
+		j->output = expect && size == j->out_size &&
+				!memcmp(expect, j->out, size) ? "pass" : "fail";
+		free(expect);
+	}
+	free(j->in);
+	free(j->out);
+	j->in = j->out = NULL;
+}
+
+static void *
+worker(
+		void * param)
+{
+	avr_cycle_count_t cycles = *(avr_cycle_count_t *)param;
+	int i;
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < job_count)
+		run_job(&job[i], cycles);
+	return NULL;
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	int workers = 0;
+	avr_cycle_count_t cycles = 0;
+	const char * manifest = NULL;
+	const char * output = NULL;
+
+	for (int pi = 1; pi < argc; pi++) {
+		if (!strcmp(argv[pi], "-h") || !strcmp(argv[pi], "--help")) {
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-j") || !strcmp(argv[pi], "--jobs")) {
+			if (pi < argc-1)
+				workers = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-c") || !strcmp(argv[pi], "--cycles")) {
+			if (pi < argc-1)
+				cycles = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-o") || !strcmp(argv[pi], "--output")) {
+			if (pi < argc-1)
+				output = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-v")) {
+			log_level++;
+		} else if (argv[pi][0] != '-') {
+			manifest = argv[pi];
+		} else
+			display_usage(basename(argv[0]));
+	}
+	if (!manifest)
+		display_usage(basename(argv[0]));
+	if (read_manifest(manifest)) {
+		fprintf(stderr, "%s: Unable to read the manifest %s\n", argv[0], manifest);
+		exit(1);
+	}
+	if (!job_count) {
+		fprintf(stderr, "%s: No jobs in the manifest %s\n", argv[0], manifest);
+		exit(1);
+	}
+	FILE * out = output ? fopen(output, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "%s: Unable to create %s\n", argv[0], output);
+		exit(1);
+	}
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > job_count)
+		workers = job_count;
+	pthread_t thread[workers];
+	for (int i = 0; i < workers; i++)
+		if (pthread_create(&thread[i], NULL, worker, &cycles)) {
+			fprintf(stderr, "%s: Unable to create the workers\n", argv[0]);
+			exit(1);
+		}
+	for (int i = 0; i < workers; i++)
+		pthread_join(thread[i], NULL);
+
+	int failed = 0;
+	for (int i = 0; i < job_count; i++) {
+		batch_job_t * j = &job[i];
+		fprintf(out, "%s\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\n", j->name,
+				j->status, j->output, (uint64_t)j->cycle, j->usec);
+		if (!strcmp(j->status, "error") || !strcmp(j->status, "crashed") ||
+				!strcmp(j->output, "fail"))
+			failed++;
+	}
+	if (out != stdout)
+		fclose(out);
+	return failed ? 1 : 0;
+}
@@ -28,6 +28,8 @@
 #include "sim_core.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
+#include "sim_jit.h"
+#include "sim_trace.h"
 #include "avr_uart.h"
 #include "sim_vcd_file.h"
 #include "avr/avr_mcu_section.h"
@@ -41,6 +43,10 @@ std_logger(
 		const int level,
 		const char * format,
 		va_list ap);
+/*
+ * The only state shared by all the AVRs of the process. It's set once by the
+ * application and read by any of the simulation threads, so it's atomic.
+ */
 static avr_logger_p _avr_global_logger = std_logger;
 
 void
@@ -50,10 +56,12 @@ avr_global_logger(
 		const char * format,
 		... )
 {
+	avr_logger_p logger = avr && avr->logger ? avr->logger :
+			__atomic_load_n(&_avr_global_logger, __ATOMIC_ACQUIRE);
 	va_list args;
 	va_start(args, format);
-	if (_avr_global_logger)
-		_avr_global_logger(avr, level, format, args);
+	if (logger)
+		logger(avr, level, format, args);
 	va_end(args);
 }
 
@@ -61,13 +69,14 @@ void
 avr_global_logger_set(
 		avr_logger_p logger)
 {
-	_avr_global_logger = logger ? logger : std_logger;
+	__atomic_store_n(&_avr_global_logger, logger ? logger : std_logger,
+			__ATOMIC_RELEASE);
 }
 
 avr_logger_p
 avr_global_logger_get(void)
 {
-	return _avr_global_logger;
+	return __atomic_load_n(&_avr_global_logger, __ATOMIC_ACQUIRE);
 }
 
 
@@ -77,12 +86,15 @@ avr_init(
 {
 	avr->flash = malloc(avr->flashend + 1);
 	memset(avr->flash, 0xff, avr->flashend + 1);
+	avr->decode = calloc((avr->flashend + 1) / 2, sizeof(avr_insn_t));
 	avr->codeend = avr->flashend;
 	avr->data = malloc(avr->ramend + 1);
 	memset(avr->data, 0, avr->ramend + 1);
-#ifdef CONFIG_SIMAVR_TRACE
+	avr->data_page = calloc(AVR_DATA_PAGE_COUNT, 1);
+	avr_data_page_set(avr, avr->ramend + 1, 0xffff - avr->ramend,
+			AVR_DATA_PAGE_INVALID);
+	avr_data_page_set(avr, R_SPL, 3, AVR_DATA_PAGE_IO);
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
-#endif
 
 	AVR_LOG(avr, LOG_TRACE, "%s init\n", avr->mmcu);
 
@@ -96,11 +108,13 @@ avr_init(
 	if (avr->init)
 		avr->init(avr);
 	// set default (non gdb) fast callbacks
-	avr->run = avr_callback_run_raw;
+	avr->run = AVR_DEFAULT_RUN;
 	avr->sleep = avr_callback_sleep_raw;
 	// number of address bytes to push/pull on/off the stack
 	avr->address_size = avr->eind ? 3 : 2;
 	avr->log = 1;
+	avr->run_cycle_limit = AVR_DEFAULT_RUN_QUANTUM;
+	avr->irq_pool.clock = &avr->cycle;
 	avr_reset(avr);
 	avr_regbit_set(avr, avr->reset_flags.porf);		// by  default set to power-on reset
 	return 0;
@@ -110,6 +124,9 @@ void
 avr_terminate(
 		avr_t * avr)
 {
+	// deliver the deferred raises while the parts are still there
+	avr_irq_pool_defer(&avr->irq_pool, 0);
+	avr_trace_stop(avr);
 	if (avr->custom.deinit)
 		avr->custom.deinit(avr, avr->custom.data);
 	if (avr->gdb) {
@@ -122,15 +139,33 @@ avr_terminate(
 	}
 	avr_deallocate_ios(avr);
 
+	// the last of the AVRs sharing the flash frees it, see avr_clone()
+	if (avr->flash_refs) {
+		if (__atomic_sub_fetch(avr->flash_refs, 1, __ATOMIC_ACQ_REL))
+			avr->flash = NULL;
+		else
+			free(avr->flash_refs);
+		avr->flash_refs = NULL;
+	}
 	if (avr->flash) free(avr->flash);
+	if (avr->decode) free(avr->decode);
+	avr_jit_terminate(avr);
 	if (avr->data) free(avr->data);
+	if (avr->data_page) free(avr->data_page);
+	avr_cycle_timer_terminate(avr);
+	if (avr->trace_data) {
+		free(avr->trace_data->codeline);
+		free(avr->trace_data);
+		avr->trace_data = NULL;
+	}
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
 		free(avr->io_console_buffer.buf);
 		avr->io_console_buffer.buf = NULL;
 	}
-	avr->flash = avr->data = NULL;
+	avr->flash = avr->data = avr->data_page = NULL;
+	avr->decode = NULL;
 }
 
 void
@@ -146,6 +181,7 @@ avr_reset(
 	avr->pc = avr->reset_pc;	// Likely to be zero
 	for (int i = 0; i < 8; i++)
 		avr->sreg[i] = 0;
+	avr->sreg_lazy.op = AVR_SREG_LAZY_NONE;
 	avr_interrupt_reset(avr);
 	avr_cycle_timer_reset(avr);
 	if (avr->reset)
@@ -227,6 +263,7 @@ avr_loadcode(
 			size, avr->flashend + 1);
 		abort();
 	}
+	avr_invalidate_code(avr, address, size);
 	memcpy(avr->flash + address, code, size);
 }
 
@@ -240,15 +277,31 @@ avr_pending_sleep_usec(
 		avr_t * avr,
 		avr_cycle_count_t howLong)
 {
+	if (avr->time_policy == AVR_TIME_FAST)
+		return 0;
 	avr->sleep_usec += avr_cycles_to_usec(avr, howLong);
-	uint32_t usec = avr->sleep_usec;
+	uint32_t scale = avr->time_policy == AVR_TIME_SCALED && avr->time_scale > 1 ?
+			avr->time_scale : 1;
+	uint32_t usec = avr->sleep_usec / scale;
 	if (usec > 200) {
-		avr->sleep_usec = 0;
+		// what the division left is slept next time
+		avr->sleep_usec -= usec * scale;
 		return usec;
 	}
 	return 0;
 }
 
+void
+avr_set_time_policy(
+		avr_t * avr,
+		uint8_t policy,
+		uint32_t scale)
+{
+	avr->time_policy = policy;
+	avr->time_scale = scale ? scale : 1;
+	avr->sleep_usec = 0;
+}
+
 void
 avr_callback_sleep_gdb(
 		avr_t * avr,
@@ -276,12 +329,17 @@ avr_callback_run_gdb(
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
-#if CONFIG_SIMAVR_TRACE
-		avr_dump_state(avr);
-#endif
+		// breakpoints are checked between calls, so run one
+		// instruction at a time whatever the quantum is
+		avr_cycle_count_t limit = avr->run_cycle_limit;
+		avr->run_cycle_limit = avr->run_cycle_count = 1;
+		new_pc = avr_core_traced(avr) ? avr_run_one_trace(avr) : avr_run_one(avr);
+		avr->run_cycle_limit = limit;
 	}
 
+	// deliver the deferred IRQ raises, if any, before the timers run
+	if (avr->irq_pool.defer)
+		avr_irq_pool_flush(&avr->irq_pool);
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
@@ -322,19 +380,25 @@ avr_callback_sleep_raw(
 	}
 }
 
-void
-avr_callback_run_raw(
-		avr_t * avr)
+/*
+ * Common part of the "raw" run callbacks, run_one is the instruction
+ * core to use; this is inlined so the call to it is direct. The traced
+ * core replaces it while any trace is on.
+ */
+static inline __attribute__((always_inline)) void
+_avr_callback_run(
+		avr_t * avr,
+		avr_flashaddr_t (*run_one)(avr_t * avr))
 {
 	avr_flashaddr_t new_pc = avr->pc;
 
-	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
-#if CONFIG_SIMAVR_TRACE
-		avr_dump_state(avr);
-#endif
-	}
+	if (avr->state == cpu_Running)
+		new_pc = unlikely(avr_core_traced(avr)) ?
+				avr_run_one_trace(avr) : run_one(avr);
 
+	// deliver the deferred IRQ raises, if any, before the timers run
+	if (avr->irq_pool.defer)
+		avr_irq_pool_flush(&avr->irq_pool);
 	// run the cycle timers, get the suggested sleep time
 	// until the next timer is due
 	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
@@ -364,6 +428,32 @@ avr_callback_run_raw(
 	}
 }
 
+void
+avr_callback_run_raw(
+		avr_t * avr)
+{
+	_avr_callback_run(avr, avr_run_one);
+}
+
+void
+avr_callback_run_threaded(
+		avr_t * avr)
+{
+	_avr_callback_run(avr, avr_run_one_threaded);
+}
+
+void
+avr_callback_run_jit(
+		avr_t * avr)
+{
+	if (unlikely(!avr->jit) && avr_jit_init(avr)) {
+		// no translator for this host, use the interpreter
+		avr->run = avr_callback_run_raw;
+		avr_callback_run_raw(avr);
+		return;
+	}
+	_avr_callback_run(avr, avr_run_one_jit);
+}
 
 int
 avr_run(
@@ -373,6 +463,56 @@ avr_run(
 	return avr->state;
 }
 
+/*
+ * This is only there so the core, and any sleep, stops on time
+ */
+static avr_cycle_count_t
+_avr_run_until_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+int
+avr_run_until(
+		avr_t * avr,
+		avr_cycle_count_t cycle,
+		avr_run_stop_t stop,
+		void * param)
+{
+	if (avr->cycle < cycle)
+		avr_cycle_timer_register(avr, cycle - avr->cycle,
+				_avr_run_until_timer, NULL);
+	while (avr->cycle < cycle &&
+			(avr->state == cpu_Running || avr->state == cpu_Sleeping)) {
+		avr->run(avr);
+		if (stop && stop(avr, param))
+			break;
+	}
+	avr_cycle_timer_cancel(avr, _avr_run_until_timer, NULL);
+	return avr->state;
+}
+
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t cycles)
+{
+	return avr_run_until(avr, avr->cycle + cycles, NULL, NULL);
+}
+
+void
+avr_set_run_quantum(
+		avr_t * avr,
+		avr_cycle_count_t cycles)
+{
+	avr->run_cycle_limit = cycles ? cycles : 1;
+	if (avr->run_cycle_count > avr->run_cycle_limit)
+		avr->run_cycle_count = avr->run_cycle_limit;
+}
+
 avr_t *
 avr_core_allocate(
 		const avr_t * core,
@@ -380,6 +520,7 @@ avr_core_allocate(
 {
 	uint8_t * b = malloc(coreLen);
 	memcpy(b, core, coreLen);
+	((avr_t *)b)->core_size = coreLen;
 	return (avr_t *)b;
 }
 
@@ -36,6 +36,7 @@ extern "C" {
 	#define FALLTHROUGH
 #endif
 
+#include <stdarg.h>
 #include "sim_irq.h"
 #include "sim_interrupts.h"
 #include "sim_cmds.h"
@@ -72,6 +73,31 @@ enum {
 #define AVR_DATA_TO_IO(v) ((v) - 32)
 #define AVR_IO_TO_DATA(v) ((v) + 32)
 
+/*
+ * The data space is split in small pages, each with a set of flags. The
+ * core accesses pages without flags directly in avr->data, the others
+ * go through the IO callbacks, watchpoints, and range checks.
+ */
+#define AVR_DATA_PAGE_SHIFT	5
+#define AVR_DATA_PAGE_COUNT	(0x10000 >> AVR_DATA_PAGE_SHIFT)
+enum {
+	AVR_DATA_PAGE_IO		= (1 << 0),	// IO callbacks, IRQs, or SREG/SP
+	AVR_DATA_PAGE_WATCH		= (1 << 1),	// gdb watchpoint
+	AVR_DATA_PAGE_INVALID	= (1 << 2),	// (partly) beyond ramend
+};
+
+// default avr->run_cycle_limit, the core returns from avr_run() at least
+// this often, even with no cycle timer due
+#ifndef AVR_DEFAULT_RUN_QUANTUM
+#define AVR_DEFAULT_RUN_QUANTUM	1000
+#endif
+
+/*
+ * Type for custom logging functions
+ */
+struct avr_t;
+typedef void (*avr_logger_p)(struct avr_t* avr, const int level, const char * format, va_list ap);
+
 /**
  * Logging macros and associated log levels.
  * The current log level is kept in avr->log.
@@ -112,7 +138,7 @@ enum {
 	cpu_Crashed,    // avr software crashed (watchdog fired)
 };
 
-// this is only ever used if CONFIG_SIMAVR_TRACE is defined
+// state of the avr->trace printf trace, used by the traced core only
 struct avr_trace_data_t {
 	struct avr_symbol_t ** codeline;
 
@@ -127,6 +153,7 @@ struct avr_trace_data_t {
 		uint16_t sp;
 	} old[OLD_PC_SIZE]; // catches reset..
 	int			old_pci;
+	int			donttrace;	// in a function that isn't traced
 
 #if AVR_STACK_WATCH
 	#define STACK_FRAME_SIZE	32
@@ -193,14 +220,26 @@ typedef struct avr_t {
 	// these next two allow the core to freely run between cycle timers and also allows
 	// for a maximum run cycle limit... run_cycle_count is set during cycle timer processing.
 	avr_cycle_count_t	run_cycle_count;	// cycles to run before next timer
-	avr_cycle_count_t	run_cycle_limit;	// maximum run cycle interval limit
+	avr_cycle_count_t	run_cycle_limit;	// maximum run cycle interval limit, see avr_set_run_quantum()
 
 	/**
 	 * Sleep requests are accumulated in sleep_usec until the minimum sleep value
-	 * is reached, at which point sleep_usec is cleared and the sleep request
-	 * is passed on to the operating system.
+	 * is reached, at which point the sleep request is taken out of sleep_usec
+	 * and passed on to the operating system.
 	 */
 	uint32_t 			sleep_usec;
+	// how the sleeps translate into host time, see avr_set_time_policy()
+	uint8_t				time_policy;
+	uint32_t			time_scale;
+	/*
+	 * When set, polling loops that can't see anything change before the
+	 * next cycle timer are skipped over, see _avr_idle_skip() in sim_core.c
+	 */
+	uint8_t				idle_skip;
+	struct {
+		avr_flashaddr_t	pc;			// last loop found not to be idle
+		uint8_t			backoff;	// turns to wait before trying it again
+	} idle;
 
 	// called at init time
 	void (*init)(struct avr_t * avr);
@@ -242,6 +281,12 @@ typedef struct avr_t {
 	// in the opcode decoder.
 	// This array is re-synthesized back/forth when SREG changes
 	uint8_t		sreg[8];
+	// Last ALU operation whose flags are not in sreg[] yet, see
+	// avr_sreg_sync() in sim_core.h
+	struct {
+		uint8_t		op;
+		uint8_t		res, rd, rr;
+	} sreg_lazy;
 
 	/* Interrupt state:
 		00: idle (no wait, no pending interrupts) or disabled
@@ -271,12 +316,18 @@ typedef struct avr_t {
 	 * allocate this table dynamically.
 	 * If you wanted to emulate the BIG AVRs, and XMegas, this would need
 	 * work.
+	 * The r and w callbacks are called directly when a register has only
+	 * one handler. When several modules share a register (the tiny85 has
+	 * registers with bits used by different IO modules, boards add tracing
+	 * or coverage) a dispatcher is installed there instead, and its param
+	 * is the array of all the handlers, see sim_io.c
 	 */
 	struct {
 		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
 		struct {
 			void * param;
 			avr_io_read_t c;
+			uint8_t idle;	// c can be skipped in idle loops, see avr_register_io_read_idle()
 		} r;
 		struct {
 			void * param;
@@ -284,31 +335,26 @@ typedef struct avr_t {
 		} w;
 	} io[MAX_IOs];
 
-	/*
-	 * This block allows sharing of the IO write/read on addresses between
-	 * multiple callbacks. In 99% of case it's not needed, however on the tiny*
-	 * (tiny85 at last) some registers have bits that are used by different
-	 * IO modules.
-	 * If this case is detected, a special "dispatch" callback is installed that
-	 * will handle this particular case, without impacting the performance of the
-	 * other, normal cases...
-	 */
-	int				io_shared_io_count;
-	struct {
-		int used;
-		struct {
-			void * param;
-			void * c;
-		} io[4];
-	} io_shared_io[4];
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *		flash;
+	// set while the flash is shared with clones, the number of AVRs using
+	// it. avr_invalidate_code() gives the AVR its own copy, see avr_clone()
+	int *			flash_refs;
+	// predecoded instructions, one per flash word (see sim_core.h)
+	struct avr_insn_t *	decode;
+	// block translator state, if avr_callback_run_jit is used (see sim_jit.h)
+	struct avr_jit_t *	jit;
 	// this is the general purpose registers, IO registers, and SRAM
 	uint8_t *		data;
+	// AVR_DATA_PAGE_* flags for each page of data
+	uint8_t *		data_page;
 
 	// queue of io modules
 	struct avr_io_t * io_port;
+	// size of the core struct this avr_t starts, with the io modules
+	// it contains, set by avr_core_allocate()
+	uint32_t		core_size;
 
 	// Builtin and user-defined commands
 	avr_cmd_table_t commands;
@@ -317,12 +363,18 @@ typedef struct avr_t {
 	// interrupt vectors and delivery fifo
 	avr_int_table_t	interrupts;
 
-	// DEBUG ONLY -- value ignored if CONFIG_SIMAVR_TRACE = 0
+	// DEBUG ONLY -- prints every instruction, the run callbacks switch
+	// to the traced core while it's set, see avr_core_traced()
 	uint8_t	trace : 1,
 			log : 4; // log level, default to 1
+	// logs the messages of this AVR, when set, in place of the global logger
+	avr_logger_p	logger;
 
-	// Only used if CONFIG_SIMAVR_TRACE is defined
 	struct avr_trace_data_t *trace_data;
+	// binary trace, see sim_trace.h. trace_rec is the record of the
+	// instruction that runs, while the tracing engine runs it
+	struct avr_trace_ring_t * trace_ring;
+	struct avr_trace_rec_t * trace_rec;
 
 	// VALUE CHANGE DUMP file (waveforms)
 	// this is the VCD file that gets allocated if the
@@ -378,10 +430,46 @@ avr_core_allocate(
 void
 avr_reset(
 		avr_t * avr);
-// run one cycle of the AVR, sleep if necessary
+// run one instruction of the AVR, or several, up to the run quantum;
+// sleep if necessary
 int
 avr_run(
 		avr_t * avr);
+/*
+ * Optional stop condition for avr_run_until(), return nonzero to stop
+ */
+typedef int (*avr_run_stop_t)(
+		avr_t * avr,
+		void * param);
+/*
+ * Keeps running the AVR until avr->cycle reaches 'cycle', the core stops
+ * running (cpu_Done, cpu_Crashed, cpu_Stopped...) or stop() returns nonzero.
+ * stop() can be NULL; it is called after each run quantum, so set the
+ * quantum to 1 if it needs to see every instruction.
+ * Returns the avr state.
+ */
+int
+avr_run_until(
+		avr_t * avr,
+		avr_cycle_count_t cycle,
+		avr_run_stop_t stop,
+		void * param);
+// same as avr_run_until(), for 'cycles' cycles from now, with no stop condition
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t cycles);
+/*
+ * Sets the run quantum, the maximum number of cycles avr_run() runs before
+ * returning. The core always stops before a cycle timer is due or an
+ * interrupt is raised, so this doesn't change the simulation, only how
+ * often the caller gets control back. 1 means one instruction per call,
+ * the default is AVR_DEFAULT_RUN_QUANTUM.
+ */
+void
+avr_set_run_quantum(
+		avr_t * avr,
+		avr_cycle_count_t cycles);
 // finish any pending operations
 void
 avr_terminate(
@@ -408,6 +496,29 @@ avr_loadcode(
 		uint8_t * code,
 		uint32_t size,
 		avr_flashaddr_t address);
+// flush the predecoded instructions covering a range of flash. This needs
+// to be called by anything that writes avr->flash directly after the core
+// started running, before writing it: the flash might be shared with clones
+// until then (avr_loadcode() and SPM do it already)
+void
+avr_invalidate_code(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size);
+// set/clear AVR_DATA_PAGE_* flags on the pages covering a range of
+// the data space
+void
+avr_data_page_set(
+		avr_t * avr,
+		uint32_t address,
+		uint32_t size,
+		uint8_t flags);
+void
+avr_data_page_clear(
+		avr_t * avr,
+		uint32_t address,
+		uint32_t size,
+		uint8_t flags);
 
 /*
  * These are accessors for avr->data but allows watchpoints to be set for gdb
@@ -441,21 +552,16 @@ avr_global_logger(
 		const char * format,
 		... );
 
-#ifndef AVR_CORE
-#include <stdarg.h>
 /*
- * Type for custom logging functions
+ * Sets a global logging function in place of the default, for the AVRs
+ * that don't have their own (avr->logger)
  */
-typedef void (*avr_logger_p)(struct avr_t* avr, const int level, const char * format, va_list ap);
-
-/* Sets a global logging function in place of the default */
 void
 avr_global_logger_set(
 		avr_logger_p logger);
 /* Gets the current global logger function */
 avr_logger_p
 avr_global_logger_get(void);
-#endif
 
 /*
  * These are callbacks for the two 'main' behaviour in simavr
@@ -464,12 +570,48 @@ void avr_callback_sleep_gdb(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_gdb(avr_t * avr);
 void avr_callback_sleep_raw(avr_t * avr, avr_cycle_count_t howLong);
 void avr_callback_run_raw(avr_t * avr);
+// same as avr_callback_run_raw, using the threaded instruction dispatch
+void avr_callback_run_threaded(avr_t * avr);
+// same as avr_callback_run_raw, running hot code with the block translator
+void avr_callback_run_jit(avr_t * avr);
+
+/*
+ * The "raw" run callback installed by avr_init(). The threaded core is
+ * selected at build time with CONFIG_SIMAVR_THREADED_CORE, and the block
+ * translator with CONFIG_SIMAVR_JIT; they are all always available, so a
+ * program can also pick one by setting avr->run after avr_init().
+ */
+#if CONFIG_SIMAVR_JIT
+#define AVR_DEFAULT_RUN avr_callback_run_jit
+#elif CONFIG_SIMAVR_THREADED_CORE
+#define AVR_DEFAULT_RUN avr_callback_run_threaded
+#else
+#define AVR_DEFAULT_RUN avr_callback_run_raw
+#endif
+
+/*
+ * Time policies. These only matter when the AVR sleeps: the simulation
+ * always jumps to the next cycle timer, the policy tells if the host
+ * waits for the corresponding time too.
+ */
+enum {
+	AVR_TIME_REALTIME = 0,	// the host sleeps as long as the AVR (default)
+	AVR_TIME_FAST,			// the host never sleeps
+	AVR_TIME_SCALED,		// the host sleeps 1/time_scale of the AVR time
+};
+
+void
+avr_set_time_policy(
+		avr_t * avr,
+		uint8_t policy,
+		uint32_t scale);
 
 /**
  * Accumulates sleep requests (and returns a sleep time of 0) until
  * a minimum count of requested sleep microseconds are reached
  * (low amounts cannot be handled accurately).
- * This function is an utility function for the sleep callbacks
+ * This function is an utility function for the sleep callbacks, it
+ * applies the time policy, and returns 0 in AVR_TIME_FAST.
  */
 uint32_t
 avr_pending_sleep_usec(
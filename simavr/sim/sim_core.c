@@ -19,6 +19,30 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * This file is compiled twice into libsimavr. The plain build is the core
+ * everything runs on by default; it has no tracing code at all. The second
+ * build, sim_core_trace.c, defines AVR_CORE_TRACE and only keeps the
+ * instruction handlers and avr_run_one_trace(), with the tracing added:
+ * the avr->trace printf trace, and the sim_trace.h binary trace records.
+ * The run callbacks switch an avr_t to it while either of them is on,
+ * see avr_core_traced().
+ */
+#ifndef AVR_CORE_TRACE
+#define AVR_CORE_TRACE 0
+#endif
+
+#if AVR_CORE_TRACE
+/*
+ * The exported helpers the handlers use get a copy of their own in the
+ * traced build, so they trace too
+ */
+#define _avr_sp_get		_avr_sp_get_trace
+#define _avr_sp_set		_avr_sp_set_trace
+#define _avr_push_addr	_avr_push_addr_trace
+#define _avr_pop_addr	_avr_pop_addr_trace
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,18 +50,20 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_jit.h"
+#include "sim_trace.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
 
-// SREG bit names
-const char * _sreg_bit_name = "cznvshti";
-
 /*
  * Handle "touching" registers, marking them changed.
  * This is used only for debugging purposes to be able to
  * print the effects of each instructions on registers
  */
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
+
+// SREG bit names
+static const char * _sreg_bit_name = "cznvshti";
 
 #define T(w) w
 
@@ -48,7 +74,7 @@ const char * _sreg_bit_name = "cznvshti";
  * This allows a "special case" to skip instruction tracing when in these
  * symbols since printf() is useful to have, but generates a lot of cycles.
  */
-int dont_trace(const char * name)
+static int dont_trace(const char * name)
 {
 	return (
 		!strcmp(name, "uart_putchar") ||
@@ -60,46 +86,30 @@ int dont_trace(const char * name)
 		!strcmp(name, "__epilogue_restores__"));
 }
 
-int donttrace = 0;
+void crash(avr_t* avr);		// in the plain build
 
 #define STATE(_f, args...) { \
 	if (avr->trace) {\
 		if (avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {\
 			const char * symn = avr->trace_data->codeline[avr->pc>>1]->symbol; \
 			int dont = 0 && dont_trace(symn);\
-			if (dont!=donttrace) { \
-				donttrace = dont;\
+			if (dont != avr->trace_data->donttrace) { \
+				avr->trace_data->donttrace = dont;\
 				DUMP_REG();\
 			}\
-			if (donttrace==0)\
+			if (avr->trace_data->donttrace == 0)\
 				printf("%04x: %-25s " _f, avr->pc, symn, ## args);\
 		} else \
 			printf("%s: %04x: " _f, __FUNCTION__, avr->pc, ## args);\
 		}\
 	}
-#define SREG() if (avr->trace && donttrace == 0) {\
+#define SREG() if (avr->trace && avr->trace_data->donttrace == 0) {\
+	avr_sreg_sync(avr); \
 	printf("%04x: \t\t\t\t\t\t\t\t\tSREG = ", avr->pc); \
 	for (int _sbi = 0; _sbi < 8; _sbi++)\
 		printf("%c", avr->sreg[_sbi] ? toupper(_sreg_bit_name[_sbi]) : '.');\
 	printf("\n");\
 }
-
-void crash(avr_t* avr)
-{
-	DUMP_REG();
-	printf("*** CYCLE %" PRI_avr_cycle_count "PC %04x\n", avr->cycle, avr->pc);
-
-	for (int i = OLD_PC_SIZE-1; i > 0; i--) {
-		int pci = (avr->trace_data->old_pci + i) & 0xf;
-		printf(FONT_RED "*** %04x: %-25s RESET -%d; sp %04x\n" FONT_DEFAULT,
-				avr->trace_data->old[pci].pc, avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->old[pci].pc>>1]->symbol : "unknown", OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
-	}
-
-	printf("Stack Ptr %04x/%04x = %d \n", _avr_sp_get(avr), avr->ramend, avr->ramend - _avr_sp_get(avr));
-	DUMP_STACK();
-
-	avr_sadly_crashed(avr, 0);
-}
 #else
 #define T(w)
 #define REG_TOUCH(a, r)
@@ -108,8 +118,20 @@ void crash(avr_t* avr)
 
 void crash(avr_t* avr)
 {
-	avr_sadly_crashed(avr, 0);
+	if (avr->trace) {
+		DUMP_REG();
+		printf("*** CYCLE %" PRI_avr_cycle_count "PC %04x\n", avr->cycle, avr->pc);
+
+		for (int i = OLD_PC_SIZE-1; i > 0; i--) {
+			int pci = (avr->trace_data->old_pci + i) & 0xf;
+			printf(FONT_RED "*** %04x: %-25s RESET -%d; sp %04x\n" FONT_DEFAULT,
+					avr->trace_data->old[pci].pc, avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->old[pci].pc>>1]->symbol : "unknown", OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
+		}
 
+		printf("Stack Ptr %04x/%04x = %d \n", _avr_sp_get(avr), avr->ramend, avr->ramend - _avr_sp_get(avr));
+		DUMP_STACK();
+	}
+	avr_sadly_crashed(avr, 0);
 }
 #endif
 
@@ -121,6 +143,45 @@ _avr_flash_read16le(
 	return(avr->flash[addr] | (avr->flash[addr + 1] << 8));
 }
 
+#if AVR_CORE_TRACE
+/*
+ * Binary trace of the data space accesses, while avr_run_one_trace() runs
+ * an instruction: the first write, or the first read if none. The
+ * accessors below call these, in the traced build only.
+ */
+static void
+_avr_trace_record(
+		avr_t * avr,
+		uint16_t addr,
+		uint8_t v,
+		uint8_t kind)
+{
+	avr_trace_rec_t * rec = avr->trace_rec;
+	if (!rec || (rec->flags & (AVR_TRACE_WRITE | kind)))
+		return;
+	rec->addr = addr;
+	rec->value = v;
+	rec->flags |= kind;
+}
+
+static inline uint8_t
+_avr_trace_read(
+		avr_t * avr,
+		uint16_t addr,
+		uint8_t v)
+{
+	_avr_trace_record(avr, addr, v, AVR_TRACE_READ);
+	return v;
+}
+
+#define _avr_trace_write(_avr, _addr, _v) \
+	_avr_trace_record(_avr, _addr, _v, AVR_TRACE_WRITE)
+#else
+#define _avr_trace_read(_avr, _addr, _v) (_v)
+#define _avr_trace_write(_avr, _addr, _v)
+#endif
+
+#if !AVR_CORE_TRACE
 void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 {
 	if (addr > avr->ramend) {
@@ -154,7 +215,6 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	if (avr->gdb) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
-
 	avr->data[addr] = v;
 }
 
@@ -172,9 +232,31 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 	if (avr->gdb) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_READ);
 	}
-
 	return avr->data[addr];
 }
+#endif
+
+/*
+ * Set a general purpose register (r < 32), that's most of the
+ * instructions destinations, and they never need any of the checks below
+ */
+static inline void _avr_set_reg(avr_t * avr, uint8_t r, uint8_t v)
+{
+	REG_TOUCH(avr, r);
+	avr->data[r] = v;
+}
+
+static inline void _avr_set_reg16le(avr_t * avr, uint8_t r, uint16_t v)
+{
+	_avr_set_reg(avr, r, v);
+	_avr_set_reg(avr, r + 1, v >> 8);
+}
+
+static inline void _avr_set_reg16le_hl(avr_t * avr, uint8_t r, uint16_t v)
+{
+	_avr_set_reg(avr, r + 1, v >> 8);
+	_avr_set_reg(avr, r , v);
+}
 
 /*
  * Set a register (r < 256)
@@ -199,8 +281,7 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 			avr->data[r] = v;
 		if (avr->io[io].irq) {
 			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
+			avr_raise_irq_bits(avr->io[io].irq, v, 0xff);
 		}
 	} else
 		avr->data[r] = v;
@@ -216,16 +297,6 @@ _avr_set_r16le(
 	_avr_set_r(avr, r + 1, v >> 8);
 }
 
-static inline void
-_avr_set_r16le_hl(
-	avr_t * avr,
-	uint16_t r,
-	uint16_t v)
-{
-	_avr_set_r(avr, r + 1, v >> 8);
-	_avr_set_r(avr, r , v);
-}
-
 /*
  * Stack pointer access
  */
@@ -240,10 +311,30 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
 }
 
 /*
- * Set any address to a value; split between registers and SRAM
+ * True if addr can be accessed directly, ie it's in a page with no IO
+ * callbacks, no watchpoints, and within ramend
+ */
+static inline int _avr_is_plain_ram(avr_t * avr, uint16_t addr)
+{
+#if AVR_STACK_WATCH
+	return 0;	// avr_core_watch_write() checks the stack frames
+#else
+	return avr->data_page[addr >> AVR_DATA_PAGE_SHIFT] == 0;
+#endif
+}
+
+/*
+ * Set any address to a value; split between registers and SRAM.
+ * Forced inline, it's the stores and the pushes fast path
  */
-static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
+static inline __attribute__((always_inline)) void
+_avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
 {
+	_avr_trace_write(avr, addr, v);
+	if (_avr_is_plain_ram(avr, addr)) {
+		avr->data[addr] = v;
+		return;
+	}
 	if (addr < MAX_IOs + 31)
 		_avr_set_r(avr, addr, v);
 	else
@@ -255,6 +346,8 @@ static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
  */
 static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 {
+	if (_avr_is_plain_ram(avr, addr))
+		return _avr_trace_read(avr, addr, avr->data[addr]);
 	if (addr == R_SREG) {
 		/*
 		 * SREG is special it's reconstructed when read
@@ -271,11 +364,10 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 		if (avr->io[io].irq) {
 			uint8_t v = avr->data[addr];
 			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
+			avr_raise_irq_bits(avr->io[io].irq, v, 0xff);
 		}
 	}
-	return avr_core_watch_read(avr, addr);
+	return _avr_trace_read(avr, addr, avr_core_watch_read(avr, addr));
 }
 
 /*
@@ -319,52 +411,64 @@ avr_flashaddr_t _avr_pop_addr(avr_t * avr)
 	return res;
 }
 
+#if !AVR_CORE_TRACE
 /*
- * "Pretty" register names
+ * "Pretty" register names, all made at compile time as the traced cores
+ * of several threads read them
  */
-const char * reg_names[255] = {
-		[R_XH] = "XH", [R_XL] = "XL",
-		[R_YH] = "YH", [R_YL] = "YL",
-		[R_ZH] = "ZH", [R_ZL] = "ZL",
-		[R_SPH] = "SPH", [R_SPL] = "SPL",
-		[R_SREG] = "SREG",
+#define REG_IO(h, l)	"io:" #h #l
+#define REG_IO16(h) \
+	REG_IO(h,0), REG_IO(h,1), REG_IO(h,2), REG_IO(h,3), \
+	REG_IO(h,4), REG_IO(h,5), REG_IO(h,6), REG_IO(h,7), \
+	REG_IO(h,8), REG_IO(h,9), REG_IO(h,a), REG_IO(h,b), \
+	REG_IO(h,c), REG_IO(h,d), REG_IO(h,e), REG_IO(h,f)
+
+static const char * const reg_names[256] = {
+	"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+	"r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23",
+	"r24", "r25", "XL", "XH", "YL", "YH", "ZL", "ZH",
+	REG_IO16(2), REG_IO16(3), REG_IO16(4),
+	REG_IO(5,0), REG_IO(5,1), REG_IO(5,2), REG_IO(5,3),
+	REG_IO(5,4), REG_IO(5,5), REG_IO(5,6), REG_IO(5,7),
+	REG_IO(5,8), REG_IO(5,9), REG_IO(5,a), REG_IO(5,b),
+	REG_IO(5,c), "SPL", "SPH", "SREG",
+	REG_IO16(6), REG_IO16(7), REG_IO16(8), REG_IO16(9),
+	REG_IO16(a), REG_IO16(b), REG_IO16(c), REG_IO16(d),
+	REG_IO16(e), REG_IO16(f),
 };
-
+#undef REG_IO16
+#undef REG_IO
 
 const char * avr_regname(uint8_t reg)
 {
-	if (!reg_names[reg]) {
-		char tt[16];
-		if (reg < 32)
-			sprintf(tt, "r%d", reg);
-		else
-			sprintf(tt, "io:%02x", reg);
-		reg_names[reg] = strdup(tt);
-	}
 	return reg_names[reg];
 }
+#endif
 
 /*
  * Called when an invalid opcode is decoded
  */
 static void _avr_invalid_opcode(avr_t * avr)
 {
-#if CONFIG_SIMAVR_TRACE
-	printf( FONT_RED "*** %04x: %-25s Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
-			avr->pc, avr->trace_data->codeline[avr->pc>>1]->symbol, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
-#else
+#if AVR_CORE_TRACE
+	if (avr->trace && avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {
+		printf( FONT_RED "*** %04x: %-25s Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
+				avr->pc, avr->trace_data->codeline[avr->pc>>1]->symbol, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
+		return;
+	}
+#endif
 	AVR_LOG(avr, LOG_ERROR, FONT_RED "CORE: *** %04x: Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
 			avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
-#endif
 }
 
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
 /*
  * Dump changed registers when tracing
  */
 void avr_dump_state(avr_t * avr)
 {
-	if (!avr->trace || donttrace)
+	if (!avr->trace || avr->trace_data->donttrace)
 		return;
 
 	int doit = 0;
@@ -390,77 +494,84 @@ void avr_dump_state(avr_t * avr)
 }
 #endif
 
-#define get_d5(o) \
-		const uint8_t d = (o >> 4) & 0x1f;
+/*
+ * Operand extraction, used by the decoder to fill the avr_insn_t fields
+ */
+#define dec_d5(o)	(((o) >> 4) & 0x1f)
+#define dec_r5(o)	((((o) >> 5) & 0x10) | ((o) & 0xf))
+#define dec_a6(o)	((((((o) >> 9) & 3) << 4) | ((o) & 0xf)) + 32)
+#define dec_h4(o)	(16 + (((o) >> 4) & 0xf))
+#define dec_k8(o)	((((o) & 0x0f00) >> 4) | ((o) & 0xf))
+#define dec_q6(o)	((((o) & 0x2000) >> 8) | (((o) & 0x0c00) >> 7) | ((o) & 0x7))
+#define dec_io5(o)	((((o) >> 3) & 0x1f) + 32)
+#define dec_p2(o)	(24 + (((o) >> 3) & 0x6))
+#define dec_k6(o)	((((o) & 0x00c0) >> 2) | ((o) & 0xf))
+#define dec_sreg_bit(o)	(((o) >> 4) & 7)
+
+/*
+ * Operand accessors for the instruction handlers. The operands were
+ * extracted by the decoder and are read back from the avr_insn_t 'i'
+ */
+#define get_d5() \
+		const uint8_t d = i->d;
 
-#define get_vd5(o) \
-		get_d5(o) \
+#define get_vd5() \
+		get_d5() \
 		const uint8_t vd = avr->data[d];
 
-#define get_r5(o) \
-		const uint8_t r = ((o >> 5) & 0x10) | (o & 0xf);
+#define get_r5() \
+		const uint8_t r = i->r;
 
-#define get_d5_a6(o) \
-		get_d5(o); \
-		const uint8_t A = ((((o >> 9) & 3) << 4) | ((o) & 0xf)) + 32;
+#define get_d5_a6() \
+		get_d5(); \
+		const uint8_t A = i->k;
 
-#define get_vd5_s3(o) \
-		get_vd5(o); \
-		const uint8_t s = o & 7;
+#define get_vd5_s3() \
+		get_vd5(); \
+		const uint8_t s = i->r;
 
-#define get_vd5_s3_mask(o) \
-		get_vd5_s3(o); \
+#define get_vd5_s3_mask() \
+		get_vd5_s3(); \
 		const uint8_t mask = 1 << s;
 
-#define get_vd5_vr5(o) \
-		get_r5(o); \
-		get_d5(o); \
+#define get_vd5_vr5() \
+		get_r5(); \
+		get_d5(); \
 		const uint8_t vd = avr->data[d], vr = avr->data[r];
 
-#define get_d5_vr5(o) \
-		get_d5(o); \
-		get_r5(o); \
+#define get_d5_vr5() \
+		get_d5(); \
+		get_r5(); \
 		const uint8_t vr = avr->data[r];
 
-#define get_h4_k8(o) \
-		const uint8_t h = 16 + ((o >> 4) & 0xf); \
-		const uint8_t k = ((o & 0x0f00) >> 4) | (o & 0xf);
+#define get_h4_k8() \
+		const uint8_t h = i->d; \
+		const uint8_t k = i->k;
 
-#define get_vh4_k8(o) \
-		get_h4_k8(o) \
+#define get_vh4_k8() \
+		get_h4_k8() \
 		const uint8_t vh = avr->data[h];
 
-#define get_d5_q6(o) \
-		get_d5(o) \
-		const uint8_t q = ((o & 0x2000) >> 8) | ((o & 0x0c00) >> 7) | (o & 0x7);
+#define get_d5_q6() \
+		get_d5() \
+		const uint8_t q = i->k;
 
-#define get_io5(o) \
-		const uint8_t io = ((o >> 3) & 0x1f) + 32;
+#define get_io5_b3mask() \
+		const uint8_t io = i->d; \
+		const uint8_t mask = i->r;
 
-#define get_io5_b3(o) \
-		get_io5(o); \
-		const uint8_t b = o & 0x7;
+#define get_o12() \
+		const int16_t o = (int16_t)i->k;
 
-#define get_io5_b3mask(o) \
-		get_io5(o); \
-		const uint8_t mask = 1 << (o & 0x7);
-
-//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
-#define get_o12(op) \
-		const int16_t o = ((int16_t)((op << 4) & 0xffff)) >> 3;
-
-#define get_vp2_k6(o) \
-		const uint8_t p = 24 + ((o >> 3) & 0x6); \
-		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf); \
+#define get_vp2_k6() \
+		const uint8_t p = i->d; \
+		const uint8_t k = i->k; \
 		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
 
-#define get_sreg_bit(o) \
-		const uint8_t b = (o >> 4) & 7;
-
 /*
  * Add a "jump" address to the jump trace buffer
  */
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
 #define TRACE_JUMP()\
 	avr->trace_data->old[avr->trace_data->old_pci].pc = avr->pc;\
 	avr->trace_data->old[avr->trace_data->old_pci].sp = _avr_sp_get(avr);\
@@ -478,7 +589,7 @@ void avr_dump_state(avr_t * avr)
 #define STACK_FRAME_PUSH()
 #define STACK_FRAME_POP()
 #endif
-#else /* CONFIG_SIMAVR_TRACE */
+#else /* AVR_CORE_TRACE */
 
 #define TRACE_JUMP()
 #define STACK_FRAME_PUSH()
@@ -589,6 +700,55 @@ _avr_flags_znv0s (struct avr_t * avr, uint8_t res)
 	_avr_flags_zns(avr, res);
 }
 
+static inline void
+_avr_flags_eval (struct avr_t * avr, uint8_t op, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	switch (op) {
+		case AVR_SREG_LAZY_LOGIC:
+			_avr_flags_znv0s(avr, res);
+			break;
+		case AVR_SREG_LAZY_ADD:
+			_avr_flags_add_zns(avr, res, rd, rr);
+			break;
+		case AVR_SREG_LAZY_SUB:
+			_avr_flags_sub_zns(avr, res, rd, rr);
+			break;
+		case AVR_SREG_LAZY_SUB_R:
+			_avr_flags_sub_Rzns(avr, res, rd, rr);
+			break;
+	}
+}
+
+#if !AVR_CORE_TRACE
+void
+_avr_sreg_flush(avr_t * avr)
+{
+	_avr_flags_eval(avr, avr->sreg_lazy.op,
+			avr->sreg_lazy.res, avr->sreg_lazy.rd, avr->sreg_lazy.rr);
+	avr->sreg_lazy.op = AVR_SREG_LAZY_NONE;
+}
+#endif
+
+/*
+ * Record the flags of an ALU operation. Any of these overwrites all the
+ * flags of a previous one, except a logic op that leaves H and C alone,
+ * so the previous one has to be computed first.
+ */
+static inline void
+_avr_flags_lazy (struct avr_t * avr, uint8_t op, uint8_t res, uint8_t rd, uint8_t rr)
+{
+#if CONFIG_SIMAVR_LAZY_SREG
+	if (op == AVR_SREG_LAZY_LOGIC && avr->sreg_lazy.op > AVR_SREG_LAZY_LOGIC)
+		_avr_sreg_flush(avr);
+	avr->sreg_lazy.op = op;
+	avr->sreg_lazy.res = res;
+	avr->sreg_lazy.rd = rd;
+	avr->sreg_lazy.rr = rr;
+#else
+	_avr_flags_eval(avr, op, res, rd, rr);
+#endif
+}
+
 static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 {
 	uint16_t o = _avr_flash_read16le(avr, pc) & 0xfc0f;
@@ -601,716 +761,1240 @@ static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 }
 
 /*
- * Main opcode decoder
- *
- * The decoder was written by following the datasheet in no particular order.
- * As I went along, I noticed "bit patterns" that could be used to factor opcodes
- * However, a lot of these only became apparent later on, so SOME instructions
- * (skip of bit set etc) are compact, and some could use some refactoring (the ALU
- * ones scream to be factored).
- * I assume that the decoder could easily be 2/3 of it's current size.
- *
- * + It lacks the "extended" XMega jumps.
- * + It also doesn't check whether the core it's
- *   emulating is supposed to have the fancy instructions, like multiply and such.
- *
- * The number of cycles taken by instruction has been added, but might not be
- * entirely accurate.
+ * Skip the next instruction, for the 'skip if' family
  */
-avr_flashaddr_t avr_run_one(avr_t * avr)
+static inline avr_flashaddr_t
+_avr_skip_next(avr_t * avr, avr_flashaddr_t new_pc, int * cycle)
 {
-run_one_again:
-#if CONFIG_SIMAVR_TRACE
-	/*
-	 * this traces spurious reset or bad jumps
-	 */
-	if ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend) {
-//		avr->trace = 1;
-		STATE("RESET\n");
-		crash(avr);
+	if (_avr_is_instruction_32_bits(avr, new_pc)) {
+		*cycle += 2;
+		return new_pc + 4;
 	}
-	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
-#endif
+	*cycle += 1;
+	return new_pc + 2;
+}
 
-	/* Ensure we don't crash simavr due to a bad instruction reading past
-	 * the end of the flash.
-	 */
-	if (unlikely(avr->pc >= avr->flashend)) {
-		STATE("CRASH\n");
-		crash(avr);
-		return 0;
+/*
+ * Instruction handlers.
+ *
+ * Each handler gets the predecoded instruction 'i', the "default" next pc
+ * (the one following a 16 bits instruction) and the cycle count, already
+ * set to the base cycle count of the instruction by the decoder. They return
+ * the new pc, and add any conditional cycles (branch taken, skip, stack push
+ * depending on the core) to *cycle.
+ */
+#define AVR_INSN(_name) \
+	static inline avr_flashaddr_t _avr_insn_##_name(avr_t * avr, const avr_insn_t * i, \
+			avr_flashaddr_t new_pc, int * cycle)
+
+AVR_INSN(invalid)
+{
+	_avr_invalid_opcode(avr);
+	return new_pc;
+}
+
+AVR_INSN(nop)
+{
+	STATE("nop\n");
+	return new_pc;
+}
+
+AVR_INSN(cpc)	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
+{
+	avr_sreg_sync(avr);
+	get_vd5_vr5();
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vd, vr);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(add)	// ADD -- Add without carry -- 0000 11rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd + vr;
+	if (r == d) {
+		STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
+	} else {
+		STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
 	}
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_ADD, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-	uint32_t		opcode = _avr_flash_read16le(avr, avr->pc);
-	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
-	int 			cycle = 1;
+AVR_INSN(sbc)	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
+{
+	avr_sreg_sync(avr);
+	get_vd5_vr5();
+	uint8_t res = vd - vr - avr->sreg[S_C];
+	STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-	switch (opcode & 0xf000) {
-		case 0x0000: {
-			switch (opcode) {
-				case 0x0000: {	// NOP
-					STATE("nop\n");
-				}	break;
-				default: {
-					switch (opcode & 0xfc00) {
-						case 0x0400: {	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						case 0x0c00: {	// ADD -- Add without carry -- 0000 11rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd + vr;
-							if (r == d) {
-								STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
-							} else {
-								STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							}
-							_avr_set_r(avr, d, res);
-							_avr_flags_add_zns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						case 0x0800: {	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
-						}	break;
-						default:
-							switch (opcode & 0xff00) {
-								case 0x0100: {	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
-									uint8_t d = ((opcode >> 4) & 0xf) << 1;
-									uint8_t r = ((opcode) & 0xf) << 1;
-									STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
-									uint16_t vr = avr->data[r] | (avr->data[r + 1] << 8);
-									_avr_set_r16le(avr, d, vr);
-								}	break;
-								case 0x0200: {	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
-									int8_t r = 16 + (opcode & 0xf);
-									int8_t d = 16 + ((opcode >> 4) & 0xf);
-									int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-									STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r16le(avr, 0, res);
-									avr->sreg[S_C] = (res >> 15) & 1;
-									avr->sreg[S_Z] = res == 0;
-									cycle++;
-									SREG();
-								}	break;
-								case 0x0300: {	// MUL -- Multiply -- 0000 0011 fddd frrr
-									int8_t r = 16 + (opcode & 0x7);
-									int8_t d = 16 + ((opcode >> 4) & 0x7);
-									int16_t res = 0;
-									uint8_t c = 0;
-									T(const char * name = "";)
-									switch (opcode & 0x88) {
-										case 0x00: 	// MULSU -- Multiply Signed Unsigned -- 0000 0011 0ddd 0rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											T(name = "mulsu";)
-											break;
-										case 0x08: 	// FMUL -- Fractional Multiply Unsigned -- 0000 0011 0ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmul";)
-											break;
-										case 0x80: 	// FMULS -- Multiply Signed -- 0000 0011 1ddd 0rrr
-											res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmuls";)
-											break;
-										case 0x88: 	// FMULSU -- Multiply Signed Unsigned -- 0000 0011 1ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmulsu";)
-											break;
-									}
-									cycle++;
-									STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r16le(avr, 0, res);
-									avr->sreg[S_C] = c;
-									avr->sreg[S_Z] = res == 0;
-									SREG();
-								}	break;
-								default: _avr_invalid_opcode(avr);
-							}
-					}
-				}
-			}
-		}	break;
+AVR_INSN(movw)	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
+{
+	const uint8_t d = i->d, r = i->r;
+	STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
+	uint16_t vr = avr->data[r] | (avr->data[r + 1] << 8);
+	_avr_set_reg16le(avr, d, vr);
+	return new_pc;
+}
 
-		case 0x1000: {
-			switch (opcode & 0xfc00) {
-				case 0x1800: {	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1000: {	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint16_t res = vd == vr;
-					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
-					if (res) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
-					}
-				}	break;
-				case 0x1400: {	// CP -- Compare -- 0001 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1c00: {	// ADD -- Add with carry -- 0001 11rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd + vr + avr->sreg[S_C];
-					if (r == d) {
-						STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
-					} else {
-						STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_add_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_INSN(muls)	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
+{
+	avr_sreg_sync(avr);
+	const uint8_t d = i->d, r = i->r;
+	int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+	STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+	_avr_set_reg16le(avr, 0, res);
+	avr->sreg[S_C] = (res >> 15) & 1;
+	avr->sreg[S_Z] = res == 0;
+	SREG();
+	return new_pc;
+}
 
-		case 0x2000: {
-			switch (opcode & 0xfc00) {
-				case 0x2000: {	// AND -- Logical AND -- 0010 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd & vr;
-					if (r == d) {
-						STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2400: {	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd ^ vr;
-					if (r==d) {
-						STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2800: {	// OR -- Logical OR -- 0010 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd | vr;
-					STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2c00: {	// MOV -- 0010 11rd dddd rrrr
-					get_d5_vr5(opcode);
-					uint8_t res = vr;
-					STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_INSN(fmul)	// MUL -- Multiply -- 0000 0011 fddd frrr
+{
+	avr_sreg_sync(avr);
+	const uint8_t d = i->d, r = i->r;
+	int16_t res = 0;
+	uint8_t c = 0;
+	T(const char * name = "";)
+	switch (i->k) {
+		case 0x00: 	// MULSU -- Multiply Signed Unsigned -- 0000 0011 0ddd 0rrr
+			res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			T(name = "mulsu";)
+			break;
+		case 0x08: 	// FMUL -- Fractional Multiply Unsigned -- 0000 0011 0ddd 1rrr
+			res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmul";)
+			break;
+		case 0x80: 	// FMULS -- Multiply Signed -- 0000 0011 1ddd 0rrr
+			res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmuls";)
+			break;
+		case 0x88: 	// FMULSU -- Multiply Signed Unsigned -- 0000 0011 1ddd 1rrr
+			res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			c = (res >> 15) & 1;
+			res <<= 1;
+			T(name = "fmulsu";)
+			break;
+	}
+	STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+	_avr_set_reg16le(avr, 0, res);
+	avr->sreg[S_C] = c;
+	avr->sreg[S_Z] = res == 0;
+	SREG();
+	return new_pc;
+}
 
-		case 0x3000: {	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_INSN(sub)	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd - vr;
+	STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x4000: {	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k - avr->sreg[S_C];
-			STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_Rzns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_INSN(cpse)	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint16_t res = vd == vr;
+	STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
+	if (res)
+		new_pc = _avr_skip_next(avr, new_pc, cycle);
+	return new_pc;
+}
 
-		case 0x5000: {	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
+AVR_INSN(cp)	// CP -- Compare -- 0001 01rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd - vr;
+	STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x6000: {	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh | k;
-			STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
-		}	break;
+AVR_INSN(adc)	// ADD -- Add with carry -- 0001 11rd dddd rrrr
+{
+	avr_sreg_sync(avr);
+	get_vd5_vr5();
+	uint8_t res = vd + vr + avr->sreg[S_C];
+	if (r == d) {
+		STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
+	} else {
+		STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+	}
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_ADD, res, vd, vr);
+	SREG();
+	return new_pc;
+}
 
-		case 0x7000: {	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh & k;
-			STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
-		}	break;
+AVR_INSN(and)	// AND -- Logical AND -- 0010 00rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd & vr;
+	if (r == d) {
+		STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
+	} else {
+		STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	}
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	SREG();
+	return new_pc;
+}
 
-		case 0xa000:
-		case 0x8000: {
-			/*
-			 * Load (LDD/STD) store instructions
-			 *
-			 * 10q0 qqsd dddd yqqq
-			 * s = 0 = load, 1 = store
-			 * y = 16 bits register index, 1 = Y, 0 = X
-			 * q = 6 bit displacement
-			 */
-			switch (opcode & 0xd008) {
-				case 0xa000:
-				case 0x8000: {	// LD (LDD) -- Load Indirect using Z -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
-				case 0xa008:
-				case 0x8008: {	// LD (LDD) -- Load Indirect using Y -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[d+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
+AVR_INSN(eor)	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd ^ vr;
+	if (r==d) {
+		STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
+	} else {
+		STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	}
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	SREG();
+	return new_pc;
+}
 
-		case 0x9000: {
-			/* this is an annoying special case, but at least these lines handle all the SREG set/clear opcodes */
-			if ((opcode & 0xff0f) == 0x9408) {
-				get_sreg_bit(opcode);
-				STATE("%s%c\n", opcode & 0x0080 ? "cl" : "se", _sreg_bit_name[b]);
-				avr_sreg_set(avr, b, (opcode & 0x0080) == 0);
-				SREG();
-			} else switch (opcode) {
-				case 0x9588: { // SLEEP -- 1001 0101 1000 1000
-					STATE("sleep\n");
-					/* Don't sleep if there are interrupts about to be serviced.
-					 * Without this check, it was possible to incorrectly enter a state
-					 * in which the cpu was sleeping and interrupts were disabled. For more
-					 * details, see the commit message. */
-					if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
-						avr->state = cpu_Sleeping;
-				}	break;
-				case 0x9598: { // BREAK -- 1001 0101 1001 1000
-					STATE("break\n");
-					if (avr->gdb) {
-						// if gdb is on, we break here as in here
-						// and we do so until gdb restores the instruction
-						// that was here before
-						avr->state = cpu_StepDone;
-						new_pc = avr->pc;
-						cycle = 0;
-					}
-				}	break;
-				case 0x95a8: { // WDR -- Watchdog Reset -- 1001 0101 1010 1000
-					STATE("wdr\n");
-					avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
-				}	break;
-				case 0x95e8: { // SPM -- Store Program Memory -- 1001 0101 1110 1000
-					STATE("spm\n");
-					avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
-				}	break;
-				case 0x9409:   // IJMP -- Indirect jump -- 1001 0100 0000 1001
-				case 0x9419:   // EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
-				case 0x9509:   // ICALL -- Indirect Call to Subroutine -- 1001 0101 0000 1001
-				case 0x9519: { // EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
-					int e = opcode & 0x10;
-					int p = opcode & 0x100;
-					if (e && !avr->eind)
-						_avr_invalid_opcode(avr);
-					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					if (e)
-						z |= avr->data[avr->eind] << 16;
-					STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
-					if (p)
-						cycle += _avr_push_addr(avr, new_pc) - 1;
-					new_pc = z << 1;
-					cycle++;
-					TRACE_JUMP();
-				}	break;
-				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
-					avr_sreg_set(avr, S_I, 1);
-					avr_interrupt_reti(avr);
-					FALLTHROUGH
-				case 0x9508: {	// RET -- Return -- 1001 0101 0000 1000
-					new_pc = _avr_pop_addr(avr);
-					cycle += 1 + avr->address_size;
-					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
-					TRACE_JUMP();
-					STACK_FRAME_POP();
-				}	break;
-				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
-					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
-					cycle += 2; // 3 cycles
-					_avr_set_r(avr, 0, avr->flash[z]);
-				}	break;
-				case 0x95d8: {	// ELPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1101 1000
-					if (!avr->rampz)
-						_avr_invalid_opcode(avr);
-					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
-					STATE("elpm %s, (Z[%02x:%04x])\n", avr_regname(0), z >> 16, z & 0xffff);
-					_avr_set_r(avr, 0, avr->flash[z]);
-					cycle += 2; // 3 cycles
-				}	break;
+AVR_INSN(or)	// OR -- Logical OR -- 0010 10rd dddd rrrr
+{
+	get_vd5_vr5();
+	uint8_t res = vd | vr;
+	STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(mov)	// MOV -- 0010 11rd dddd rrrr
+{
+	get_d5_vr5();
+	uint8_t res = vr;
+	STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
+	_avr_set_reg(avr, d, res);
+	return new_pc;
+}
+
+AVR_INSN(cpi)	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
+{
+	get_vh4_k8();
+	uint8_t res = vh - k;
+	STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(sbci)	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
+{
+	avr_sreg_sync(avr);
+	get_vh4_k8();
+	uint8_t res = vh - k - avr->sreg[S_C];
+	STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+	_avr_set_reg(avr, h, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB_R, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(subi)	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
+{
+	get_vh4_k8();
+	uint8_t res = vh - k;
+	STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+	_avr_set_reg(avr, h, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_SUB, res, vh, k);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(ori)	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
+{
+	get_vh4_k8();
+	uint8_t res = vh | k;
+	STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_set_reg(avr, h, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(andi)	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
+{
+	get_vh4_k8();
+	uint8_t res = vh & k;
+	STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+	_avr_set_reg(avr, h, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(ldd_z)	// LD (LDD) -- Load Indirect using Z -- 10q0 qq0d dddd 0qqq
+{
+	uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	get_d5_q6();
+	STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
+	_avr_set_reg(avr, d, _avr_get_ram(avr, v+q));
+	return new_pc;
+}
+
+AVR_INSN(std_z)	// ST (STD) -- Store Indirect using Z -- 10q0 qq1d dddd 0qqq
+{
+	uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	get_d5_q6();
+	STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, v+q, avr->data[d]);
+	return new_pc;
+}
+
+AVR_INSN(ldd_y)	// LD (LDD) -- Load Indirect using Y -- 10q0 qq0d dddd 1qqq
+{
+	uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+	get_d5_q6();
+	STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[d+q]);
+	_avr_set_reg(avr, d, _avr_get_ram(avr, v+q));
+	return new_pc;
+}
+
+AVR_INSN(std_y)	// ST (STD) -- Store Indirect using Y -- 10q0 qq1d dddd 1qqq
+{
+	uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+	get_d5_q6();
+	STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, v+q, avr->data[d]);
+	return new_pc;
+}
+
+AVR_INSN(sreg_bit)	// BSET/BCLR -- all the SREG set/clear opcodes -- 1001 0100 Bbbb 1000
+{
+	const uint8_t b = i->r;
+	STATE("%s%c\n", i->d ? "se" : "cl", _sreg_bit_name[b]);
+	avr_sreg_set(avr, b, i->d);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(sleep)	// SLEEP -- 1001 0101 1000 1000
+{
+	STATE("sleep\n");
+	/* Don't sleep if there are interrupts about to be serviced.
+	 * Without this check, it was possible to incorrectly enter a state
+	 * in which the cpu was sleeping and interrupts were disabled. For more
+	 * details, see the commit message. */
+	if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
+		avr->state = cpu_Sleeping;
+	return new_pc;
+}
+
+AVR_INSN(break)	// BREAK -- 1001 0101 1001 1000
+{
+	STATE("break\n");
+	if (avr->gdb) {
+		// if gdb is on, we break here as in here
+		// and we do so until gdb restores the instruction
+		// that was here before
+		avr->state = cpu_StepDone;
+		new_pc = avr->pc;
+		*cycle = 0;
+	}
+	return new_pc;
+}
+
+AVR_INSN(wdr)	// WDR -- Watchdog Reset -- 1001 0101 1010 1000
+{
+	STATE("wdr\n");
+	avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+	return new_pc;
+}
+
+AVR_INSN(spm)	// SPM -- Store Program Memory -- 1001 0101 1110 1000
+{
+	STATE("spm\n");
+	avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
+	return new_pc;
+}
+
+/*
+ * IJMP/EIJMP/ICALL/EICALL -- 1001 010p 000e 1001
+ * d is the 'e' extended bit, r is the 'p' push pc bit
+ */
+AVR_INSN(ijmp)
+{
+	int e = i->d;
+	int p = i->r;
+	if (e && !avr->eind)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	if (e)
+		z |= avr->data[avr->eind] << 16;
+	STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
+	if (p)
+		*cycle += _avr_push_addr(avr, new_pc) - 1;
+	new_pc = z << 1;
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_INSN(ret)	// RET -- Return -- 1001 0101 0000 1000
+{
+	new_pc = _avr_pop_addr(avr);
+	*cycle += avr->address_size;
+	STATE("ret%s\n", i->opcode & 0x10 ? "i" : "");
+	TRACE_JUMP();
+	STACK_FRAME_POP();
+	return new_pc;
+}
+
+AVR_INSN(reti)	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
+{
+	avr_sreg_set(avr, S_I, 1);
+	avr_interrupt_reti(avr);
+	return _avr_insn_ret(avr, i, new_pc, cycle);
+}
+
+AVR_INSN(lpm_r0)	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
+{
+	uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
+	_avr_set_reg(avr, 0, avr->flash[z]);
+	return new_pc;
+}
+
+AVR_INSN(elpm_r0)	// ELPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1101 1000
+{
+	if (!avr->rampz)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+	STATE("elpm %s, (Z[%02x:%04x])\n", avr_regname(0), z >> 16, z & 0xffff);
+	_avr_set_reg(avr, 0, avr->flash[z]);
+	return new_pc;
+}
+
+AVR_INSN(lds)	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
+{
+	get_d5();
+	uint16_t x = i->k;
+	new_pc += 2;
+	STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
+	_avr_set_reg(avr, d, _avr_get_ram(avr, x));
+	return new_pc;
+}
+
+AVR_INSN(lpm)	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
+{
+	get_d5();
+	uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	int op = i->r;
+	STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
+	_avr_set_reg(avr, d, avr->flash[z]);
+	if (op) {
+		z++;
+		_avr_set_reg16le_hl(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+AVR_INSN(elpm)	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
+{
+	if (!avr->rampz)
+		_avr_invalid_opcode(avr);
+	uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+	get_d5();
+	int op = i->r;
+	STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
+	_avr_set_reg(avr, d, avr->flash[z]);
+	if (op) {
+		z++;
+		_avr_set_r(avr, avr->rampz, z >> 16);
+		_avr_set_reg16le_hl(avr, R_ZL, z);
+	}
+	return new_pc;
+}
+
+/*
+ * Load store instructions
+ *
+ * 1001 00sr rrrr iioo
+ * s = 0 = load, 1 = store
+ * ii = 16 bits register index, 11 = X, 10 = Y, 00 = Z
+ * oo = 1) post increment, 2) pre-decrement
+ * The decoder places 'oo' in r
+ */
+AVR_INSN(ld_x)	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
+{
+	int op = i->r;
+	get_d5();
+	uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+	STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
+	if (op == 2) x--;
+	uint8_t vd = _avr_get_ram(avr, x);
+	if (op == 1) x++;
+	_avr_set_reg16le_hl(avr, R_XL, x);
+	_avr_set_reg(avr, d, vd);
+	return new_pc;
+}
+
+AVR_INSN(st_x)	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
+{
+	int op = i->r;
+	get_vd5();
+	uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+	STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) x--;
+	_avr_set_ram(avr, x, vd);
+	if (op == 1) x++;
+	_avr_set_reg16le_hl(avr, R_XL, x);
+	return new_pc;
+}
+
+AVR_INSN(ld_y)	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
+{
+	int op = i->r;
+	get_d5();
+	uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+	STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
+	if (op == 2) y--;
+	uint8_t vd = _avr_get_ram(avr, y);
+	if (op == 1) y++;
+	_avr_set_reg16le_hl(avr, R_YL, y);
+	_avr_set_reg(avr, d, vd);
+	return new_pc;
+}
+
+AVR_INSN(st_y)	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
+{
+	int op = i->r;
+	get_vd5();
+	uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+	STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) y--;
+	_avr_set_ram(avr, y, vd);
+	if (op == 1) y++;
+	_avr_set_reg16le_hl(avr, R_YL, y);
+	return new_pc;
+}
+
+AVR_INSN(sts)	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
+{
+	get_vd5();
+	uint16_t x = i->k;
+	new_pc += 2;
+	STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
+	_avr_set_ram(avr, x, vd);
+	return new_pc;
+}
+
+AVR_INSN(ld_z)	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
+{
+	int op = i->r;
+	get_d5();
+	uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+	STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
+	if (op == 2) z--;
+	uint8_t vd = _avr_get_ram(avr, z);
+	if (op == 1) z++;
+	_avr_set_reg16le_hl(avr, R_ZL, z);
+	_avr_set_reg(avr, d, vd);
+	return new_pc;
+}
+
+AVR_INSN(st_z)	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
+{
+	int op = i->r;
+	get_vd5();
+	uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+	STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
+	if (op == 2) z--;
+	_avr_set_ram(avr, z, vd);
+	if (op == 1) z++;
+	_avr_set_reg16le_hl(avr, R_ZL, z);
+	return new_pc;
+}
+
+AVR_INSN(pop)	// POP -- 1001 000d dddd 1111
+{
+	get_d5();
+	_avr_set_reg(avr, d, _avr_pop8(avr));
+	T(uint16_t sp = _avr_sp_get(avr);)
+	STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
+	return new_pc;
+}
+
+AVR_INSN(push)	// PUSH -- 1001 001d dddd 1111
+{
+	get_vd5();
+	_avr_push8(avr, vd);
+	T(uint16_t sp = _avr_sp_get(avr);)
+	STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
+	return new_pc;
+}
+
+AVR_INSN(com)	// COM -- One's Complement -- 1001 010d dddd 0000
+{
+	get_vd5();
+	uint8_t res = 0xff - vd;
+	STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_lazy(avr, AVR_SREG_LAZY_LOGIC, res, 0, 0);
+	avr->sreg[S_C] = 1;
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(neg)	// NEG -- Two's Complement -- 1001 010d dddd 0001
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = 0x00 - vd;
+	STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_reg(avr, d, res);
+	avr->sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
+	avr->sreg[S_V] = res == 0x80;
+	avr->sreg[S_C] = res != 0;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(swap)	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
+{
+	get_vd5();
+	uint8_t res = (vd >> 4) | (vd << 4) ;
+	STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_reg(avr, d, res);
+	return new_pc;
+}
+
+AVR_INSN(inc)	// INC -- Increment -- 1001 010d dddd 0011
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = vd + 1;
+	STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_reg(avr, d, res);
+	avr->sreg[S_V] = res == 0x80;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(asr)	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = (vd >> 1) | (vd & 0x80);
+	STATE("asr %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(lsr)	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = vd >> 1;
+	STATE("lsr %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_reg(avr, d, res);
+	avr->sreg[S_N] = 0;
+	_avr_flags_zcvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(ror)	// ROR -- Rotate Right -- 1001 010d dddd 0111
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
+	STATE("ror %s[%02x]\n", avr_regname(d), vd);
+	_avr_set_reg(avr, d, res);
+	_avr_flags_zcnvs(avr, res, vd);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(dec)	// DEC -- Decrement -- 1001 010d dddd 1010
+{
+	avr_sreg_sync(avr);
+	get_vd5();
+	uint8_t res = vd - 1;
+	STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
+	_avr_set_reg(avr, d, res);
+	avr->sreg[S_V] = res == 0x7f;
+	_avr_flags_zns(avr, res);
+	SREG();
+	return new_pc;
+}
+
+/*
+ * JMP -- Long Jump, 32 bits -- 1001 010a aaaa 110a
+ * r holds the 6 high bits of the (word) address, k the low 16 bits
+ */
+AVR_INSN(jmp)
+{
+	avr_flashaddr_t a = ((avr_flashaddr_t)i->r << 16) | i->k;
+	STATE("jmp 0x%06x\n", a);
+	new_pc = a << 1;
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_INSN(call)	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
+{
+	avr_flashaddr_t a = ((avr_flashaddr_t)i->r << 16) | i->k;
+	STATE("call 0x%06x\n", a);
+	new_pc += 2;
+	*cycle += _avr_push_addr(avr, new_pc);
+	new_pc = a << 1;
+	TRACE_JUMP();
+	STACK_FRAME_PUSH();
+	return new_pc;
+}
+
+AVR_INSN(adiw)	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
+{
+	avr_sreg_sync(avr);
+	get_vp2_k6();
+	uint16_t res = vp + k;
+	STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+	_avr_set_reg16le_hl(avr, p, res);
+	avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
+	avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(sbiw)	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
+{
+	avr_sreg_sync(avr);
+	get_vp2_k6();
+	uint16_t res = vp - k;
+	STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+	_avr_set_reg16le_hl(avr, p, res);
+	avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
+	avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
+	_avr_flags_zns16(avr, res);
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(cbi)	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
+{
+	get_io5_b3mask();
+	uint8_t res = _avr_get_ram(avr, io) & ~mask;
+	STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+	_avr_set_ram(avr, io, res);
+	return new_pc;
+}
+
+AVR_INSN(sbic)	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
+{
+	get_io5_b3mask();
+	uint8_t res = _avr_get_ram(avr, io) & mask;
+	STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
+	if (!res)
+		new_pc = _avr_skip_next(avr, new_pc, cycle);
+	return new_pc;
+}
+
+AVR_INSN(sbi)	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
+{
+	get_io5_b3mask();
+	uint8_t res = _avr_get_ram(avr, io) | mask;
+	STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+	_avr_set_ram(avr, io, res);
+	return new_pc;
+}
+
+AVR_INSN(sbis)	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
+{
+	get_io5_b3mask();
+	uint8_t res = _avr_get_ram(avr, io) & mask;
+	STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
+	if (res)
+		new_pc = _avr_skip_next(avr, new_pc, cycle);
+	return new_pc;
+}
+
+AVR_INSN(mul)	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
+{
+	avr_sreg_sync(avr);
+	get_vd5_vr5();
+	uint16_t res = vd * vr;
+	STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+	_avr_set_reg16le(avr, 0, res);
+	avr->sreg[S_Z] = res == 0;
+	avr->sreg[S_C] = (res >> 15) & 1;
+	SREG();
+	return new_pc;
+}
+
+AVR_INSN(out)	// OUT A,Rr -- 1011 1AAd dddd AAAA
+{
+	get_d5_a6();
+	STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
+	_avr_set_ram(avr, A, avr->data[d]);
+	return new_pc;
+}
+
+AVR_INSN(in)	// IN Rd,A -- 1011 0AAd dddd AAAA
+{
+	get_d5_a6();
+	STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
+	_avr_set_reg(avr, d, _avr_get_ram(avr, A));
+	return new_pc;
+}
+
+AVR_INSN(rjmp)	// RJMP -- 1100 kkkk kkkk kkkk
+{
+	get_o12();
+	STATE("rjmp .%d [%04x]\n", o >> 1, new_pc + o);
+	new_pc = (new_pc + o) % (avr->flashend+1);
+	TRACE_JUMP();
+	return new_pc;
+}
+
+AVR_INSN(rcall)	// RCALL -- 1101 kkkk kkkk kkkk
+{
+	get_o12();
+	STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
+	*cycle += _avr_push_addr(avr, new_pc);
+	new_pc = (new_pc + o) % (avr->flashend+1);
+	// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
+	if (o != 0) {
+		TRACE_JUMP();
+		STACK_FRAME_PUSH();
+	}
+	return new_pc;
+}
+
+AVR_INSN(ldi)	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
+{
+	get_h4_k8();
+	STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
+	_avr_set_reg(avr, h, k);
+	return new_pc;
+}
+
+/*
+ * BRXC/BRXS -- All the SREG branches -- 1111 0Boo oooo osss
+ * k is the (word) offset, r the SREG bit, d is set for BRXS
+ */
+AVR_INSN(brxs)
+{
+	avr_sreg_sync(avr);
+	int16_t o = (int16_t)i->k;
+	uint8_t s = i->r;
+	int set = i->d;
+	int branch = (avr->sreg[s] && set) || (!avr->sreg[s] && !set);
+#if AVR_CORE_TRACE
+	const char *names[2][8] = {
+			{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
+			{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
+	};
+	if (names[set][s]) {
+		STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, new_pc + (o << 1), branch ? "":" not");
+	} else {
+		STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
+	}
+#endif
+	if (branch) {
+		*cycle += 1; // 2 cycles if taken, 1 otherwise
+		new_pc = new_pc + (o << 1);
+	}
+	return new_pc;
+}
+
+AVR_INSN(bld)	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
+{
+	get_vd5_s3_mask();
+	uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
+	STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
+	_avr_set_reg(avr, d, v);
+	return new_pc;
+}
+
+AVR_INSN(bst)	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
+{
+	get_vd5_s3();
+	STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
+	avr->sreg[S_T] = (vd >> s) & 1;
+	SREG();
+	return new_pc;
+}
+
+/*
+ * SBRS/SBRC -- Skip if Bit in Register is Set/Clear -- 1111 11sd dddd 0bbb
+ * k is set for SBRS
+ */
+AVR_INSN(sbrxs)
+{
+	get_vd5_s3_mask();
+	int set = i->k;
+	int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
+	STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
+	if (branch)
+		new_pc = _avr_skip_next(avr, new_pc, cycle);
+	return new_pc;
+}
+
+/*
+ * List of all the instruction handlers, this is used to give each of them
+ * an index (avr_insn_t.op) for the threaded and traced cores dispatch tables
+ */
+#define AVR_INSN_LIST(_) \
+	_(invalid) _(nop) _(cpc) _(add) _(sbc) _(movw) _(muls) _(fmul) \
+	_(sub) _(cpse) _(cp) _(adc) _(and) _(eor) _(or) _(mov) \
+	_(cpi) _(sbci) _(subi) _(ori) _(andi) _(ldi) \
+	_(ldd_z) _(std_z) _(ldd_y) _(std_y) \
+	_(sreg_bit) _(sleep) _(break) _(wdr) _(spm) \
+	_(ijmp) _(ret) _(reti) _(lpm_r0) _(elpm_r0) \
+	_(lds) _(lpm) _(elpm) _(ld_x) _(st_x) _(ld_y) _(st_y) _(sts) \
+	_(ld_z) _(st_z) _(pop) _(push) \
+	_(com) _(neg) _(swap) _(inc) _(asr) _(lsr) _(ror) _(dec) \
+	_(jmp) _(call) _(adiw) _(sbiw) _(cbi) _(sbic) _(sbi) _(sbis) _(mul) \
+	_(out) _(in) _(rjmp) _(rcall) _(brxs) _(bld) _(bst) _(sbrxs)
+
+#define _AVR_OP_ENUM(_name) _avr_op_##_name,
+enum {
+	AVR_INSN_LIST(_AVR_OP_ENUM)
+	_avr_op_count
+};
+
+#if !AVR_CORE_TRACE
+/*
+ * Instructions the translator (sim_jit.c) can handle
+ */
+static const uint8_t _avr_op_props[_avr_op_count] = {
+	[_avr_op_nop] = AVR_INSN_REGONLY,
+	[_avr_op_cpc] = AVR_INSN_REGONLY,
+	[_avr_op_add] = AVR_INSN_REGONLY,
+	[_avr_op_sbc] = AVR_INSN_REGONLY,
+	[_avr_op_movw] = AVR_INSN_REGONLY,
+	[_avr_op_muls] = AVR_INSN_REGONLY,
+	[_avr_op_fmul] = AVR_INSN_REGONLY,
+	[_avr_op_sub] = AVR_INSN_REGONLY,
+	[_avr_op_cp] = AVR_INSN_REGONLY,
+	[_avr_op_adc] = AVR_INSN_REGONLY,
+	[_avr_op_and] = AVR_INSN_REGONLY,
+	[_avr_op_eor] = AVR_INSN_REGONLY,
+	[_avr_op_or] = AVR_INSN_REGONLY,
+	[_avr_op_mov] = AVR_INSN_REGONLY,
+	[_avr_op_cpi] = AVR_INSN_REGONLY,
+	[_avr_op_sbci] = AVR_INSN_REGONLY,
+	[_avr_op_subi] = AVR_INSN_REGONLY,
+	[_avr_op_ori] = AVR_INSN_REGONLY,
+	[_avr_op_andi] = AVR_INSN_REGONLY,
+	[_avr_op_ldi] = AVR_INSN_REGONLY,
+	[_avr_op_sreg_bit] = AVR_INSN_REGONLY,	// except S_I, see avr_insn_props()
+	[_avr_op_com] = AVR_INSN_REGONLY,
+	[_avr_op_neg] = AVR_INSN_REGONLY,
+	[_avr_op_swap] = AVR_INSN_REGONLY,
+	[_avr_op_inc] = AVR_INSN_REGONLY,
+	[_avr_op_asr] = AVR_INSN_REGONLY,
+	[_avr_op_lsr] = AVR_INSN_REGONLY,
+	[_avr_op_ror] = AVR_INSN_REGONLY,
+	[_avr_op_dec] = AVR_INSN_REGONLY,
+	[_avr_op_adiw] = AVR_INSN_REGONLY,
+	[_avr_op_sbiw] = AVR_INSN_REGONLY,
+	[_avr_op_mul] = AVR_INSN_REGONLY,
+	[_avr_op_bld] = AVR_INSN_REGONLY,
+	[_avr_op_bst] = AVR_INSN_REGONLY,
+	[_avr_op_cpse] = AVR_INSN_BRANCH,
+	[_avr_op_sbrxs] = AVR_INSN_BRANCH,
+	[_avr_op_brxs] = AVR_INSN_BRANCH,
+	[_avr_op_rjmp] = AVR_INSN_BRANCH,
+};
+
+#define DECODE(_name, _cycles) { \
+		insn->handler = _avr_insn_##_name; \
+		insn->op = _avr_op_##_name; \
+		insn->cycles = _cycles; \
+	}
+
+/*
+ * Main opcode decoder
+ *
+ * The decoder was written by following the datasheet in no particular order.
+ * As I went along, I noticed "bit patterns" that could be used to factor opcodes
+ * However, a lot of these only became apparent later on, so SOME instructions
+ * (skip of bit set etc) are compact, and some could use some refactoring.
+ *
+ * + It lacks the "extended" XMega jumps.
+ * + It also doesn't check whether the core it's
+ *   emulating is supposed to have the fancy instructions, like multiply and such.
+ *
+ * The decoder runs only once per flash word; it fills the avr_insn_t with
+ * the handler, the extracted operands and the base number of cycles the
+ * instruction takes. The handlers add the conditional cycles.
+ * The number of cycles taken by instruction has been added, but might not be
+ * entirely accurate.
+ */
+static void
+_avr_decode_one(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		avr_insn_t * insn)
+{
+	uint16_t opcode = _avr_flash_read16le(avr, pc);
+	/* second word of the 32 bits instructions, if there is one */
+	uint16_t next = pc + 3 <= avr->flashend ? _avr_flash_read16le(avr, pc + 2) : 0;
+
+	insn->opcode = opcode;
+	insn->k = 0;
+	insn->d = insn->r = 0;
+	DECODE(invalid, 1);
+
+	switch (opcode & 0xf000) {
+		case 0x0000: {
+			if (opcode == 0x0000) {	// NOP
+				DECODE(nop, 1);
+				break;
+			}
+			insn->d = dec_d5(opcode);
+			insn->r = dec_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x0400: DECODE(cpc, 1); break;
+				case 0x0c00: DECODE(add, 1); break;
+				case 0x0800: DECODE(sbc, 1); break;
+				default:
+					switch (opcode & 0xff00) {
+						case 0x0100:
+							insn->d = ((opcode >> 4) & 0xf) << 1;
+							insn->r = ((opcode) & 0xf) << 1;
+							DECODE(movw, 1);
+							break;
+						case 0x0200:
+							insn->d = 16 + ((opcode >> 4) & 0xf);
+							insn->r = 16 + (opcode & 0xf);
+							DECODE(muls, 2);
+							break;
+						case 0x0300:
+							insn->d = 16 + ((opcode >> 4) & 0x7);
+							insn->r = 16 + (opcode & 0x7);
+							insn->k = opcode & 0x88;
+							DECODE(fmul, 2);
+							break;
+					}
+			}
+		}	break;
+
+		case 0x1000: {
+			insn->d = dec_d5(opcode);
+			insn->r = dec_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x1800: DECODE(sub, 1); break;
+				case 0x1000: DECODE(cpse, 1); break;
+				case 0x1400: DECODE(cp, 1); break;
+				case 0x1c00: DECODE(adc, 1); break;
+			}
+		}	break;
+
+		case 0x2000: {
+			insn->d = dec_d5(opcode);
+			insn->r = dec_r5(opcode);
+			switch (opcode & 0xfc00) {
+				case 0x2000: DECODE(and, 1); break;
+				case 0x2400: DECODE(eor, 1); break;
+				case 0x2800: DECODE(or, 1); break;
+				case 0x2c00: DECODE(mov, 1); break;
+			}
+		}	break;
+
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x6000:
+		case 0x7000:
+		case 0xe000: {
+			insn->d = dec_h4(opcode);
+			insn->k = dec_k8(opcode);
+			switch (opcode & 0xf000) {
+				case 0x3000: DECODE(cpi, 1); break;
+				case 0x4000: DECODE(sbci, 1); break;
+				case 0x5000: DECODE(subi, 1); break;
+				case 0x6000: DECODE(ori, 1); break;
+				case 0x7000: DECODE(andi, 1); break;
+				case 0xe000: DECODE(ldi, 1); break;
+			}
+		}	break;
+
+		case 0xa000:
+		case 0x8000: {
+			/*
+			 * Load (LDD/STD) store instructions
+			 *
+			 * 10q0 qqsd dddd yqqq
+			 * s = 0 = load, 1 = store
+			 * y = 16 bits register index, 1 = Y, 0 = X
+			 * q = 6 bit displacement
+			 */
+			insn->d = dec_d5(opcode);
+			insn->k = dec_q6(opcode);
+			// 2 cycles, 3 for tinyavr
+			switch (opcode & 0xd208) {
+				case 0xa000:
+				case 0x8000: DECODE(ldd_z, 2); break;
+				case 0xa200:
+				case 0x8200: DECODE(std_z, 2); break;
+				case 0xa008:
+				case 0x8008: DECODE(ldd_y, 2); break;
+				case 0xa208:
+				case 0x8208: DECODE(std_y, 2); break;
+			}
+		}	break;
+
+		case 0x9000: {
+			/* this is an annoying special case, but at least these lines handle all the SREG set/clear opcodes */
+			if ((opcode & 0xff0f) == 0x9408) {
+				insn->r = dec_sreg_bit(opcode);
+				insn->d = (opcode & 0x0080) == 0;
+				DECODE(sreg_bit, 1);
+			} else switch (opcode) {
+				case 0x9588: DECODE(sleep, 1); break;
+				case 0x9598: DECODE(break, 1); break;
+				case 0x95a8: DECODE(wdr, 1); break;
+				case 0x95e8: DECODE(spm, 1); break;
+				case 0x9409:	// IJMP
+				case 0x9419:	// EIJMP -- bit 4 is "indirect"
+				case 0x9509:	// ICALL
+				case 0x9519:	// EICALL -- bit 8 is "push pc"
+					insn->d = (opcode & 0x10) != 0;
+					insn->r = (opcode & 0x100) != 0;
+					DECODE(ijmp, 2);
+					break;
+				case 0x9518: DECODE(reti, 2); break;	// + address_size
+				case 0x9508: DECODE(ret, 2); break;	// + address_size
+				case 0x95c8: DECODE(lpm_r0, 3); break;
+				case 0x95d8: DECODE(elpm_r0, 3); break;
 				default:  {
+					insn->d = dec_d5(opcode);
 					switch (opcode & 0xfe0f) {
-						case 0x9000: {	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
-							get_d5(opcode);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							new_pc += 2;
-							STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
-							_avr_set_r(avr, d, _avr_get_ram(avr, x));
-							cycle++; // 2 cycles
-						}	break;
+						case 0x9000:
+							insn->k = next;
+							DECODE(lds, 2);
+							break;
 						case 0x9005:
-						case 0x9004: {	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
-							get_d5(opcode);
-							uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-							int op = opcode & 1;
-							STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r16le_hl(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
+						case 0x9004:
+							insn->r = opcode & 1;
+							DECODE(lpm, 3);
+							break;
 						case 0x9006:
-						case 0x9007: {	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
-							if (!avr->rampz)
-								_avr_invalid_opcode(avr);
-							uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
-							get_d5(opcode);
-							int op = opcode & 1;
-							STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r(avr, avr->rampz, z >> 16);
-								_avr_set_r16le_hl(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
-						/*
-						 * Load store instructions
-						 *
-						 * 1001 00sr rrrr iioo
-						 * s = 0 = load, 1 = store
-						 * ii = 16 bits register index, 11 = X, 10 = Y, 00 = Z
-						 * oo = 1) post increment, 2) pre-decrement
-						 */
+						case 0x9007:
+							insn->r = opcode & 1;
+							DECODE(elpm, 3);
+							break;
 						case 0x900c:
 						case 0x900d:
-						case 0x900e: {	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
-							cycle++; // 2 cycles (1 for tinyavr, except with inc/dec 2)
-							if (op == 2) x--;
-							uint8_t vd = _avr_get_ram(avr, x);
-							if (op == 1) x++;
-							_avr_set_r16le_hl(avr, R_XL, x);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x900e:
+							insn->r = opcode & 3;
+							DECODE(ld_x, 2);	// 2 cycles (1 for tinyavr, except with inc/dec 2)
+							break;
 						case 0x920c:
 						case 0x920d:
-						case 0x920e: {	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) x--;
-							_avr_set_ram(avr, x, vd);
-							if (op == 1) x++;
-							_avr_set_r16le_hl(avr, R_XL, x);
-						}	break;
+						case 0x920e:
+							insn->r = opcode & 3;
+							DECODE(st_x, 2);	// 2 cycles, except tinyavr
+							break;
 						case 0x9009:
-						case 0x900a: {	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) y--;
-							uint8_t vd = _avr_get_ram(avr, y);
-							if (op == 1) y++;
-							_avr_set_r16le_hl(avr, R_YL, y);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x900a:
+							insn->r = opcode & 3;
+							DECODE(ld_y, 2);	// 2 cycles, except tinyavr
+							break;
 						case 0x9209:
-						case 0x920a: {	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++;
-							if (op == 2) y--;
-							_avr_set_ram(avr, y, vd);
-							if (op == 1) y++;
-							_avr_set_r16le_hl(avr, R_YL, y);
-						}	break;
-						case 0x9200: {	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
-							get_vd5(opcode);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							new_pc += 2;
-							STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
-							cycle++;
-							_avr_set_ram(avr, x, vd);
-						}	break;
+						case 0x920a:
+							insn->r = opcode & 3;
+							DECODE(st_y, 2);
+							break;
+						case 0x9200:
+							insn->k = next;
+							DECODE(sts, 2);
+							break;
 						case 0x9001:
-						case 0x9002: {	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
-							cycle++;; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							uint8_t vd = _avr_get_ram(avr, z);
-							if (op == 1) z++;
-							_avr_set_r16le_hl(avr, R_ZL, z);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x9002:
+							insn->r = opcode & 3;
+							DECODE(ld_z, 2);	// 2 cycles, except tinyavr
+							break;
 						case 0x9201:
-						case 0x9202: {	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							_avr_set_ram(avr, z, vd);
-							if (op == 1) z++;
-							_avr_set_r16le_hl(avr, R_ZL, z);
-						}	break;
-						case 0x900f: {	// POP -- 1001 000d dddd 1111
-							get_d5(opcode);
-							_avr_set_r(avr, d, _avr_pop8(avr));
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
-							cycle++;
-						}	break;
-						case 0x920f: {	// PUSH -- 1001 001d dddd 1111
-							get_vd5(opcode);
-							_avr_push8(avr, vd);
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
-							cycle++;
-						}	break;
-						case 0x9400: {	// COM -- One's Complement -- 1001 010d dddd 0000
-							get_vd5(opcode);
-							uint8_t res = 0xff - vd;
-							STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_znv0s(avr, res);
-							avr->sreg[S_C] = 1;
-							SREG();
-						}	break;
-						case 0x9401: {	// NEG -- Two's Complement -- 1001 010d dddd 0001
-							get_vd5(opcode);
-							uint8_t res = 0x00 - vd;
-							STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
-							avr->sreg[S_V] = res == 0x80;
-							avr->sreg[S_C] = res != 0;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9402: {	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
-							get_vd5(opcode);
-							uint8_t res = (vd >> 4) | (vd << 4) ;
-							STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-						}	break;
-						case 0x9403: {	// INC -- Increment -- 1001 010d dddd 0011
-							get_vd5(opcode);
-							uint8_t res = vd + 1;
-							STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x80;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9405: {	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
-							get_vd5(opcode);
-							uint8_t res = (vd >> 1) | (vd & 0x80);
-							STATE("asr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9406: {	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
-							get_vd5(opcode);
-							uint8_t res = vd >> 1;
-							STATE("lsr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_N] = 0;
-							_avr_flags_zcvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9407: {	// ROR -- Rotate Right -- 1001 010d dddd 0111
-							get_vd5(opcode);
-							uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
-							STATE("ror %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x940a: {	// DEC -- Decrement -- 1001 010d dddd 1010
-							get_vd5(opcode);
-							uint8_t res = vd - 1;
-							STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x7f;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
+						case 0x9202:
+							insn->r = opcode & 3;
+							DECODE(st_z, 2);	// 2 cycles, except tinyavr
+							break;
+						case 0x900f: DECODE(pop, 2); break;
+						case 0x920f: DECODE(push, 2); break;
+						case 0x9400: DECODE(com, 1); break;
+						case 0x9401: DECODE(neg, 1); break;
+						case 0x9402: DECODE(swap, 1); break;
+						case 0x9403: DECODE(inc, 1); break;
+						case 0x9405: DECODE(asr, 1); break;
+						case 0x9406: DECODE(lsr, 1); break;
+						case 0x9407: DECODE(ror, 1); break;
+						case 0x940a: DECODE(dec, 1); break;
 						case 0x940c:
-						case 0x940d: {	// JMP -- Long Call to sub, 32 bits -- 1001 010a aaaa 110a
-							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							a = (a << 16) | x;
-							STATE("jmp 0x%06x\n", a);
-							new_pc = a << 1;
-							cycle += 2;
-							TRACE_JUMP();
-						}	break;
+						case 0x940d:
+							insn->r = ((opcode & 0x01f0) >> 3) | (opcode & 1);
+							insn->k = next;
+							DECODE(jmp, 3);
+							break;
 						case 0x940e:
-						case 0x940f: {	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
-							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							a = (a << 16) | x;
-							STATE("call 0x%06x\n", a);
-							new_pc += 2;
-							cycle += 1 + _avr_push_addr(avr, new_pc);
-							new_pc = a << 1;
-							TRACE_JUMP();
-							STACK_FRAME_PUSH();
-						}	break;
-
+						case 0x940f:
+							insn->r = ((opcode & 0x01f0) >> 3) | (opcode & 1);
+							insn->k = next;
+							DECODE(call, 2);	// + address_size
+							break;
 						default: {
 							switch (opcode & 0xff00) {
-								case 0x9600: {	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp + k;
-									STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r16le_hl(avr, p, res);
-									avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
-									avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
-								}	break;
-								case 0x9700: {	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp - k;
-									STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r16le_hl(avr, p, res);
-									avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
-									avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
-								}	break;
-								case 0x9800: {	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & ~mask;
-									STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
-								}	break;
-								case 0x9900: {	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
-									if (!res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
-									}
-								}	break;
-								case 0x9a00: {	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) | mask;
-									STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
-								}	break;
-								case 0x9b00: {	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
-									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
-									if (res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
+								case 0x9600:
+								case 0x9700:
+									insn->d = dec_p2(opcode);
+									insn->k = dec_k6(opcode);
+									if (opcode & 0x0100)
+										DECODE(sbiw, 2)
+									else
+										DECODE(adiw, 2)
+									break;
+								case 0x9800:
+								case 0x9900:
+								case 0x9a00:
+								case 0x9b00:
+									insn->d = dec_io5(opcode);
+									insn->r = 1 << (opcode & 0x7);
+									switch (opcode & 0xff00) {
+										case 0x9800: DECODE(cbi, 2); break;
+										case 0x9900: DECODE(sbic, 1); break;
+										case 0x9a00: DECODE(sbi, 2); break;
+										case 0x9b00: DECODE(sbis, 1); break;
 									}
-								}	break;
+									break;
 								default:
-									switch (opcode & 0xfc00) {
-										case 0x9c00: {	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
-											get_vd5_vr5(opcode);
-											uint16_t res = vd * vr;
-											STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-											cycle++;
-											_avr_set_r16le(avr, 0, res);
-											avr->sreg[S_Z] = res == 0;
-											avr->sreg[S_C] = (res >> 15) & 1;
-											SREG();
-										}	break;
-										default: _avr_invalid_opcode(avr);
+									if ((opcode & 0xfc00) == 0x9c00) {
+										insn->r = dec_r5(opcode);
+										DECODE(mul, 2);
 									}
 							}
 						}	break;
@@ -1320,45 +2004,22 @@ run_one_again:
 		}	break;
 
 		case 0xb000: {
-			switch (opcode & 0xf800) {
-				case 0xb800: {	// OUT A,Rr -- 1011 1AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
-					_avr_set_ram(avr, A, avr->data[d]);
-				}	break;
-				case 0xb000: {	// IN Rd,A -- 1011 0AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
-					_avr_set_r(avr, d, _avr_get_ram(avr, A));
-				}	break;
-				default: _avr_invalid_opcode(avr);
-			}
-		}	break;
-
-		case 0xc000: {	// RJMP -- 1100 kkkk kkkk kkkk
-			get_o12(opcode);
-			STATE("rjmp .%d [%04x]\n", o >> 1, new_pc + o);
-			new_pc = (new_pc + o) % (avr->flashend+1);
-			cycle++;
-			TRACE_JUMP();
-		}	break;
-
-		case 0xd000: {	// RCALL -- 1101 kkkk kkkk kkkk
-			get_o12(opcode);
-			STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
-			cycle += _avr_push_addr(avr, new_pc);
-			new_pc = (new_pc + o) % (avr->flashend+1);
-			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
-			if (o != 0) {
-				TRACE_JUMP();
-				STACK_FRAME_PUSH();
-			}
+			insn->d = dec_d5(opcode);
+			insn->k = dec_a6(opcode);
+			if (opcode & 0x0800)
+				DECODE(out, 1)
+			else
+				DECODE(in, 1)
 		}	break;
 
-		case 0xe000: {	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
-			get_h4_k8(opcode);
-			STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
-			_avr_set_r(avr, h, k);
+		case 0xc000:
+		case 0xd000: {
+			//	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
+			insn->k = (uint16_t)(((int16_t)((opcode << 4) & 0xffff)) >> 3);
+			if (opcode & 0x1000)
+				DECODE(rcall, 1)	// + address_size
+			else
+				DECODE(rjmp, 2)
 		}	break;
 
 		case 0xf000: {
@@ -1366,60 +2027,365 @@ run_one_again:
 				case 0xf000:
 				case 0xf200:
 				case 0xf400:
-				case 0xf600: {	// BRXC/BRXS -- All the SREG branches -- 1111 0Boo oooo osss
-					int16_t o = ((int16_t)(opcode << 6)) >> 9; // offset
-					uint8_t s = opcode & 7;
-					int set = (opcode & 0x0400) == 0;		// this bit means BRXC otherwise BRXS
-					int branch = (avr->sreg[s] && set) || (!avr->sreg[s] && !set);
-					const char *names[2][8] = {
-							{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
-							{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
-					};
-					if (names[set][s]) {
-						STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, new_pc + (o << 1), branch ? "":" not");
-					} else {
-						STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
-					}
-					if (branch) {
-						cycle++; // 2 cycles if taken, 1 otherwise
-						new_pc = new_pc + (o << 1);
-					}
-				}	break;
+				case 0xf600:
+					insn->k = (uint16_t)(((int16_t)(opcode << 6)) >> 9); // offset
+					insn->r = opcode & 7;
+					insn->d = (opcode & 0x0400) == 0;	// this bit means BRXC otherwise BRXS
+					DECODE(brxs, 1);
+					break;
 				case 0xf800:
-				case 0xf900: {	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
-					get_vd5_s3_mask(opcode);
-					uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
-					STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
-					_avr_set_r(avr, d, v);
-				}	break;
+					insn->d = dec_d5(opcode);
+					insn->r = opcode & 7;
+					DECODE(bld, 1);
+					break;
 				case 0xfa00:
-				case 0xfb00:{	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
-					get_vd5_s3(opcode)
-					STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
-					avr->sreg[S_T] = (vd >> s) & 1;
-					SREG();
-				}	break;
+					insn->d = dec_d5(opcode);
+					insn->r = opcode & 7;
+					DECODE(bst, 1);
+					break;
 				case 0xfc00:
-				case 0xfe00: {	// SBRS/SBRC -- Skip if Bit in Register is Set/Clear -- 1111 11sd dddd 0bbb
-					get_vd5_s3_mask(opcode)
-					int set = (opcode & 0x0200) != 0;
-					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
-					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
-					if (branch) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
-					}
-				}	break;
-				default: _avr_invalid_opcode(avr);
+				case 0xfe00:
+					insn->d = dec_d5(opcode);
+					insn->r = opcode & 7;
+					insn->k = (opcode & 0x0200) != 0;
+					DECODE(sbrxs, 1);
+					break;
 			}
 		}	break;
+	}
+}
+
+avr_insn_t *
+avr_insn_at(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	avr_insn_t * insn = &avr->decode[pc >> 1];
+	if (!insn->handler)
+		_avr_decode_one(avr, pc, insn);
+	return insn;
+}
+
+uint8_t
+avr_insn_props(
+		const avr_insn_t * insn)
+{
+	// SEI/CLI change the interrupt state, they have to be interpreted
+	if (insn->op == _avr_op_sreg_bit && insn->r == S_I)
+		return 0;
+	return _avr_op_props[insn->op];
+}
+
+int
+avr_insn_is_32_bits(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	return _avr_is_instruction_32_bits(avr, pc);
+}
+
+/*
+ * Gives the AVR its own copy of a flash it shares with clones. The last
+ * one using it keeps it, the others can be running on other threads.
+ */
+static void
+_avr_flash_unshare(
+		avr_t * avr)
+{
+	int * refs = avr->flash_refs;
+	avr->flash_refs = NULL;
+	if (__atomic_load_n(refs, __ATOMIC_ACQUIRE) > 1) {
+		uint8_t * flash = malloc(avr->flashend + 1);
+		memcpy(flash, avr->flash, avr->flashend + 1);
+		if (__atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0) {
+			// the others let go of it meanwhile
+			free(avr->flash);
+			free(refs);
+		}
+		avr->flash = flash;
+	} else
+		free(refs);
+}
+
+void
+avr_invalidate_code(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size)
+{
+	if (avr->flash_refs && size)
+		_avr_flash_unshare(avr);
+	if (!avr->decode || !size)
+		return;
+	/* a 32 bits instruction starting just before the range depends on it too */
+	avr_flashaddr_t start = address >= 2 ? address - 2 : 0;
+	avr_flashaddr_t end = address + size;
+	if (end > avr->flashend + 1)
+		end = avr->flashend + 1;
+	start >>= 1;
+	end = (end + 1) >> 1;
+	if (start < end)
+		memset(avr->decode + start, 0, (end - start) * sizeof(avr_insn_t));
+	if (avr->jit)
+		avr_jit_invalidate(avr, address, size);
+}
+
+void
+avr_data_page_set(
+		avr_t * avr,
+		uint32_t address,
+		uint32_t size,
+		uint8_t flags)
+{
+	if (!avr->data_page || !size || address > 0xffff)
+		return;
+	uint32_t end = address + size - 1;
+	if (end > 0xffff)
+		end = 0xffff;
+	for (uint32_t p = address >> AVR_DATA_PAGE_SHIFT; p <= end >> AVR_DATA_PAGE_SHIFT; p++)
+		avr->data_page[p] |= flags;
+}
+
+void
+avr_data_page_clear(
+		avr_t * avr,
+		uint32_t address,
+		uint32_t size,
+		uint8_t flags)
+{
+	if (!avr->data_page || !size || address > 0xffff)
+		return;
+	uint32_t end = address + size - 1;
+	if (end > 0xffff)
+		end = 0xffff;
+	for (uint32_t p = address >> AVR_DATA_PAGE_SHIFT; p <= end >> AVR_DATA_PAGE_SHIFT; p++)
+		avr->data_page[p] &= ~flags;
+}
+#endif
+
+/*
+ * Fetch the predecoded instruction at the current pc, decoding it if
+ * needed. Returns NULL if the pc is out of the flash.
+ */
+static inline avr_insn_t *
+_avr_fetch(
+		avr_t * avr)
+{
+#if AVR_CORE_TRACE
+	/*
+	 * this traces spurious reset or bad jumps
+	 */
+	if (avr->trace && ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend)) {
+		STATE("RESET\n");
+		crash(avr);
+	}
+	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
+#endif
+
+	/* Ensure we don't crash simavr due to a bad instruction reading past
+	 * the end of the flash.
+	 */
+	if (unlikely(avr->pc >= avr->flashend)) {
+		STATE("CRASH\n");
+		crash(avr);
+		return NULL;
+	}
+
+	avr_insn_t * insn = &avr->decode[avr->pc >> 1];
+	if (unlikely(!insn->handler))
+		insn = avr_insn_at(avr, avr->pc);	// the plain build decodes
+	return insn;
+}
+
+#if !AVR_CORE_TRACE
+/*
+ * Idle loop skipping (avr->idle_skip). A polling loop such as
+ *	wait: lds r24, UCSR0A
+ *	      sbrs r24, UDRE0
+ *	      rjmp wait
+ * does the exact same thing on every turn until a cycle timer or an IRQ
+ * changes the register it polls. Nothing of the sort can happen before
+ * the end of the current run (avr->run_cycle_count), so once a turn of
+ * the loop is known to be side effect free and to come back to the same
+ * registers, all the turns that fit in the run can be skipped.
+ */
+#define AVR_IDLE_MAX_INSN	16
+#define AVR_IDLE_MAX_CYCLES	(AVR_IDLE_MAX_INSN * 3)	// 3: jmp, skip of a 32 bits insn
+#define AVR_IDLE_BACKOFF	16
+
+/*
+ * True if reading addr can be repeated as many times as we like, with
+ * the same result: plain sram, or an IO register that has no read
+ * callback (or one that says so), no watchpoint, nobody listening
+ */
+static int
+_avr_idle_read_ok(
+		avr_t * avr,
+		uint16_t addr)
+{
+	if (addr > avr->ramend)
+		return 0;
+	uint8_t page = avr->data_page[addr >> AVR_DATA_PAGE_SHIFT];
+	if (page & ~AVR_DATA_PAGE_IO)
+		return 0;
+	if (!page || addr <= 31 || addr >= 31 + MAX_IOs)
+		return 1;
+	avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+	return !avr->io[io].irq && (!avr->io[io].r.c || avr->io[io].r.idle);
+}
+
+static int
+_avr_idle_insn_ok(
+		avr_t * avr,
+		const avr_insn_t * i)
+{
+	if (avr_insn_props(i))
+		return 1;
+	switch (i->op) {
+		case _avr_op_jmp:
+			return 1;
+		case _avr_op_in:
+		case _avr_op_lds:
+			return _avr_idle_read_ok(avr, i->k);
+		case _avr_op_sbic:
+		case _avr_op_sbis:
+			return _avr_idle_read_ok(avr, i->d);
+	}
+	return 0;
+}
+
+/*
+ * Called by the engines when the code jumps back to 'head', with the
+ * cycles of the jump already accounted for. Runs one turn of the loop,
+ * checking every instruction, and skips the following turns if that one
+ * was idle. Returns the pc to continue at; the caller has to check
+ * avr->state and avr->interrupt_state again, as instructions were run.
+ */
+static avr_flashaddr_t
+_avr_idle_skip(
+		avr_t * avr,
+		avr_flashaddr_t head)
+{
+	if (head == avr->idle.pc && avr->idle.backoff) {
+		avr->idle.backoff--;
+		return head;
+	}
+	/* make sure the turn can't run out of cycles midway */
+	if (avr->run_cycle_count <= AVR_IDLE_MAX_CYCLES)
+		return head;
+
+	avr_sreg_sync(avr);
+	uint8_t regs[32], sreg[8];
+	memcpy(regs, avr->data, 32);
+	memcpy(sreg, avr->sreg, 8);
+	const avr_cycle_count_t start = avr->cycle;
+	const avr_cycle_count_t end = avr->cycle + avr->run_cycle_count;
+
+	avr_flashaddr_t pc = head;
+	for (int count = 0; count < AVR_IDLE_MAX_INSN; count++) {
+		avr->pc = pc;
+		avr_insn_t * insn = _avr_fetch(avr);
+		if (!insn)
+			return 0;
+		/* the engine runs it, a call or ret could go past the budget */
+		if (!_avr_idle_insn_ok(avr, insn))
+			goto not_idle;
+		int cycle = insn->cycles;
+		pc = insn->handler(avr, insn, pc + 2, &cycle);
+		avr->cycle += cycle;
+		if (avr->state != cpu_Running || avr->interrupt_state)
+			return pc;
+		avr->run_cycle_count -= cycle;
+		if (pc == head)
+			break;
+	}
+	avr_sreg_sync(avr);
+	if (pc != head || memcmp(regs, avr->data, 32) || memcmp(sreg, avr->sreg, 8))
+		goto not_idle;
+	/* a read callback could have (re)scheduled a cycle timer */
+	if (avr->cycle + avr->run_cycle_count != end)
+		goto not_idle;
+
+	avr_cycle_count_t turn = avr->cycle - start;
+	avr_cycle_count_t skip = ((avr->run_cycle_count - 1) / turn) * turn;
+	avr->cycle += skip;
+	avr->run_cycle_count -= skip;
+	return head;
+not_idle:
+	avr->idle.pc = head;
+	avr->idle.backoff = AVR_IDLE_BACKOFF;
+	return pc;
+}
+
+/*
+ * Engine epilogue bit, for when the instruction that just ran goes to
+ * new_pc: backward jumps are checked for idle loops
+ */
+#define _AVR_IDLE_CHECK(_new_pc) \
+	if (unlikely(avr->idle_skip) && (_new_pc) <= avr->pc) { \
+		_new_pc = _avr_idle_skip(avr, _new_pc); \
+		if (avr->state != cpu_Running || avr->interrupt_state) \
+			return _new_pc; \
+	}
+
+/*
+ * Run one instruction, and as many following ones as the cycle budget
+ * allows, using the predecoded instruction cache.
+ */
+avr_flashaddr_t avr_run_one(avr_t * avr)
+{
+run_one_again:;
+	avr_insn_t * insn = _avr_fetch(avr);
+	if (!insn)
+		return 0;
+
+	int cycle = insn->cycles;
+	avr_flashaddr_t new_pc = insn->handler(avr, insn, avr->pc + 2, &cycle);
+
+	avr->cycle += cycle;
+
+	if ((avr->state == cpu_Running) &&
+		(avr->run_cycle_count > cycle) &&
+		(avr->interrupt_state == 0))
+	{
+		avr->run_cycle_count -= cycle;
+		_AVR_IDLE_CHECK(new_pc);
+		avr->pc = new_pc;
+		goto run_one_again;
+	}
 
-		default: _avr_invalid_opcode(avr);
+	return new_pc;
+}
 
+/*
+ * Same as avr_run_one(), but runs the translated block for the current pc
+ * if there is one (see sim_jit.c). A block runs only if the remaining cycle
+ * budget covers all of it, so the cycle timers fire exactly when they would
+ * have with the interpreter.
+ */
+avr_flashaddr_t avr_run_one_jit(avr_t * avr)
+{
+	int entry = 1;
+run_one_again:;
+	avr_flashaddr_t new_pc;
+	int cycle;
+
+	if (avr->interrupt_state == 0 && avr->pc < avr->flashend) {
+		avr_jit_block_t * b = avr_jit_lookup(avr, avr->pc, entry);
+		if (b && avr->run_cycle_count > b->max_cycles) {
+			cycle = b->cycles;
+			new_pc = b->code(avr, &cycle);
+			entry = 1;
+			goto block_done;
+		}
 	}
+	avr_insn_t * insn = _avr_fetch(avr);
+	if (!insn)
+		return 0;
+	cycle = insn->cycles;
+	new_pc = insn->handler(avr, insn, avr->pc + 2, &cycle);
+	entry = new_pc != avr->pc + 2;
+block_done:
 	avr->cycle += cycle;
 
 	if ((avr->state == cpu_Running) &&
@@ -1427,6 +2393,7 @@ run_one_again:
 		(avr->interrupt_state == 0))
 	{
 		avr->run_cycle_count -= cycle;
+		_AVR_IDLE_CHECK(new_pc);
 		avr->pc = new_pc;
 		goto run_one_again;
 	}
@@ -1434,4 +2401,140 @@ run_one_again:
 	return new_pc;
 }
 
+/*
+ * Threaded version of avr_run_one().
+ * Instead of calling the handler through a pointer and looping back to a
+ * single dispatch point, each handler gets its own copy of the epilogue,
+ * and jumps (computed goto) straight to the handler of the next
+ * instruction. The handlers themselves are the same, so it behaves exactly
+ * like avr_run_one(), it just gives the host branch predictor one
+ * indirect jump per instruction kind to work with.
+ */
+#define _AVR_OP_LABEL(_name) [_avr_op_##_name] = &&op_##_name,
+#define _AVR_OP_BLOCK(_name) \
+	op_##_name: \
+		new_pc = _avr_insn_##_name(avr, insn, avr->pc + 2, &cycle); \
+		_AVR_THREADED_NEXT();
+
+#define _AVR_THREADED_DISPATCH() { \
+		insn = _avr_fetch(avr); \
+		if (!insn) \
+			return 0; \
+		cycle = insn->cycles; \
+		goto *dispatch[insn->op]; \
+	}
+#define _AVR_THREADED_NEXT() { \
+		avr->cycle += cycle; \
+		if ((avr->state == cpu_Running) && \
+			(avr->run_cycle_count > cycle) && \
+			(avr->interrupt_state == 0)) { \
+			avr->run_cycle_count -= cycle; \
+			_AVR_IDLE_CHECK(new_pc); \
+			avr->pc = new_pc; \
+			_AVR_THREADED_DISPATCH(); \
+		} \
+		return new_pc; \
+	}
+
+/*
+ * gcc otherwise merges all the "goto *" back into a single one, which
+ * defeats the purpose of the exercise.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+avr_flashaddr_t avr_run_one_threaded(avr_t * avr)
+{
+	static void * const dispatch[_avr_op_count] = {
+		AVR_INSN_LIST(_AVR_OP_LABEL)
+	};
+	avr_insn_t * insn;
+	avr_flashaddr_t new_pc;
+	int cycle;
+
+	_AVR_THREADED_DISPATCH();
+
+	AVR_INSN_LIST(_AVR_OP_BLOCK)
+}
+#else /* AVR_CORE_TRACE */
+
+/*
+ * Bitmap of the registers that differ between r0..r31 copies a and b
+ */
+static inline uint32_t
+_avr_regs_changed(
+		const uint8_t * a,
+		const uint8_t * b)
+{
+	uint32_t res = 0;
+	for (int i = 0; i < 32; i += 8) {
+		uint64_t wa, wb;
+		memcpy(&wa, a + i, 8);
+		memcpy(&wb, b + i, 8);
+		if (wa == wb)
+			continue;
+		for (int r = i; r < i + 8; r++)
+			if (a[r] != b[r])
+				res |= 1 << r;
+	}
+	return res;
+}
+
+/*
+ * Same as avr_run_one(), with the traced handlers. Prints the
+ * instructions if avr->trace is set, and adds a record to the binary
+ * trace for each of them while there is one. The registers are compared
+ * before and after to get the ones an instruction changed; the data space
+ * accesses are noted by the accessors while avr->trace_rec is set.
+ * This doesn't skip idle loops, the traces have all the instructions.
+ */
+#define _AVR_OP_HANDLER(_name) [_avr_op_##_name] = _avr_insn_##_name,
+
+avr_flashaddr_t avr_run_one_trace(avr_t * avr)
+{
+	static const avr_insn_handler_t handler[_avr_op_count] = {
+		AVR_INSN_LIST(_AVR_OP_HANDLER)
+	};
+	avr_trace_ring_t * t = avr->trace_ring;
+	avr_trace_rec_t * rec = NULL;
+	uint8_t regs[32];
+run_one_again:;
+	avr_insn_t * insn = _avr_fetch(avr);
+	if (!insn)
+		return 0;
+
+	if (t) {
+		rec = avr_trace_rec_next(t);
+		rec->cycle = avr->cycle;
+		rec->pc = avr->pc;
+		rec->opcode = _avr_flash_read16le(avr, avr->pc);
+		rec->addr = rec->value = rec->flags = 0;
+		memcpy(regs, avr->data, 32);
+		avr->trace_rec = rec;
+	}
+
+	int cycle = insn->cycles;
+	avr_flashaddr_t new_pc = handler[insn->op](avr, insn, avr->pc + 2, &cycle);
 
+	if (t) {
+		avr->trace_rec = NULL;
+		rec->sp = _avr_sp_get(avr);
+		rec->touched = _avr_regs_changed(regs, avr->data);
+		avr_trace_rec_commit(t);
+	}
+	avr_dump_state(avr);
+
+	avr->cycle += cycle;
+
+	if ((avr->state == cpu_Running) &&
+		(avr->run_cycle_count > cycle) &&
+		(avr->interrupt_state == 0))
+	{
+		avr->run_cycle_count -= cycle;
+		avr->pc = new_pc;
+		goto run_one_again;
+	}
+
+	return new_pc;
+}
+#endif
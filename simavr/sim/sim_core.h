@@ -36,10 +36,78 @@ extern "C" {
 	#define FONT_DEFAULT	"\e[0m"
 #endif
 
+struct avr_insn_t;
+
+/*
+ * Instruction handler, gets the "default" new pc (the one after a 16 bits
+ * instruction), returns the real new pc and adds any extra cycles to *cycle
+ */
+typedef avr_flashaddr_t (*avr_insn_handler_t)(
+		avr_t * avr,
+		const struct avr_insn_t * i,
+		avr_flashaddr_t new_pc,
+		int * cycle);
+
+/*
+ * Predecoded instruction. There is one of these per flash word in
+ * avr->decode, they are filled lazily the first time the core executes
+ * that word, and cleared by avr_invalidate_code() when the flash changes.
+ */
+typedef struct avr_insn_t {
+	avr_insn_handler_t	handler;	// NULL when not decoded yet
+	uint16_t	opcode;		// raw opcode, for tracing
+	uint16_t	k;			// immediate, displacement, address
+	uint8_t		d, r;		// register/io operands, or small constants
+	uint8_t		cycles;		// base cycle count
+	uint8_t		op;			// handler index, for the threaded core
+} avr_insn_t;
+
+/*
+ * Returns the predecoded instruction at pc, decoding it if needed
+ */
+avr_insn_t * avr_insn_at(avr_t * avr, avr_flashaddr_t pc);
+
+/*
+ * Instruction properties, for the block translator
+ */
+enum {
+	AVR_INSN_REGONLY	= (1 << 0),	// only touches r0-r31 and SREG (not I)
+	AVR_INSN_BRANCH		= (1 << 1),	// register only, may change the pc; ends a block
+};
+uint8_t avr_insn_props(const avr_insn_t * insn);
+// true if the instruction at pc is 32 bits, the ones a skip jumps over with 2 cycles
+int avr_insn_is_32_bits(avr_t * avr, avr_flashaddr_t pc);
+
 /*
  * Instruction decoder, run ONE instruction
  */
 avr_flashaddr_t avr_run_one(avr_t * avr);
+/*
+ * Same as avr_run_one(), but uses computed goto "threaded" dispatch
+ */
+avr_flashaddr_t avr_run_one_threaded(avr_t * avr);
+/*
+ * Same as avr_run_one(), but runs the translated blocks, see sim_jit.h
+ */
+avr_flashaddr_t avr_run_one_jit(avr_t * avr);
+/*
+ * Same as avr_run_one(), but with the traced build of the core: prints the
+ * instructions if avr->trace is set, and fills a record of the binary
+ * trace for each of them if there is one, see sim_trace.h.
+ * It doesn't skip idle loops.
+ */
+avr_flashaddr_t avr_run_one_trace(avr_t * avr);
+
+/*
+ * True if 'avr' has to run with avr_run_one_trace(), the run callbacks
+ * check it before each run, so avr->trace can be set at any time
+ */
+static inline int
+avr_core_traced(
+		avr_t * avr)
+{
+	return avr->trace || avr->trace_ring;
+}
 
 /*
  * These are for internal access to the stack (for interrupts)
@@ -48,16 +116,13 @@ uint16_t _avr_sp_get(avr_t * avr);
 void _avr_sp_set(avr_t * avr, uint16_t sp);
 int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr);
 
-#if CONFIG_SIMAVR_TRACE
-
 /*
  * Get a "pretty" register name
  */
 const char * avr_regname(uint8_t reg);
 
 /*
- * DEBUG bits follow
- * These will disappear when gdb arrives
+ * DEBUG bits follow, for the avr->trace printf trace
  */
 void avr_dump_state(avr_t * avr);
 
@@ -83,17 +148,42 @@ void avr_dump_state(avr_t * avr);
 #define DUMP_STACK()
 #endif
 
-#else /* CONFIG_SIMAVR_TRACE */
+/*
+ * Lazy SREG flags. The common ALU instructions (add/sub/cp/logic) only
+ * record their operands and result in avr->sreg_lazy, and the flags are
+ * computed into avr->sreg[] when something needs to look at them.
+ * Build with -DCONFIG_SIMAVR_LAZY_SREG=0 to compute them eagerly.
+ */
+#ifndef CONFIG_SIMAVR_LAZY_SREG
+#define CONFIG_SIMAVR_LAZY_SREG 1
+#endif
+
+enum {
+	AVR_SREG_LAZY_NONE = 0,
+	AVR_SREG_LAZY_LOGIC,	// V cleared, Z N S from result
+	AVR_SREG_LAZY_ADD,		// H C V Z N S
+	AVR_SREG_LAZY_SUB,		// H C V Z N S
+	AVR_SREG_LAZY_SUB_R,	// same, Z only cleared (SBC, SBCI, CPC)
+};
 
-#define DUMP_STACK()
-#define DUMP_REG();
+void _avr_sreg_flush(avr_t * avr);
 
-#endif
+/*
+ * Bring avr->sreg[] up to date, needed before reading or changing
+ * any flag directly. (Not conditional on CONFIG_SIMAVR_LAZY_SREG, so
+ * code built with a different setting than the core still works)
+ */
+static inline void avr_sreg_sync(avr_t * avr)
+{
+	if (avr->sreg_lazy.op)
+		_avr_sreg_flush(avr);
+}
 
 /**
  * Reconstructs the SREG value from avr->sreg into dst.
  */
 #define READ_SREG_INTO(avr, dst) { \
+			avr_sreg_sync(avr); \
 			dst = 0; \
 			for (int i = 0; i < 8; i++) \
 				if (avr->sreg[i] > 1) { \
@@ -116,7 +206,8 @@ static inline void avr_sreg_set(avr_t * avr, uint8_t flag, uint8_t ival)
 				avr->interrupt_state = -2;
 		} else
 			avr->interrupt_state = 0;
-	}
+	} else
+		avr_sreg_sync(avr);
 
 	avr->sreg[flag] = ival;
 }
@@ -125,6 +216,7 @@ static inline void avr_sreg_set(avr_t * avr, uint8_t flag, uint8_t ival)
  * Splits the SREG value from src into the avr->sreg array.
  */
 #define SET_SREG_FROM(avr, src) { \
+			avr->sreg_lazy.op = AVR_SREG_LAZY_NONE; \
 			for (int i = 0; i < 8; i++) \
 				avr_sreg_set(avr, i, (src & (1 << i)) != 0); \
 		}
@@ -0,0 +1,358 @@
+/*
+	sim_cosim.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_cosim.h"
+
+#define NSEC	1000000000ULL
+
+/*
+ * Cycle of the AVR at 'time' on the board, the first one that isn't
+ * before it. Split in seconds and the rest so it doesn't overflow.
+ */
+static avr_cycle_count_t
+_avr_cosim_cycle(
+		avr_cosim_node_t * n,
+		uint64_t time)
+{
+	uint64_t f = n->avr->frequency;
+	time -= n->base;
+	return n->base_cycle + (time / NSEC) * f +
+			((time % NSEC) * f + NSEC - 1) / NSEC;
+}
+
+// time on the board of a cycle of the AVR
+static uint64_t
+_avr_cosim_time(
+		avr_cosim_node_t * n,
+		avr_cycle_count_t cycle)
+{
+	uint64_t f = n->avr->frequency;
+	cycle -= n->base_cycle;
+	return n->base + (cycle / f) * NSEC + (cycle % f) * NSEC / f;
+}
+
+static avr_cosim_node_t *
+_avr_cosim_node(
+		avr_cosim_t * c,
+		avr_irq_t * irq)
+{
+	for (int i = 0; i < c->node_count; i++)
+		if (irq->pool == &c->node[i]->avr->irq_pool)
+			return c->node[i];
+	return NULL;
+}
+
+static int
+_avr_cosim_push(
+		avr_cosim_raise_t ** r,
+		int * count,
+		int * size,
+		uint64_t when,
+		uint32_t value)
+{
+	if (*count == *size) {
+		int ns = *size ? *size * 2 : 16;
+		avr_cosim_raise_t * nr = realloc(*r, ns * sizeof(**r));
+		if (!nr)
+			return -1;
+		*r = nr;
+		*size = ns;
+	}
+	(*r)[*count].when = when;
+	(*r)[*count].value = value;
+	(*count)++;
+	return 0;
+}
+
+// raised on the source, on its thread, stamps it for the end of the quantum
+static void
+_avr_cosim_sample(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_cosim_link_t * l = (avr_cosim_link_t *)param;
+	uint64_t when = _avr_cosim_time(l->from, avr_irq_get_stamp(irq));
+	if (_avr_cosim_push(&l->out, &l->out_count, &l->out_size, when, value))
+		AVR_LOG(l->from->avr, LOG_ERROR,
+				"COSIM: %s: out of memory, raise of %s lost\n",
+				__func__, irq->name ? irq->name : "irq");
+}
+
+// cycle timer of the destination, raises what is due
+static avr_cycle_count_t
+_avr_cosim_deliver(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_cosim_link_t * l = (avr_cosim_link_t *)param;
+	while (l->in_head < l->in_count && l->in[l->in_head].when <= avr->cycle) {
+		avr_raise_irq(l->dst, l->in[l->in_head].value);
+		l->in_head++;
+	}
+	if (l->in_head < l->in_count)
+		return l->in[l->in_head].when;
+	l->in_head = l->in_count = 0;
+	return 0;
+}
+
+/*
+ * At the end of a quantum, with all the AVRs stopped: hands what the
+ * sources raised to the destinations, one quantum later
+ */
+static void
+_avr_cosim_exchange(
+		avr_cosim_t * c)
+{
+	for (int i = 0; i < c->link_count; i++) {
+		avr_cosim_link_t * l = c->link[i];
+		if (!l->out_count)
+			continue;
+		avr_t * avr = l->to->avr;
+		int armed = l->in_count > l->in_head;
+		if (l->in_head) {
+			l->in_count -= l->in_head;
+			memmove(l->in, l->in + l->in_head, l->in_count * sizeof(*l->in));
+			l->in_head = 0;
+		}
+		for (int e = 0; e < l->out_count; e++) {
+			avr_cycle_count_t cycle = _avr_cosim_cycle(l->to,
+					l->out[e].when + c->quantum);
+			if (_avr_cosim_push(&l->in, &l->in_count, &l->in_size,
+					cycle, l->out[e].value))
+				AVR_LOG(avr, LOG_ERROR,
+						"COSIM: %s: out of memory, raise of %s lost\n",
+						__func__, l->dst->name ? l->dst->name : "irq");
+		}
+		l->out_count = 0;
+		if (!armed && l->in_count > l->in_head) {
+			avr_cycle_count_t first = l->in[l->in_head].when;
+			avr_cycle_timer_register(avr,
+					first > avr->cycle ? first - avr->cycle : 0,
+					_avr_cosim_deliver, l);
+		}
+	}
+}
+
+static void
+_avr_cosim_run_node(
+		avr_cosim_node_t * n)
+{
+	avr_run_until(n->avr, n->target, NULL, NULL);
+}
+
+static void *
+_avr_cosim_thread(
+		void * param)
+{
+	avr_cosim_node_t * n = (avr_cosim_node_t *)param;
+	avr_cosim_t * c = n->cosim;
+	uint32_t seen = 0;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (c->generation == seen && !c->stop)
+			pthread_cond_wait(&c->go, &c->lock);
+		if (c->stop)
+			break;
+		seen = c->generation;
+		pthread_mutex_unlock(&c->lock);
+		_avr_cosim_run_node(n);
+		pthread_mutex_lock(&c->lock);
+		if (--c->running == 0)
+			pthread_cond_signal(&c->done);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static int
+_avr_cosim_start(
+		avr_cosim_t * c)
+{
+	c->started = 0;
+	for (int i = 0; i < c->node_count; i++) {
+		if (pthread_create(&c->node[i]->thread, NULL,
+				_avr_cosim_thread, c->node[i]))
+			return -1;
+		c->started++;
+	}
+	return 0;
+}
+
+static void
+_avr_cosim_stop(
+		avr_cosim_t * c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_broadcast(&c->go);
+	pthread_mutex_unlock(&c->lock);
+	for (int i = 0; i < c->started; i++)
+		pthread_join(c->node[i]->thread, NULL);
+	c->started = 0;
+	c->stop = 0;
+	// the next threads start from there, waiting for a quantum
+	c->generation = 0;
+}
+
+avr_cosim_t *
+avr_cosim_new(
+		uint64_t quantum,
+		int threads)
+{
+	avr_cosim_t * c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->quantum = quantum ? quantum : 1;
+	c->threads = threads;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->go, NULL);
+	pthread_cond_init(&c->done, NULL);
+	return c;
+}
+
+int
+avr_cosim_add(
+		avr_cosim_t * c,
+		avr_t * avr)
+{
+	// the threads are made again with the new one, next time it runs
+	if (c->started)
+		_avr_cosim_stop(c);
+	avr_cosim_node_t * n = calloc(1, sizeof(*n));
+	avr_cosim_node_t ** nn = realloc(c->node,
+			(c->node_count + 1) * sizeof(*nn));
+	if (!n || !nn) {
+		free(n);
+		if (nn)
+			c->node = nn;
+		return -1;
+	}
+	c->node = nn;
+	n->cosim = c;
+	n->avr = avr;
+	n->base = c->time;
+	n->base_cycle = avr->cycle;
+	c->node[c->node_count++] = n;
+	avr_set_time_policy(avr, AVR_TIME_FAST, 1);
+	return 0;
+}
+
+int
+avr_cosim_connect(
+		avr_cosim_t * c,
+		avr_irq_t * src,
+		avr_irq_t * dst)
+{
+	avr_cosim_node_t * from = _avr_cosim_node(c, src);
+	avr_cosim_node_t * to = _avr_cosim_node(c, dst);
+	if (!from || !to)
+		return -1;
+	avr_cosim_link_t * l = calloc(1, sizeof(*l));
+	avr_cosim_link_t ** nl = realloc(c->link,
+			(c->link_count + 1) * sizeof(*nl));
+	if (!l || !nl) {
+		free(l);
+		if (nl)
+			c->link = nl;
+		return -1;
+	}
+	c->link = nl;
+	l->from = from;
+	l->to = to;
+	l->src = src;
+	l->dst = dst;
+	c->link[c->link_count++] = l;
+	avr_irq_register_notify(src, _avr_cosim_sample, l);
+	return 0;
+}
+
+int
+avr_cosim_run(
+		avr_cosim_t * c,
+		uint64_t nsec)
+{
+	uint64_t end = c->time + nsec;
+	int alive = c->node_count;
+
+	if (c->threads && !c->started && _avr_cosim_start(c)) {
+		AVR_LOG(NULL, LOG_ERROR, "COSIM: %s: can't create the threads\n",
+				__func__);
+		_avr_cosim_stop(c);
+		c->threads = 0;
+	}
+	while (c->time < end && alive) {
+		uint64_t target = c->time + c->quantum;
+		if (target > end)
+			target = end;
+		for (int i = 0; i < c->node_count; i++)
+			c->node[i]->target = _avr_cosim_cycle(c->node[i], target);
+
+		if (c->started) {
+			pthread_mutex_lock(&c->lock);
+			c->running = c->started;
+			c->generation++;
+			pthread_cond_broadcast(&c->go);
+			while (c->running)
+				pthread_cond_wait(&c->done, &c->lock);
+			pthread_mutex_unlock(&c->lock);
+		} else
+			for (int i = 0; i < c->node_count; i++)
+				_avr_cosim_run_node(c->node[i]);
+
+		c->time = target;
+		_avr_cosim_exchange(c);
+		alive = 0;
+		for (int i = 0; i < c->node_count; i++)
+			if (c->node[i]->avr->state != cpu_Done &&
+					c->node[i]->avr->state != cpu_Crashed)
+				alive++;
+	}
+	return alive;
+}
+
+void
+avr_cosim_free(
+		avr_cosim_t * c)
+{
+	if (!c)
+		return;
+	_avr_cosim_stop(c);
+	for (int i = 0; i < c->link_count; i++) {
+		avr_cosim_link_t * l = c->link[i];
+		avr_irq_unregister_notify(l->src, _avr_cosim_sample, l);
+		avr_cycle_timer_cancel(l->to->avr, _avr_cosim_deliver, l);
+		free(l->out);
+		free(l->in);
+		free(l);
+	}
+	for (int i = 0; i < c->node_count; i++)
+		free(c->node[i]);
+	free(c->link);
+	free(c->node);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->go);
+	pthread_cond_destroy(&c->done);
+	free(c);
+}
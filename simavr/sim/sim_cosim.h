@@ -0,0 +1,147 @@
+/*
+	sim_cosim.h
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Co-simulation of several AVRs, on one board.
+ *
+ * The scheduler keeps a global clock, in nanoseconds, and runs all its AVRs
+ * up to the same point in time, one quantum after the other, each at its
+ * own frequency. Within a quantum the AVRs don't see each other, so they
+ * run at the same time on their own threads, and only wait for each other
+ * at the end of the quantum.
+ *
+ * The IRQs going from one AVR to another are connected through the
+ * scheduler with avr_cosim_connect(), not avr_connect_irq(). Each raise of
+ * the source is stamped with its time on the global clock, and raised on
+ * the destination one quantum later, at the cycle of the destination that
+ * is at that time (or at the end of the instruction running then). The
+ * quantum is the delay of the wires between the chips: a raise can't reach
+ * the other side in the quantum it was made in, since that one may have
+ * run past it already. Pick it below what the protocols on those wires can
+ * notice, a fraction of a UART or SPI bit for example. The results don't
+ * depend on the threads: the same AVRs run the same way with or without.
+ *
+ * The AVRs must not share anything else (parts connected to several of
+ * them, IRQs chained with avr_connect_irq()...) while they run on threads.
+ */
+#ifndef __SIM_COSIM_H__
+#define __SIM_COSIM_H__
+
+#include <pthread.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avr_cosim_node_t {
+	struct avr_cosim_t *	cosim;
+	avr_t *				avr;
+	// cycle of the AVR at time 'base' of the board, when it was added
+	avr_cycle_count_t	base_cycle;
+	uint64_t			base;
+	avr_cycle_count_t	target;	// cycle to run to, in this quantum
+	pthread_t			thread;
+} avr_cosim_node_t;
+
+typedef struct avr_cosim_raise_t {
+	uint64_t	when;	// time on the board, then cycle of the destination
+	uint32_t	value;
+} avr_cosim_raise_t;
+
+typedef struct avr_cosim_link_t {
+	avr_cosim_node_t *	from, * to;
+	avr_irq_t *			src, * dst;
+	// raised on the source in this quantum, stamped with the board time
+	avr_cosim_raise_t *	out;
+	int			out_count, out_size;
+	// waiting for their cycle on the destination
+	avr_cosim_raise_t *	in;
+	int			in_head, in_count, in_size;
+} avr_cosim_link_t;
+
+typedef struct avr_cosim_t {
+	uint64_t	time;		// of the board, in nanoseconds
+	uint64_t	quantum;
+	int			threads;
+	int			node_count;
+	avr_cosim_node_t **	node;
+	int			link_count;
+	avr_cosim_link_t **	link;
+
+	// the threads run a quantum each time 'generation' changes
+	pthread_mutex_t	lock;
+	pthread_cond_t	go, done;
+	uint32_t	generation;
+	int			running;	// threads still in the quantum
+	int			stop;
+	int			started;
+} avr_cosim_t;
+
+/*
+ * Makes a scheduler that runs its AVRs 'quantum' nanoseconds at a time,
+ * on a thread each if 'threads' is set, one after the other on the caller's
+ * thread if not. Returns NULL if out of memory.
+ */
+avr_cosim_t *
+avr_cosim_new(
+		uint64_t quantum,
+		int threads);
+/*
+ * Adds 'avr' to the board, from the current time of the board on. The
+ * scheduler is its clock from then on: its time policy is set to
+ * AVR_TIME_FAST, so it doesn't wait in real time when it sleeps.
+ * Returns 0, or -1 if out of memory.
+ */
+int
+avr_cosim_add(
+		avr_cosim_t * c,
+		avr_t * avr);
+/*
+ * Connects 'src', an IRQ of one of the AVRs of the board (or of a part
+ * allocated in its IRQ pool) to 'dst', of another (or the same) one: what
+ * is raised on 'src' is raised on 'dst' one quantum later.
+ * Returns 0, or -1 if either IRQ doesn't belong to an AVR of the board.
+ */
+int
+avr_cosim_connect(
+		avr_cosim_t * c,
+		avr_irq_t * src,
+		avr_irq_t * dst);
+/*
+ * Runs the board for 'nsec' nanoseconds, or until all its AVRs are done
+ * or crashed. Returns the number of AVRs still running.
+ */
+int
+avr_cosim_run(
+		avr_cosim_t * c,
+		uint64_t nsec);
+/*
+ * Stops the threads, disconnects the IRQs and frees the scheduler. The AVRs
+ * are left as they are, to be terminated by their owner.
+ */
+void
+avr_cosim_free(
+		avr_cosim_t * c);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_COSIM_H__ */
@@ -25,42 +25,70 @@
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_cycle_timers.h"
+#include "sim_snapshot.h"
 
 #define QUEUE(__q, __e) { \
 		(__e)->next = (__q); \
 		(__q) = __e; \
 	}
-#define DETACH(__q, __l, __e) { \
-		if (__l) \
-			(__l)->next = (__e)->next; \
-		else \
-			(__q) = (__e)->next; \
-	}
-#define INSERT(__q, __l, __e) { \
-		if (__l) { \
-			(__e)->next = (__l)->next; \
-			(__l)->next = (__e); \
-		} else { \
-			(__e)->next = (__q); \
-			(__q) = (__e); \
-		} \
-	}
 
 #define DEFAULT_SLEEP_CYCLES 1000
 
+/*
+ * slot->index, for the slots not in the heap while the due timers run,
+ * see avr_cycle_timer_process()
+ */
+enum {
+	AVR_CYCLE_TIMER_DUE = -1,		// waiting to run, or to go back in the heap
+	AVR_CYCLE_TIMER_DONE = -2,		// running, or ran and is to be freed; ignored by the hash
+	AVR_CYCLE_TIMER_CANCELLED = -3,	// cancelled while waiting
+};
+
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
-	memset(pool, 0, sizeof(*pool));
-	// queue all slots into the free queue
-	for (int i = 0; i < MAX_CYCLE_TIMERS; i++) {
-		avr_cycle_timer_slot_p t = &pool->timer_slots[i];
-		QUEUE(pool->timer_free, t);
-	}
+	// queue all slots into the free queue, they're all allocated already
+	pool->timer_free = NULL;
+	for (avr_cycle_timer_chunk_t * c = pool->chunks; c; c = c->next)
+		for (int i = 0; i < AVR_CYCLE_TIMER_CHUNK; i++) {
+			avr_cycle_timer_slot_p t = &c->slot[i];
+			QUEUE(pool->timer_free, t);
+		}
+	pool->count = 0;
+	pool->seq = 0;
+	if (pool->hash)
+		memset(pool->hash, 0, pool->hash_size * sizeof(pool->hash[0]));
+	uint32_t slots = pool->stats.slots;
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	pool->stats.slots = slots;
 	avr->run_cycle_count = 1;
-	avr->run_cycle_limit = 1;
+}
+
+void
+avr_cycle_timer_terminate(
+		struct avr_t * avr)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	while (pool->chunks) {
+		avr_cycle_timer_chunk_t * c = pool->chunks;
+		pool->chunks = c->next;
+		free(c);
+	}
+	free(pool->heap);
+	free(pool->due);
+	free(pool->hash);
+	memset(pool, 0, sizeof(*pool));
+}
+
+void
+avr_cycle_timer_get_stats(
+		struct avr_t * avr,
+		avr_cycle_timer_stats_t * stats)
+{
+	*stats = avr->cycle_timers.stats;
+	stats->active = avr->cycle_timers.count;
 }
 
 static avr_cycle_count_t
@@ -85,9 +113,9 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 	avr_cycle_count_t sleep_cycle_count = DEFAULT_SLEEP_CYCLES;
 
-	if(pool->timer) {
-		if(pool->timer->when > avr->cycle) {
-			sleep_cycle_count = pool->timer->when - avr->cycle;
+	if(pool->count) {
+		if(pool->heap[0]->when > avr->cycle) {
+			sleep_cycle_count = pool->heap[0]->when - avr->cycle;
 		} else {
 			sleep_cycle_count = 0;
 		}
@@ -96,6 +124,192 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_return_sleep_run_cycles_limited(avr, sleep_cycle_count);
 }
 
+static inline int
+avr_cycle_timer_before(
+		avr_cycle_timer_slot_p a,
+		avr_cycle_timer_slot_p b)
+{
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static inline void
+avr_cycle_timer_heap_set(
+		avr_cycle_timer_pool_t * pool,
+		int i,
+		avr_cycle_timer_slot_p t)
+{
+	pool->heap[i] = t;
+	t->index = i;
+}
+
+static void
+avr_cycle_timer_sift_up(
+		avr_cycle_timer_pool_t * pool,
+		int i)
+{
+	avr_cycle_timer_slot_p t = pool->heap[i];
+	while (i) {
+		int parent = (i - 1) / 2;
+		if (!avr_cycle_timer_before(t, pool->heap[parent]))
+			break;
+		avr_cycle_timer_heap_set(pool, i, pool->heap[parent]);
+		i = parent;
+	}
+	avr_cycle_timer_heap_set(pool, i, t);
+}
+
+static void
+avr_cycle_timer_sift_down(
+		avr_cycle_timer_pool_t * pool,
+		int i)
+{
+	avr_cycle_timer_slot_p t = pool->heap[i];
+	for (;;) {
+		int child = (2 * i) + 1;
+		if (child >= pool->count)
+			break;
+		if (child + 1 < pool->count &&
+				avr_cycle_timer_before(pool->heap[child + 1], pool->heap[child]))
+			child++;
+		if (!avr_cycle_timer_before(pool->heap[child], t))
+			break;
+		avr_cycle_timer_heap_set(pool, i, pool->heap[child]);
+		i = child;
+	}
+	avr_cycle_timer_heap_set(pool, i, t);
+}
+
+static inline avr_cycle_timer_slot_p *
+avr_cycle_timer_bucket(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	uintptr_t h = (uintptr_t)timer ^ ((uintptr_t)param * 0x9e3779b1u);
+	h ^= h >> 16;
+	return &pool->hash[(h ^ (h >> 7)) & (pool->hash_size - 1)];
+}
+
+static void
+avr_cycle_timer_hash(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	avr_cycle_timer_slot_p * b = avr_cycle_timer_bucket(pool, t->timer, t->param);
+	t->next = *b;
+	*b = t;
+}
+
+static void
+avr_cycle_timer_unhash(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	avr_cycle_timer_slot_p * b = avr_cycle_timer_bucket(pool, t->timer, t->param);
+	while (*b != t)
+		b = &(*b)->next;
+	*b = t->next;
+	t->next = NULL;
+}
+
+/*
+ * Adds a chunk of free slots, and makes room for them in the heap and
+ * the hash. Returns zero if we're out of memory.
+ */
+static int
+avr_cycle_timer_grow(
+		avr_cycle_timer_pool_t * pool)
+{
+	int slots = pool->stats.slots + AVR_CYCLE_TIMER_CHUNK;
+	avr_cycle_timer_slot_p * heap = realloc(pool->heap, slots * sizeof(heap[0]));
+	if (!heap)
+		return 0;
+	pool->heap = heap;
+	avr_cycle_timer_slot_p * due = realloc(pool->due, slots * sizeof(due[0]));
+	if (!due)
+		return 0;
+	pool->due = due;
+
+	if (slots > pool->hash_size) {
+		int size = pool->hash_size ? pool->hash_size : AVR_CYCLE_TIMER_CHUNK;
+		while (size < slots)
+			size *= 2;
+		avr_cycle_timer_slot_p * hash = calloc(size, sizeof(hash[0]));
+		if (!hash)
+			return 0;
+		avr_cycle_timer_slot_p * old = pool->hash;
+		int old_size = pool->hash_size;
+		pool->hash = hash;
+		pool->hash_size = size;
+		for (int i = 0; i < old_size; i++)
+			while (old[i]) {
+				avr_cycle_timer_slot_p t = old[i];
+				old[i] = t->next;
+				avr_cycle_timer_hash(pool, t);
+			}
+		free(old);
+	}
+
+	avr_cycle_timer_chunk_t * c = calloc(1, sizeof(*c));
+	if (!c)
+		return 0;
+	c->next = pool->chunks;
+	pool->chunks = c;
+	for (int i = 0; i < AVR_CYCLE_TIMER_CHUNK; i++) {
+		avr_cycle_timer_slot_p t = &c->slot[i];
+		QUEUE(pool->timer_free, t);
+	}
+	pool->stats.slots = slots;
+	return 1;
+}
+
+/*
+ * Finds the active timer for (timer, param). There can be two if a callback
+ * re-registered itself and also returned a new cycle, in that case it's the
+ * one that fires first, same as a search of the sorted list would find.
+ */
+static avr_cycle_timer_slot_p
+avr_cycle_timer_find(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	avr_cycle_timer_slot_p res = NULL;
+	for (avr_cycle_timer_slot_p t = *avr_cycle_timer_bucket(pool, timer, param); t; t = t->next)
+		if (t->timer == timer && t->param == param &&
+				t->index != AVR_CYCLE_TIMER_DONE &&
+				(!res || avr_cycle_timer_before(t, res)))
+			res = t;
+	return res;
+}
+
+static void
+avr_cycle_timer_heap_push(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	avr_cycle_timer_heap_set(pool, pool->count++, t);
+	avr_cycle_timer_sift_up(pool, t->index);
+	if (pool->count > pool->stats.peak)
+		pool->stats.peak = pool->count;
+}
+
+static void
+avr_cycle_timer_heap_remove(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	int i = t->index;
+	avr_cycle_timer_slot_p last = pool->heap[--pool->count];
+	if (last != t) {
+		avr_cycle_timer_heap_set(pool, i, last);
+		if (i && avr_cycle_timer_before(last, pool->heap[(i - 1) / 2]))
+			avr_cycle_timer_sift_up(pool, i);
+		else
+			avr_cycle_timer_sift_down(pool, i);
+	}
+}
+
 // no sanity checks checking here, on purpose
 static void
 avr_cycle_timer_insert(
@@ -108,28 +322,22 @@ avr_cycle_timer_insert(
 
 	when += avr->cycle;
 
-	avr_cycle_timer_slot_p t = pool->timer_free;
-
-	if (!t) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: ran out of timers (%d)!\n", __func__, MAX_CYCLE_TIMERS);
+	if (!pool->timer_free && !avr_cycle_timer_grow(pool)) {
+		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: out of memory for timers (%d)!\n",
+				__func__, pool->stats.slots);
 		return;
 	}
+	avr_cycle_timer_slot_p t = pool->timer_free;
 	// detach head
 	pool->timer_free = t->next;
-	t->next = NULL;
 	t->timer = timer;
 	t->param = param;
 	t->when = when;
+	t->seq = pool->seq++;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p loop = pool->timer, last = NULL;
-	while (loop) {
-		if (loop->when > when)
-			break;
-		last = loop;
-		loop = loop->next;
-	}
-	INSERT(pool->timer, last, t);
+	avr_cycle_timer_hash(pool, t);
+	avr_cycle_timer_heap_push(pool, t);
+	pool->stats.inserts++;
 }
 
 void
@@ -139,15 +347,9 @@ avr_cycle_timer_register(
 		avr_cycle_timer_t timer,
 		void * param)
 {
-	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
-
 	// remove it if it was already scheduled
 	avr_cycle_timer_cancel(avr, timer, param);
 
-	if (!pool->timer_free) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: pool is full (%d)!\n", __func__, MAX_CYCLE_TIMERS);
-		return;
-	}
 	avr_cycle_timer_insert(avr, when, timer, param);
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
@@ -170,16 +372,16 @@ avr_cycle_timer_cancel(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer, last = NULL;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			DETACH(pool->timer, last, t);
+	avr_cycle_timer_slot_p t = pool->hash ?
+			avr_cycle_timer_find(pool, timer, param) : NULL;
+	if (t) {
+		avr_cycle_timer_unhash(pool, t);
+		if (t->index >= 0) {
+			avr_cycle_timer_heap_remove(pool, t);
 			QUEUE(pool->timer_free, t);
-			break;
-		}
-		last = t;
-		t = t->next;
+		} else	// due, avr_cycle_timer_process() will free it
+			t->index = AVR_CYCLE_TIMER_CANCELLED;
+		pool->stats.cancels++;
 	}
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
@@ -195,22 +397,23 @@ avr_cycle_timer_status(
 		void * param)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	avr_cycle_timer_slot_p t = pool->hash ?
+			avr_cycle_timer_find(pool, timer, param) : NULL;
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			return 1 + (t->when - avr->cycle);
-		}
-		t = t->next;
-	}
-	return 0;
+	return t ? 1 + (t->when - avr->cycle) : 0;
 }
 
 /*
  * run through all the timers, call the ones that needs it,
  * clear the ones that wants it, and calculate the next
  * potential cycle we could sleep for...
+ *
+ * All the timers due are taken out of the heap in one go, and run in
+ * order. They stay in the hash meanwhile, so the callbacks can still
+ * cancel them or get their status; the ones rescheduled go back in the
+ * heap together at the end. A timer registered by a callback for a cycle
+ * already reached goes in the heap, it runs in the next round, after the
+ * ones already due: same order as if they had run one at a time.
  */
 avr_cycle_count_t
 avr_cycle_timer_process(
@@ -218,32 +421,160 @@ avr_cycle_timer_process(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	if (pool->timer) do {
-		avr_cycle_timer_slot_p t = pool->timer;
-		avr_cycle_count_t when = t->when;
-
-		if (when > avr->cycle)
-			return avr_cycle_timer_return_sleep_run_cycles_limited(avr, when - avr->cycle);
-
-		// detach from active timers
-		pool->timer = t->next;
-		t->next = NULL;
+	while (pool->count && pool->heap[0]->when <= avr->cycle) {
+		int due = 0;
 		do {
-			avr_cycle_count_t w = t->timer(avr, when, t->param);
-			// make sure the return value is either zero, or greater
-			// than the last one to prevent infinite loop here
-			when = w > when ? w : 0;
-		} while (when && when <= avr->cycle);
-		
-		if (when) // reschedule then
-			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param);
-		
-		// requeue this one into the free ones
-		QUEUE(pool->timer_free, t);
-	} while (pool->timer);
+			avr_cycle_timer_slot_p t = pool->heap[0];
+			avr_cycle_timer_heap_remove(pool, t);
+			t->index = AVR_CYCLE_TIMER_DUE;
+			pool->due[due++] = t;
+		} while (pool->count && pool->heap[0]->when <= avr->cycle);
+
+		for (int i = 0; i < due; i++) {
+			avr_cycle_timer_slot_p t = pool->due[i];
+			if (t->index == AVR_CYCLE_TIMER_CANCELLED)
+				continue;
+			// a running timer can't be found, it can only register again
+			t->index = AVR_CYCLE_TIMER_DONE;
+			avr_cycle_count_t when = t->when;
+			do {
+				avr_cycle_count_t w = t->timer(avr, when, t->param);
+				pool->stats.fired++;
+				// make sure the return value is either zero, or greater
+				// than the last one to prevent infinite loop here
+				when = w > when ? w : 0;
+			} while (when && when <= avr->cycle);
+
+			if (when) { // reschedule then
+				t->when = when;
+				t->seq = pool->seq++;
+				t->index = AVR_CYCLE_TIMER_DUE;
+				pool->stats.inserts++;
+			}
+		}
+		for (int i = 0; i < due; i++) {
+			avr_cycle_timer_slot_p t = pool->due[i];
+			if (t->index == AVR_CYCLE_TIMER_DUE)
+				avr_cycle_timer_heap_push(pool, t);
+			else {	// requeue this one into the free ones
+				if (t->index == AVR_CYCLE_TIMER_DONE)
+					avr_cycle_timer_unhash(pool, t);
+				QUEUE(pool->timer_free, t);
+			}
+		}
+	}
+	if (pool->count)
+		return avr_cycle_timer_return_sleep_run_cycles_limited(avr,
+				pool->heap[0]->when - avr->cycle);
 
 	// original behavior was to return 1000 cycles when no timers were present...
 	// run_cycles are bound to at least one cycle but no more than requested limit...
 	//	value passed here is returned unbounded, thus preserving original behavior.
 	return avr_cycle_timer_return_sleep_run_cycles_limited(avr, DEFAULT_SLEEP_CYCLES);
 }
+
+// frees all the active timers, the stats are left alone
+static void
+avr_cycle_timer_clear(
+		avr_cycle_timer_pool_t * pool)
+{
+	while (pool->count) {
+		avr_cycle_timer_slot_p t = pool->heap[--pool->count];
+		avr_cycle_timer_unhash(pool, t);
+		QUEUE(pool->timer_free, t);
+	}
+}
+
+// adds a timer as it was in another pool, returns zero if out of memory
+static int
+avr_cycle_timer_copy(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_count_t when,
+		uint64_t seq,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	if (!pool->timer_free && !avr_cycle_timer_grow(pool))
+		return 0;
+	avr_cycle_timer_slot_p t = pool->timer_free;
+	pool->timer_free = t->next;
+	t->when = when;
+	t->seq = seq;
+	t->timer = timer;
+	t->param = param;
+	avr_cycle_timer_hash(pool, t);
+	avr_cycle_timer_heap_push(pool, t);
+	return 1;
+}
+
+// a timer in a snapshot, the callback and param are saved as they are
+typedef struct avr_cycle_timer_saved_t {
+	avr_cycle_count_t	when;
+	uint64_t			seq;
+	avr_cycle_timer_t	timer;
+	void *				param;
+} avr_cycle_timer_saved_t;
+
+void
+avr_cycle_timer_serialize(
+		avr_t * avr,
+		struct avr_snapshot_t * s)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+
+	avr_snapshot_put(s, &pool->seq, sizeof(pool->seq));
+	for (int i = 0; i < pool->count; i++) {
+		avr_cycle_timer_slot_p t = pool->heap[i];
+		avr_cycle_timer_saved_t saved = {
+			.when = t->when, .seq = t->seq, .timer = t->timer, .param = t->param,
+		};
+		avr_snapshot_put(s, &saved, sizeof(saved));
+	}
+}
+
+int
+avr_cycle_timer_deserialize(
+		avr_t * avr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+
+	if (size < sizeof(pool->seq) ||
+			(size - sizeof(pool->seq)) % sizeof(avr_cycle_timer_saved_t))
+		return -1;
+	avr_cycle_timer_clear(pool);
+	memcpy(&pool->seq, data, sizeof(pool->seq));
+	for (uint32_t o = sizeof(pool->seq); o < size; o += sizeof(avr_cycle_timer_saved_t)) {
+		avr_cycle_timer_saved_t saved;
+		memcpy(&saved, data + o, sizeof(saved));
+		if (!avr_cycle_timer_copy(pool, saved.when, saved.seq, saved.timer, saved.param))
+			return -1;
+	}
+	return 0;
+}
+
+int
+avr_cycle_timer_clone(
+		avr_t * avr,
+		avr_t * from)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	avr_cycle_timer_pool_t * fpool = &from->cycle_timers;
+	uint8_t * base = (uint8_t *)from;
+
+	avr_cycle_timer_clear(pool);
+	pool->seq = fpool->seq;
+	for (int i = 0; i < fpool->count; i++) {
+		avr_cycle_timer_slot_p t = fpool->heap[i];
+		uint8_t * param = t->param;
+		if (param) {
+			if (param < base || param >= base + from->core_size)
+				continue;	// not part of the AVR
+			param = (uint8_t *)avr + (param - base);
+		}
+		if (!avr_cycle_timer_copy(pool, t->when, t->seq, t->timer, param))
+			return -1;
+	}
+	return 0;
+}
@@ -24,9 +24,11 @@
  * these timers are one shots, then get cleared if the timer function returns zero,
  * they get reset if the callback function returns a new cycle number
  *
- * the implementation maintains a list of 'pending' timers, sorted by when they
- * should run, it allows very quick comparison with the next timer to run, and
- * quick removal of then from the pile once dispatched.
+ * the implementation keeps the 'pending' timers in a binary heap, ordered by
+ * when they should run (and by order of registration for the ones due on the
+ * same cycle), so the next timer to run is always at the top. The pending
+ * timers are also hashed by (timer, param), which is what identifies a timer
+ * for the API, so cancelling it or getting its status doesn't need a search.
  */
 #ifndef __SIM_CYCLE_TIMERS_H___
 #define __SIM_CYCLE_TIMERS_H___
@@ -37,7 +39,8 @@
 extern "C" {
 #endif
 
-#define MAX_CYCLE_TIMERS	64
+// the slot pool grows by chunks of that many timers, as needed
+#define AVR_CYCLE_TIMER_CHUNK	64
 
 typedef avr_cycle_count_t (*avr_cycle_timer_t)(
 		struct avr_t * avr,
@@ -55,22 +58,49 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
  * repeteadly until it 'caches up'.
  */
 typedef struct avr_cycle_timer_slot_t {
-	struct avr_cycle_timer_slot_t *next;
+	struct avr_cycle_timer_slot_t *next;	// free queue, or hash chain
 	avr_cycle_count_t	when;
+	uint64_t			seq;	// registration order, breaks ties on 'when'
 	avr_cycle_timer_t	timer;
 	void * param;
+	int					index;	// position in the heap
 } avr_cycle_timer_slot_t, *avr_cycle_timer_slot_p;
 
+typedef struct avr_cycle_timer_chunk_t {
+	struct avr_cycle_timer_chunk_t * next;
+	avr_cycle_timer_slot_t slot[AVR_CYCLE_TIMER_CHUNK];
+} avr_cycle_timer_chunk_t;
+
+/*
+ * Usage counters, see avr_cycle_timer_get_stats(). They are cleared
+ * when the AVR is reset.
+ */
+typedef struct avr_cycle_timer_stats_t {
+	uint32_t	slots;		// slots allocated
+	uint32_t	active;		// timers pending now
+	uint32_t	peak;		// most timers pending at once
+	uint64_t	inserts;	// timers scheduled, including the rescheduled ones
+	uint64_t	cancels;	// pending timers cancelled, including by a register
+	uint64_t	fired;		// callbacks called
+} avr_cycle_timer_stats_t;
+
 /*
  * Timer pool contains a pool of timer slots available, they all
  * start queued into the 'free' qeueue, are migrated to the
- * 'active' queue when needed and are re-queued to the free one
- * when done
+ * 'active' heap (and hash) when needed and are re-queued to the free
+ * one when done. The slots are allocated by chunks when the free queue
+ * runs out, and only freed by avr_terminate()
  */
 typedef struct avr_cycle_timer_pool_t {
-	avr_cycle_timer_slot_t timer_slots[MAX_CYCLE_TIMERS];
+	avr_cycle_timer_chunk_t * chunks;
 	avr_cycle_timer_slot_p timer_free;
-	avr_cycle_timer_slot_p timer;
+	avr_cycle_timer_slot_p * heap;	// room for all the slots
+	avr_cycle_timer_slot_p * due;	// timers being run by avr_cycle_timer_process()
+	int count;		// active timers in the heap
+	uint64_t seq;
+	avr_cycle_timer_slot_p * hash;
+	int hash_size;	// power of two
+	avr_cycle_timer_stats_t stats;
 } avr_cycle_timer_pool_t, *avr_cycle_timer_pool_p;
 
 
@@ -104,6 +134,12 @@ avr_cycle_timer_status(
 		avr_cycle_timer_t timer,
 		void * param);
 
+// get the usage counters of the timer pool
+void
+avr_cycle_timer_get_stats(
+		struct avr_t * avr,
+		avr_cycle_timer_stats_t * stats);
+
 //
 // Private, called from the core
 //
@@ -113,6 +149,29 @@ avr_cycle_timer_process(
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr);
+void
+avr_cycle_timer_terminate(
+		struct avr_t * avr);
+
+struct avr_snapshot_t;
+//
+// Private, for sim_snapshot.c: save the active timers, and replace them
+// with the saved ones, or with those of the AVR 'avr' is a clone of that
+// have no param, or a param in its core struct, moved to the clone
+//
+void
+avr_cycle_timer_serialize(
+		struct avr_t * avr,
+		struct avr_snapshot_t * s);
+int
+avr_cycle_timer_deserialize(
+		struct avr_t * avr,
+		const uint8_t * data,
+		uint32_t size);
+int
+avr_cycle_timer_clone(
+		struct avr_t * avr,
+		struct avr_t * from);
 
 #ifdef __cplusplus
 };
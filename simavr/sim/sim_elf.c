@@ -54,8 +54,10 @@ avr_load_firmware(
 		avr->avcc = firmware->avcc;
 	if (firmware->aref)
 		avr->aref = firmware->aref;
-#if CONFIG_SIMAVR_TRACE && ELF_SYMBOLS
+#if ELF_SYMBOLS
+	// symbol of each code word, for the avr->trace printf trace
 	int scount = firmware->flashsize >> 1;
+	free(avr->trace_data->codeline);
 	avr->trace_data->codeline = malloc(scount * sizeof(avr_symbol_t*));
 	memset(avr->trace_data->codeline, 0, scount * sizeof(avr_symbol_t*));
 
@@ -36,6 +36,7 @@ extern "C" {
  * "fake" a non-Harvard addressing space for the AVR
  */
 #define AVR_SEGMENT_OFFSET_FLASH 0
+#define AVR_SEGMENT_OFFSET_DATA 0x00800000
 #define AVR_SEGMENT_OFFSET_EEPROM 0x00810000
 
 #include "sim_avr.h"
@@ -175,6 +175,20 @@ gdb_watch_clear(
 	w->len = 0;
 }
 
+/*
+ * Flag the data pages that have watchpoints, so the core doesn't
+ * skip the checks for them
+ */
+static void
+gdb_watch_update_pages(
+		avr_gdb_t * g )
+{
+	avr_data_page_clear(g->avr, 0, 0x10000, AVR_DATA_PAGE_WATCH);
+	for (int i = 0; i < g->watchpoints.len; i++)
+		avr_data_page_set(g->avr, g->watchpoints.points[i].addr,
+				g->watchpoints.points[i].size, AVR_DATA_PAGE_WATCH);
+}
+
 static void
 gdb_send_reply(
 		avr_gdb_t * g,
@@ -405,6 +419,7 @@ gdb_handle_command(
 				break;
 			}
 			if (addr < 0xffff) {
+				avr_invalidate_code(avr, addr, len);
 				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
 				gdb_send_reply(g, "OK");
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
@@ -457,6 +472,7 @@ gdb_handle_command(
 						gdb_send_reply(g, "E01");
 						break;
 					}
+					gdb_watch_update_pages(g);
 
 					gdb_send_reply(g, "OK");
 					break;
@@ -517,6 +533,7 @@ gdb_network_handler(
 			close(g->s);
 			gdb_watch_clear(&g->breakpoints);
 			gdb_watch_clear(&g->watchpoints);
+			gdb_watch_update_pages(g);
 			g->avr->state = cpu_Running;	// resume
 			g->s = -1;
 			return 1;
@@ -674,7 +691,7 @@ avr_deinit_gdb(
 {
 	if (!avr->gdb)
 		return;
-	avr->run = avr_callback_run_raw; // restore normal callbacks
+	avr->run = AVR_DEFAULT_RUN; // restore normal callbacks
 	avr->sleep = avr_callback_sleep_raw;
 	if (avr->gdb->listen != -1)
 		close(avr->gdb->listen);
@@ -682,6 +699,7 @@ avr_deinit_gdb(
 	if (avr->gdb->s != -1)
 		close(avr->gdb->s);
 	avr->gdb->s = -1;
+	avr_data_page_clear(avr, 0, 0x10000, AVR_DATA_PAGE_WATCH);
 	free(avr->gdb);
 	avr->gdb = NULL;
 
@@ -28,8 +28,6 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 
-DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
-
 void
 avr_interrupt_init(
 		avr_t * avr )
@@ -50,7 +48,7 @@ avr_interrupt_reset(
 	avr_int_table_p table = &avr->interrupts;
 
 	table->running_ptr = 0;
-	avr_int_pending_reset(&table->pending);
+	table->pending = 0;
 	avr->interrupt_state = 0;
 	for (int i = 0; i < table->vector_count; i++)
 		table->vector[i]->pending = 0;
@@ -73,7 +71,25 @@ avr_register_vector(
 	avr_init_irq(&avr->irq_pool, vector->irq,
 			vector->vector * 256, // base number
 			AVR_INT_IRQ_COUNT, names);
-	table->vector[table->vector_count++] = vector;
+	if (table->vector_count == AVR_INT_MAX_VECTORS) {
+		AVR_LOG(avr, LOG_ERROR, "IRQ%d too many vectors!\n", vector->vector);
+		return;
+	}
+	/*
+	 * Keep the table sorted by vector number, so the lowest bit set in
+	 * the pending map is the one with the highest priority.
+	 */
+	int i = table->vector_count++;
+	for (; i > 0 && table->vector[i-1]->vector > vector->vector; i--) {
+		table->vector[i] = table->vector[i-1];
+		table->vector[i]->index = i;
+	}
+	table->vector[i] = vector;
+	vector->index = i;
+	uint64_t below = (1ULL << i) - 1;
+	table->pending = (table->pending & below) | ((table->pending & ~below) << 1);
+	if (vector->pending)
+		table->pending |= 1ULL << i;
 	if (vector->trace)
 		printf("IRQ%d registered (enabled %04x:%d)\n",
 			vector->vector, vector->enable.reg, vector->enable.bit);
@@ -88,7 +104,16 @@ avr_has_pending_interrupts(
 		avr_t * avr)
 {
 	avr_int_table_p table = &avr->interrupts;
-	return !avr_int_pending_isempty(&table->pending);
+	return table->pending != 0;
+}
+
+// vector number of the highest priority pending interrupt, if any
+static uint8_t
+_avr_pending_vector(
+		avr_int_table_p table)
+{
+	return table->pending ?
+			table->vector[__builtin_ctzll(table->pending)]->vector : 0;
 }
 
 int
@@ -135,12 +160,19 @@ avr_raise_interrupt(
 
 	// If the interrupt is enabled, attempt to wake the core
 	if (avr_regbit_get(avr, vector->enable)) {
+		/*
+		 * It needs a bit in the pending map, that avr_register_vector()
+		 * gives it. Doing that here would reset its IRQs, and shift the
+		 * bits of the others under the snapshots.
+		 */
+		if (avr->interrupts.vector[vector->index] != vector) {
+			AVR_LOG(avr, LOG_ERROR, "IRQ%d raised but not registered\n",
+					vector->vector);
+			return 0;
+		}
 		// Mark the interrupt as pending
 		vector->pending = 1;
-
-		avr_int_table_p table = &avr->interrupts;
-
-		avr_int_pending_write(&table->pending, vector);
+		avr->interrupts.pending |= 1ULL << vector->index;
 
 		if (avr->sreg[S_I] && avr->interrupt_state == 0)
 			avr->interrupt_state = 1;
@@ -165,13 +197,14 @@ avr_clear_interrupt(
 	if (vector->trace)
 		printf("IRQ%d cleared\n", vector->vector);
 	vector->pending = 0;
+	// a vector never raised has no bit, 'index' 0 is someone else's
+	if (avr->interrupts.vector[vector->index] == vector)
+		avr->interrupts.pending &= ~(1ULL << vector->index);
 
 	avr_raise_irq(vector->irq + AVR_INT_IRQ_PENDING, 0);
 	avr_raise_irq_float(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr) ?
-					avr_int_pending_read_at(
-							&avr->interrupts.pending, 0)->vector : 0,
-							!avr_has_pending_interrupts(avr));
+			_avr_pending_vector(&avr->interrupts),
+			!avr_has_pending_interrupts(avr));
 
 	if (vector->raised.reg && !vector->raise_sticky)
 		avr_regbit_clear(avr, vector->raised);
@@ -244,30 +277,21 @@ avr_service_interrupts(
 
 	avr_int_table_p table = &avr->interrupts;
 
-	// how many are pending...
-	int cnt = avr_int_pending_get_read_size(&table->pending);
-	// locate the highest priority one
-	int min = 0xff;
-	int mini = 0;
-	for (int ii = 0; ii < cnt; ii++) {
-		avr_int_vector_t * v = avr_int_pending_read_at(&table->pending, ii);
-		if (v->vector < min) {
-			min = v->vector;
-			mini = ii;
-		}
+	// cleared since it was raised?
+	if (!table->pending) {
+		avr->interrupt_state = 0;
+		return;
 	}
-	avr_int_vector_t * vector = avr_int_pending_read_at(&table->pending, mini);
-
-	// now move the one at the front of the fifo in the slot of
-	// the one we service
-	table->pending.buffer[(table->pending.read + mini) % avr_int_pending_fifo_size] =
-			avr_int_pending_read(&table->pending);
+	// the highest priority one, taken out of the pending map
+	int bit = __builtin_ctzll(table->pending);
+	avr_int_vector_t * vector = table->vector[bit];
+	table->pending &= ~(1ULL << bit);
 	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
 			avr_has_pending_interrupts(avr));
 
 	// if that single interrupt is masked, ignore it and continue
-	// could also have been disabled, or cleared
-	if (!avr_regbit_get(avr, vector->enable) || !vector->pending) {
+	// could also have been disabled
+	if (!avr_regbit_get(avr, vector->enable)) {
 		vector->pending = 0;
 		avr->interrupt_state = avr_has_pending_interrupts(avr);
 	} else {
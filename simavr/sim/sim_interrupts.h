@@ -24,7 +24,6 @@
 
 #include "sim_avr_types.h"
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,20 +43,21 @@ typedef struct avr_int_vector_t {
 
 	// 'pending' IRQ, and 'running' status as signaled here
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
-	uint8_t			pending : 1,	// 1 while scheduled in the fifo
+	uint8_t			index;			// in the table's vector[], and bit in its pending map
+	uint8_t			pending : 1,	// 1 while set in the table's pending map
 					trace : 1,		// only for debug of a vector
 					raise_sticky : 1;	// 1 if the interrupt flag (= the raised regbit) is not cleared
 										// by the hardware when executing the interrupt routine (see TWINT)
 } avr_int_vector_t, *avr_int_vector_p;
 
-// Size needs to be >= max number of vectors, and a power of two
-DECLARE_FIFO(avr_int_vector_p, avr_int_pending, 64);
+#define AVR_INT_MAX_VECTORS	64
 
 // interrupt vectors, and their enable/clear registers
 typedef struct  avr_int_table_t {
-	avr_int_vector_t * vector[64];
+	// sorted by vector number, which is also their priority
+	avr_int_vector_t * vector[AVR_INT_MAX_VECTORS];
 	uint8_t			vector_count;
-	avr_int_pending_t pending;
+	uint64_t		pending;	// bit n is set when vector[n] is pending
 	uint8_t			running_ptr;
 	avr_int_vector_t *running[64]; // stack of nested interrupts
 	// global status for pending + running in interrupt context
@@ -67,7 +67,7 @@ typedef struct  avr_int_table_t {
 /*
  * Interrupt Helper Functions
  */
-// register an interrupt vector. It's only needed if you want to use the "r_raised" flags
+// register an interrupt vector, with its IRQs. It has to be, to be raised
 void
 avr_register_vector(
 		struct avr_t *avr,
@@ -119,7 +119,7 @@ void
 avr_interrupt_init(
 		struct avr_t * avr );
 
-// reset the interrupt table and the fifo
+// reset the interrupt table and the pending map
 void
 avr_interrupt_reset(
 		struct avr_t * avr );
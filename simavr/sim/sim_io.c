@@ -53,28 +53,74 @@ avr_register_io(
 	avr->io_port = io;
 }
 
-void
-avr_register_io_read(
-		avr_t *avr,
+/*
+ * When several handlers read or write the same register, a dispatcher
+ * is installed in avr->io[] in place of the handler, with all of them in
+ * one array as its param. They are called in the order they were
+ * registered; a register with a single handler doesn't pay for this.
+ */
+typedef struct avr_io_handler_t {
+	void * param;
+	void * c;		// avr_io_read_t or avr_io_write_t
+	uint8_t idle;	// see avr_register_io_read_idle()
+} avr_io_handler_t;
+
+typedef struct avr_io_mux_t {
+	int count, size;
+	avr_io_handler_t h[];
+} avr_io_mux_t;
+
+/*
+ * Adds 'h' to the dispatcher 'm', or to a new one holding 'first' if 'm'
+ * is NULL. Returns the dispatcher, that may have moved, or NULL if out of
+ * memory, nothing is changed then.
+ */
+static avr_io_mux_t *
+_avr_io_mux_add(
+		avr_io_mux_t * m,
+		const avr_io_handler_t * first,
+		const avr_io_handler_t * h)
+{
+	if (!m) {
+		m = malloc(sizeof(*m) + 4 * sizeof(m->h[0]));
+		if (!m)
+			return NULL;
+		m->size = 4;
+		m->count = 1;
+		m->h[0] = *first;
+	}
+	for (int i = 0; i < m->count; i++)
+		if (m->h[i].c == h->c && m->h[i].param == h->param)
+			return m;
+	if (m->count == m->size) {
+		avr_io_mux_t * n = realloc(m,
+				sizeof(*m) + m->size * 2 * sizeof(m->h[0]));
+		if (!n)
+			return NULL;
+		m = n;
+		m->size *= 2;
+	}
+	m->h[m->count++] = *h;
+	return m;
+}
+
+static uint8_t
+_avr_io_mux_read(
+		avr_t * avr,
 		avr_io_addr_t addr,
-		avr_io_read_t readp,
 		void * param)
 {
-	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
-	if (avr->io[a].r.param || avr->io[a].r.c) {
-		if (avr->io[a].r.param != param || avr->io[a].r.c != readp) {
-			AVR_LOG(avr, LOG_ERROR,
-					"IO: %s(): Already registered, refusing to override.\n",
-					__func__);
-			AVR_LOG(avr, LOG_ERROR,
-					"IO: %s(%04x : %p/%p): %p/%p\n",
-					__func__, a,
-					avr->io[a].r.c, avr->io[a].r.param, readp, param);
-			abort();
-		}
+	avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+	// handlers registered from a handler are only called from the next read
+	int count = ((avr_io_mux_t *)param)->count;
+
+	// each handler sees the value returned by the previous one
+	for (int i = 0; i < count; i++) {
+		// reloaded, a handler registering another can move the array
+		avr_io_handler_t * h = ((avr_io_mux_t *)avr->io[io].r.param)->h + i;
+		avr->data[addr] = ((avr_io_read_t)h->c)(avr, addr, h->param);
 	}
-	avr->io[a].r.param = param;
-	avr->io[a].r.c = readp;
+	return avr->data[addr];
 }
 
 static void
@@ -84,69 +130,138 @@ _avr_io_mux_write(
 		uint8_t v,
 		void * param)
 {
-	int io = (intptr_t)param;
-	for (int i = 0; i < avr->io_shared_io[io].used; i++) {
-		avr_io_write_t c = avr->io_shared_io[io].io[i].c;
-		if (c)
-			c(avr, addr, v, avr->io_shared_io[io].io[i].param);
+	avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+	int count = ((avr_io_mux_t *)param)->count;
+
+	for (int i = 0; i < count; i++) {
+		avr_io_handler_t * h = ((avr_io_mux_t *)avr->io[io].w.param)->h + i;
+		((avr_io_write_t)h->c)(avr, addr, v, h->param);
 	}
 }
 
+static uint8_t
+_avr_io_mux_idle(
+		avr_io_mux_t * m)
+{
+	for (int i = 0; i < m->count; i++)
+		if (!m->h[i].idle)
+			return 0;
+	return 1;
+}
+
+static int
+_avr_io_check_addr(
+		avr_t * avr,
+		avr_io_addr_t a,
+		const char * func)
+{
+	if (a < MAX_IOs)
+		return 1;
+	AVR_LOG(avr, LOG_ERROR,
+			"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+			func, a, MAX_IOs);
+	return 0;
+}
+
 void
-avr_register_io_write(
+avr_register_io_read(
 		avr_t *avr,
 		avr_io_addr_t addr,
-		avr_io_write_t writep,
+		avr_io_read_t readp,
 		void * param)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
 
-	if (a >= MAX_IOs) {
+	if (!_avr_io_check_addr(avr, a, __func__))
+		return;
+	avr_data_page_set(avr, addr, 1, AVR_DATA_PAGE_IO);
+	if (!avr->io[a].r.c) {
+		avr->io[a].r.param = param;
+		avr->io[a].r.c = readp;
+		avr->io[a].r.idle = 0;
+		return;
+	}
+	if (avr->io[a].r.c == readp && avr->io[a].r.param == param)
+		return;
+
+	avr_io_handler_t first = {
+		.param = avr->io[a].r.param, .c = avr->io[a].r.c,
+		.idle = avr->io[a].r.idle };
+	avr_io_mux_t * m = avr->io[a].r.c == _avr_io_mux_read ?
+			avr->io[a].r.param : NULL;
+	if (!m)
+		AVR_LOG(avr, LOG_TRACE,
+				"IO: %s(%04x): Installing muxer on register.\n",
+				__func__, addr);
+	m = _avr_io_mux_add(m, &first,
+			&(avr_io_handler_t){ .param = param, .c = readp });
+	if (!m) {
 		AVR_LOG(avr, LOG_ERROR,
-				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
-				__func__, a, MAX_IOs);
-		abort();
+				"IO: %s(%04x): Out of memory, handler not registered.\n",
+				__func__, addr);
+		return;
 	}
-	/*
-	 * Verifying that some other piece of code is not installed to watch write
-	 * on this address. If there is, this code installs a "dispatcher" callback
-	 * instead to handle multiple clients, otherwise, it continues as usual
-	 */
-	if (avr->io[a].w.param || avr->io[a].w.c) {
-		if (avr->io[a].w.param != param || avr->io[a].w.c != writep) {
-			// if the muxer not already installed, allocate a new slot
-			if (avr->io[a].w.c != _avr_io_mux_write) {
-				int no = avr->io_shared_io_count++;
-				if (avr->io_shared_io_count > ARRAY_SIZE(avr->io_shared_io)) {
-					AVR_LOG(avr, LOG_ERROR,
-							"IO: %s(): Too many shared IO registers.\n", __func__);
-					abort();
-				}
-				AVR_LOG(avr, LOG_TRACE,
-						"IO: %s(%04x): Installing muxer on register.\n",
-						__func__, addr);
-				avr->io_shared_io[no].used = 1;
-				avr->io_shared_io[no].io[0].param = avr->io[a].w.param;
-				avr->io_shared_io[no].io[0].c = avr->io[a].w.c;
-				avr->io[a].w.param = (void*)(intptr_t)no;
-				avr->io[a].w.c = _avr_io_mux_write;
-			}
-			int no = (intptr_t)avr->io[a].w.param;
-			int d = avr->io_shared_io[no].used++;
-			if (avr->io_shared_io[no].used > ARRAY_SIZE(avr->io_shared_io[0].io)) {
-				AVR_LOG(avr, LOG_ERROR,
-						"IO: %s(): Too many callbacks on %04x.\n",
-						__func__, addr);
-				abort();
-			}
-			avr->io_shared_io[no].io[d].param = param;
-			avr->io_shared_io[no].io[d].c = writep;
-			return;
-		}
+	avr->io[a].r.param = m;
+	avr->io[a].r.c = _avr_io_mux_read;
+	avr->io[a].r.idle = _avr_io_mux_idle(m);
+}
+
+void
+avr_register_io_read_idle(
+		avr_t *avr,
+		avr_io_addr_t addr)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (!_avr_io_check_addr(avr, a, __func__))
+		return;
+	if (avr->io[a].r.c == _avr_io_mux_read) {
+		// this is about the handler registered last
+		avr_io_mux_t * m = avr->io[a].r.param;
+		m->h[m->count - 1].idle = 1;
+		avr->io[a].r.idle = _avr_io_mux_idle(m);
+	} else
+		avr->io[a].r.idle = 1;
+}
+
+void
+avr_register_io_write(
+		avr_t *avr,
+		avr_io_addr_t addr,
+		avr_io_write_t writep,
+		void * param)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (!_avr_io_check_addr(avr, a, __func__))
+		return;
+	avr_data_page_set(avr, addr, 1, AVR_DATA_PAGE_IO);
+	if (!avr->io[a].w.c) {
+		avr->io[a].w.param = param;
+		avr->io[a].w.c = writep;
+		return;
 	}
+	if (avr->io[a].w.c == writep && avr->io[a].w.param == param)
+		return;
 
-	avr->io[a].w.param = param;
-	avr->io[a].w.c = writep;
+	avr_io_handler_t first = {
+		.param = avr->io[a].w.param, .c = avr->io[a].w.c };
+	avr_io_mux_t * m = avr->io[a].w.c == _avr_io_mux_write ?
+			avr->io[a].w.param : NULL;
+	if (!m)
+		AVR_LOG(avr, LOG_TRACE,
+				"IO: %s(%04x): Installing muxer on register.\n",
+				__func__, addr);
+	m = _avr_io_mux_add(m, &first,
+			&(avr_io_handler_t){ .param = param, .c = writep });
+	if (!m) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(%04x): Out of memory, handler not registered.\n",
+				__func__, addr);
+		return;
+	}
+	avr->io[a].w.param = m;
+	avr->io[a].w.c = _avr_io_mux_write;
 }
 
 avr_irq_t *
@@ -191,6 +306,7 @@ avr_iomem_getirq(
 			d += strlen(d) + 1;
 		}
 		avr->io[a].irq = avr_alloc_irq(&avr->irq_pool, 0, 9, namep);
+		avr_data_page_set(avr, addr, 1, AVR_DATA_PAGE_IO);
 		// mark the pin ones as filtered, so they only are raised when changing
 		for (int i = 0; i < 8; i++)
 			avr->io[a].irq[i].flags |= IRQ_FLAG_FILTERED;
@@ -295,4 +411,17 @@ avr_deallocate_ios(
 		port = next;
 	}
 	avr->io_port = NULL;
+
+	for (int a = 0; a < MAX_IOs; a++) {
+		if (avr->io[a].r.c == _avr_io_mux_read) {
+			free(avr->io[a].r.param);
+			avr->io[a].r.param = NULL;
+			avr->io[a].r.c = NULL;
+		}
+		if (avr->io[a].w.c == _avr_io_mux_write) {
+			free(avr->io[a].w.param);
+			avr->io[a].w.param = NULL;
+			avr->io[a].w.c = NULL;
+		}
+	}
 }
@@ -35,6 +35,8 @@ extern "C" {
 #define AVR_IOCTL_DEF(_a,_b,_c,_d) \
 	(((_a) << 24)|((_b) << 16)|((_c) << 8)|((_d)))
 
+struct avr_snapshot_t;
+
 /*
  * IO module base struct
  * Modules uses that as their first member in their own struct
@@ -56,6 +58,14 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	// optional, save and restore the state the module keeps outside of
+	// its struct, the struct itself is saved whole. See sim_snapshot.h
+	void (*serialize)(struct avr_io_t *io, struct avr_snapshot_t *s);
+	int (*deserialize)(struct avr_io_t *io, const uint8_t *data, uint32_t size);
+	// optional, called by avr_clone() once the module is copied from the
+	// original; 'own' is the clone's as it was before. Gives the clone back
+	// its own buffers and pointers, with the contents of the original's
+	void (*clone)(struct avr_io_t *io, const struct avr_io_t *own);
 } avr_io_t;
 
 /*
@@ -78,14 +88,32 @@ avr_io_setirqs(
 		int count,
 		avr_irq_t * irqs );
 
-// register a callback for when IO register "addr" is read
+/*
+ * register a callback for when IO register "addr" is read. Any number of
+ * them can be registered on a register, they are called in that order,
+ * and each sees the value returned by the previous one in avr->data[addr].
+ * Registering the same callback and param again does nothing.
+ */
 void
 avr_register_io_read(
 		avr_t *avr,
 		avr_io_addr_t addr,
 		avr_io_read_t read,
 		void * param);
+/*
+ * Tell the idle loop detector (avr->idle_skip) that the read callback of
+ * "addr" can be called any number of times in a row with the same result
+ * and no visible side effect, as long as no cycle timer or IRQ ran in
+ * between. Polling loops on that register can then be skipped.
+ * With several read callbacks, this applies to the last one registered,
+ * and the loops are only skipped if all of them are idle.
+ */
+void
+avr_register_io_read_idle(
+		avr_t *avr,
+		avr_io_addr_t addr);
 // register a callback for when the IO register is written. callback has to set the memory itself
+// Any number of them can be registered on a register, called in that order
 void
 avr_register_io_write(
 		avr_t *avr,
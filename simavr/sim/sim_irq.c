@@ -26,14 +26,32 @@
 
 // internal structure for a hook, never seen by the notify procs
 typedef struct avr_irq_hook_t {
-	struct avr_irq_hook_t * next;
-	int busy;	// prevent reentrance of callbacks
-
 	struct avr_irq_t * chain;	// raise the IRQ on this too - optional if "notify" is on
 	avr_irq_notify_t notify;	// called when IRQ is raised - optional if "chain" is on
 	void * param;				// "notify" parameter
+	int busy;	// prevent reentrance of callbacks
 } avr_irq_hook_t;
 
+#define FIFO_SYNC	// the queue is only used by the simulation thread
+#include "fifo_declare.h"
+
+// a deferred raise, see avr_irq_pool_defer()
+typedef struct avr_irq_deferred_t {
+	uint64_t when;
+	avr_irq_t * irq;	// NULL if it was freed before delivery
+	uint32_t value;
+	int floating;
+} avr_irq_deferred_t;
+
+DECLARE_FIFO(avr_irq_deferred_t, avr_irq_defer_fifo, 256);
+DEFINE_FIFO(avr_irq_deferred_t, avr_irq_defer_fifo);
+
+typedef struct avr_irq_defer_t {
+	avr_irq_defer_fifo_t fifo;
+	int delivering;
+	uint64_t stamp;		// of the raise being delivered
+} avr_irq_defer_t;
+
 static void
 _avr_irq_pool_add(
 		avr_irq_pool_t * pool,
@@ -104,16 +122,121 @@ avr_alloc_irq(
 }
 
 static avr_irq_hook_t *
-_avr_alloc_irq_hook(
-		avr_irq_t * irq)
+_avr_irq_hook_append(
+		avr_irq_hook_t ** array,
+		uint16_t * count,
+		uint16_t * size)
 {
-	avr_irq_hook_t *hook = malloc(sizeof(avr_irq_hook_t));
+	if (*count == *size) {
+		int nsize = *size ? *size * 2 : 2;
+		avr_irq_hook_t * hook;
+		if (nsize > 0xffff ||
+				!(hook = realloc(*array, nsize * sizeof(*hook))))
+			return NULL;
+		*array = hook;
+		*size = nsize;
+	}
+	avr_irq_hook_t *hook = &(*array)[(*count)++];
 	memset(hook, 0, sizeof(avr_irq_hook_t));
-	hook->next = irq->hook;
-	irq->hook = hook;
 	return hook;
 }
 
+/*
+ * Hooks are appended to the array, and called from the last one down,
+ * so the latest registered is called first like it always was.
+ * The array can't move while avr_raise_irq() walks it, so if it is full
+ * the new hook waits in 'pending' until the raise is over.
+ * Returns NULL if out of memory.
+ */
+static avr_irq_hook_t *
+_avr_alloc_irq_hook(
+		avr_irq_t * irq)
+{
+	if (irq->raising && irq->hook_count == irq->hook_size) {
+		irq->hook_dirty = 1;
+		return _avr_irq_hook_append(&irq->pending,
+				&irq->pending_count, &irq->pending_size);
+	}
+	return _avr_irq_hook_append(&irq->hook, &irq->hook_count, &irq->hook_size);
+}
+
+/*
+ * Removes the dead hooks (no notify and no chain) from the array, and
+ * moves the pending ones in. Only when the irq is not being raised.
+ */
+static void
+_avr_irq_tidy_hooks(
+		avr_irq_t * irq)
+{
+	irq->hook_dirty = 0;
+	int o = 0;
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify || irq->hook[i].chain)
+			irq->hook[o++] = irq->hook[i];
+	irq->hook_count = o;
+	for (int i = 0; i < irq->pending_count; i++) {
+		if (!irq->pending[i].notify && !irq->pending[i].chain)
+			continue;
+		avr_irq_hook_t * hook = _avr_irq_hook_append(
+				&irq->hook, &irq->hook_count, &irq->hook_size);
+		if (hook)
+			*hook = irq->pending[i];
+	}
+	free(irq->pending);
+	irq->pending = NULL;
+	irq->pending_count = irq->pending_size = 0;
+}
+
+static avr_irq_hook_t *
+_avr_irq_find_hook(
+		avr_irq_t * irq,
+		avr_irq_notify_t notify,
+		void * param,
+		avr_irq_t * chain)
+{
+	for (int i = 0; i < irq->hook_count; i++) {
+		avr_irq_hook_t * hook = &irq->hook[i];
+		if (hook->notify == notify && hook->param == param &&
+				hook->chain == chain)
+			return hook;
+	}
+	for (int i = 0; i < irq->pending_count; i++) {
+		avr_irq_hook_t * hook = &irq->pending[i];
+		if (hook->notify == notify && hook->param == param &&
+				hook->chain == chain)
+			return hook;
+	}
+	return NULL;
+}
+
+static void
+_avr_free_irq_hook(
+		avr_irq_t * irq,
+		avr_irq_hook_t * hook)
+{
+	hook->notify = NULL;
+	hook->chain = NULL;
+	hook->param = NULL;
+	if (irq->raising)
+		irq->hook_dirty = 1;
+	else
+		_avr_irq_tidy_hooks(irq);
+}
+
+static void
+_avr_irq_defer_drop(
+		avr_irq_defer_t * d,
+		avr_irq_t * irq)
+{
+	int count = avr_irq_defer_fifo_get_read_size(&d->fifo);
+	for (int i = 0; i < count; i++) {
+		avr_irq_deferred_t * e = &d->fifo.buffer[
+				(d->fifo.read + i) & (avr_irq_defer_fifo_fifo_size - 1)];
+		if (e->irq == irq)
+			e->irq = NULL;
+	}
+}
+
 void
 avr_free_irq(
 		avr_irq_t * irq,
@@ -123,19 +246,19 @@ avr_free_irq(
 		return;
 	for (int i = 0; i < count; i++) {
 		avr_irq_t * iq = irq + i;
+		if (iq->pool && iq->pool->defer)
+			_avr_irq_defer_drop(iq->pool->defer, iq);
 		if (iq->pool)
 			_avr_irq_pool_remove(iq->pool, iq);
 		if (iq->name)
 			free((char*)iq->name);
 		iq->name = NULL;
 		// purge hooks
-		avr_irq_hook_t *hook = iq->hook;
-		while (hook) {
-			avr_irq_hook_t * next = hook->next;
-			free(hook);
-			hook = next;
-		}
-		iq->hook = NULL;
+		free(iq->hook);
+		free(iq->pending);
+		iq->hook = iq->pending = NULL;
+		iq->hook_count = iq->hook_size = 0;
+		iq->pending_count = iq->pending_size = 0;
 	}
 	// if that irq list was allocated by us, free it
 	if (irq->flags & IRQ_FLAG_ALLOC)
@@ -151,13 +274,11 @@ avr_irq_register_notify(
 	if (!irq || !notify)
 		return;
 
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param)
-			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(irq);
+	if (_avr_irq_find_hook(irq, notify, param, NULL))
+		return;	// already there
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(irq);
+	if (!hook)
+		return;
 	hook->notify = notify;
 	hook->param = param;
 }
@@ -168,24 +289,65 @@ avr_irq_unregister_notify(
 		avr_irq_notify_t notify,
 		void * param)
 {
-	avr_irq_hook_t *hook, *prev;
 	if (!irq || !notify)
 		return;
 
-	hook = irq->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				irq->hook = hook->next;
-			free(hook);
-			return;
-		}
-		prev = hook;
-		hook = hook->next;
+	avr_irq_hook_t *hook = _avr_irq_find_hook(irq, notify, param, NULL);
+	if (hook)
+		_avr_free_irq_hook(irq, hook);
+}
+
+/*
+ * The array doesn't move during the raise, hooks added by the callbacks
+ * are past the end or pending, the removed ones are just left dead.
+ */
+static void
+_avr_irq_call_hooks(
+		avr_irq_t * irq,
+		uint32_t output,
+		int floating)
+{
+	avr_irq_hook_t * first = irq->hook;
+
+	irq->raising++;
+	for (avr_irq_hook_t * hook = first + irq->hook_count; hook-- > first; ) {
+		// prevents reentrance / endless calling loops
+		if (hook->busy)
+			continue;
+		hook->busy = 1;
+		if (hook->notify)
+			hook->notify(irq, output, hook->param);
+		if (hook->chain)
+			avr_raise_irq_float(hook->chain, output, floating);
+		hook->busy = 0;
 	}
+	if (!--irq->raising && irq->hook_dirty)
+		_avr_irq_tidy_hooks(irq);
+}
+
+/*
+ * Queues the raise if the pool is deferring, and not delivering already.
+ * The queue is delivered early if it is full.
+ */
+static int
+_avr_irq_defer(
+		avr_irq_t * irq,
+		uint32_t value,
+		int floating)
+{
+	avr_irq_defer_t * d = irq->pool ? irq->pool->defer : NULL;
+	if (!d || d->delivering)
+		return 0;
+	if (avr_irq_defer_fifo_isfull(&d->fifo))
+		avr_irq_pool_flush(irq->pool);
+	avr_irq_deferred_t e = {
+		.when = irq->pool->clock ? *irq->pool->clock : 0,
+		.irq = irq,
+		.value = value,
+		.floating = floating,
+	};
+	avr_irq_defer_fifo_write(&d->fifo, e);
+	return 1;
 }
 
 void
@@ -196,6 +358,8 @@ avr_raise_irq_float(
 {
 	if (!irq)
 		return ;
+	if ((irq->flags & IRQ_FLAG_DEFERRED) && _avr_irq_defer(irq, value, floating))
+		return;
 	uint32_t output = (irq->flags & IRQ_FLAG_NOT) ? !value : value;
 	// if value is the same but it's the first time, raise it anyway
 	if (irq->value == output &&
@@ -204,20 +368,8 @@ avr_raise_irq_float(
 	irq->flags &= ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING);
 	if (floating)
 		irq->flags |= IRQ_FLAG_FLOATING;
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		avr_irq_hook_t * next = hook->next;
-			// prevents reentrance / endless calling loops
-		if (hook->busy == 0) {
-			hook->busy++;
-			if (hook->notify)
-				hook->notify(irq, output,  hook->param);
-			if (hook->chain)
-				avr_raise_irq_float(hook->chain, output, floating);
-			hook->busy--;
-		}
-		hook = next;
-	}
+	if (irq->hook_count)
+		_avr_irq_call_hooks(irq, output, floating);
 	// the value is set after the callbacks are called, so the callbacks
 	// can themselves compare for old/new values between their parameter
 	// they are passed (new value) and the previous irq->value
@@ -232,6 +384,25 @@ avr_raise_irq(
 	avr_raise_irq_float(irq, value, !!(irq->flags & IRQ_FLAG_FLOATING));
 }
 
+void
+avr_raise_irq_bits(
+		avr_irq_t * irq,
+		uint32_t value,
+		uint32_t mask)
+{
+	while (mask) {
+		int i = __builtin_ctz(mask);
+		mask &= mask - 1;
+		avr_irq_t * b = irq + i;
+		uint32_t bit = (value >> i) & 1;
+		// same test as avr_raise_irq_float(), without the call
+		if ((b->flags & (IRQ_FLAG_FILTERED | IRQ_FLAG_INIT)) == IRQ_FLAG_FILTERED &&
+				b->value == ((b->flags & IRQ_FLAG_NOT) ? !bit : bit))
+			continue;
+		avr_raise_irq(b, bit);
+	}
+}
+
 void
 avr_connect_irq(
 		avr_irq_t * src,
@@ -241,13 +412,11 @@ avr_connect_irq(
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	avr_irq_hook_t *hook = src->hook;
-	while (hook) {
-		if (hook->chain == dst)
-			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(src);
+	if (_avr_irq_find_hook(src, NULL, NULL, dst))
+		return;	// already there
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(src);
+	if (!hook)
+		return;
 	hook->chain = dst;
 }
 
@@ -256,26 +425,13 @@ avr_unconnect_irq(
 		avr_irq_t * src,
 		avr_irq_t * dst)
 {
-	avr_irq_hook_t *hook, *prev;
-
 	if (!src || !dst || src == dst) {
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	hook = src->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->chain == dst) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				src->hook = hook->next;
-			free(hook);
-			return;
-		}
-		prev = hook;
-		hook = hook->next;
-	}
+	avr_irq_hook_t *hook = _avr_irq_find_hook(src, NULL, NULL, dst);
+	if (hook)
+		_avr_free_irq_hook(src, hook);
 }
 
 uint8_t
@@ -292,3 +448,51 @@ avr_irq_set_flags(
 {
 	irq->flags = flags;
 }
+
+int
+avr_irq_pool_defer(
+		avr_irq_pool_t * pool,
+		int on)
+{
+	if (on) {
+		if (!pool->defer)
+			pool->defer = calloc(1, sizeof(avr_irq_defer_t));
+		return pool->defer ? 0 : -1;
+	}
+	if (pool->defer) {
+		avr_irq_pool_flush(pool);
+		free(pool->defer);
+		pool->defer = NULL;
+	}
+	return 0;
+}
+
+void
+avr_irq_pool_flush(
+		avr_irq_pool_t * pool)
+{
+	avr_irq_defer_t * d = pool->defer;
+	if (!d || d->delivering)
+		return;
+	d->delivering = 1;
+	while (!avr_irq_defer_fifo_isempty(&d->fifo)) {
+		avr_irq_deferred_t e = avr_irq_defer_fifo_read(&d->fifo);
+		if (!e.irq)
+			continue;
+		d->stamp = e.when;
+		avr_raise_irq_float(e.irq, e.value, e.floating);
+	}
+	d->delivering = 0;
+}
+
+uint64_t
+avr_irq_get_stamp(
+		avr_irq_t * irq)
+{
+	avr_irq_pool_t * pool = irq->pool;
+	if (!pool)
+		return 0;
+	if (pool->defer && pool->defer->delivering)
+		return pool->defer->stamp;
+	return pool->clock ? *pool->clock : 0;
+}
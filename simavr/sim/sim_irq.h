@@ -35,8 +35,10 @@ extern "C" {
  * raised. The IRQ definition is up to the module defining it, for example a IOPORT pin change
  * might be an IRQ in which case any piece of code can be notified when a pin has changed state
  *
- * The notify hooks are chained, and duplicates are filtered out so you can't register a
- * notify hook twice on one particular IRQ
+ * The notify hooks are kept in an array per IRQ, and duplicates are filtered out so you
+ * can't register a notify hook twice on one particular IRQ. Hooks can be registered and
+ * unregistered from a notify callback; the new ones aren't called by the raise in progress,
+ * the removed ones aren't called anymore.
  *
  * IRQ calling order is not defined, so don't rely on it.
  *
@@ -58,6 +60,7 @@ enum {
 	IRQ_FLAG_INIT		= (1 << 3), //!< this irq hasn't been used yet
 	IRQ_FLAG_FLOATING	= (1 << 4), //!< this 'pin'/signal is floating
 	IRQ_FLAG_USER		= (1 << 5), //!< Can be used by irq users
+	IRQ_FLAG_DEFERRED	= (1 << 6), //!< raises can be queued, see avr_irq_pool_defer()
 };
 
 /*
@@ -66,6 +69,8 @@ enum {
 typedef struct avr_irq_pool_t {
 	int count;						//!< number of irqs living in the pool
 	struct avr_irq_t ** irq;		//!< irqs belonging in this pool
+	const uint64_t * clock;			//!< cycle counter, stamps the raises
+	struct avr_irq_defer_t * defer;	//!< queued raises, when deferring
 } avr_irq_pool_t;
 
 /*!
@@ -77,7 +82,14 @@ typedef struct avr_irq_t {
 	uint32_t			irq;		//!< any value the user needs
 	uint32_t			value;		//!< current value
 	uint8_t				flags;		//!< IRQ_* flags
-	struct avr_irq_hook_t * hook;	//!< list of hooks to be notified
+	uint8_t				hook_dirty;	//!< hooks were added/removed while raising
+	uint16_t			raising;	//!< nesting depth of avr_raise_irq() on it
+	uint16_t			hook_count;	//!< hooks in 'hook', 0 is the fast path
+	uint16_t			hook_size;	//!< hooks allocated in 'hook'
+	uint16_t			pending_count;	//!< hooks added while raising, 'hook' was full
+	uint16_t			pending_size;
+	struct avr_irq_hook_t * hook;	//!< array of hooks to be notified
+	struct avr_irq_hook_t * pending;	//!< moved to 'hook' after the raise
 } avr_irq_t;
 
 //! allocates 'count' IRQs, initializes their "irq" starting from 'base' and increment
@@ -120,6 +132,16 @@ avr_raise_irq_float(
 		avr_irq_t * irq,
 		uint32_t value,
 		int floating);
+/*!
+ * Raises irq[i] with bit i of 'value', for each bit i set in 'mask', in
+ * order. The IRQ_FLAG_FILTERED ones that already have that value are
+ * skipped without a call, so a write that changes nothing is cheap.
+ */
+void
+avr_raise_irq_bits(
+		avr_irq_t * irq,
+		uint32_t value,
+		uint32_t mask);
 //! this connects a "source" IRQ to a "destination" IRQ
 void
 avr_connect_irq(
@@ -143,6 +165,29 @@ avr_irq_unregister_notify(
 		avr_irq_notify_t notify,
 		void * param);
 
+/*
+ * Deferred raises. Observers that don't need to run inside the instruction
+ * that changed a signal (VCD, logic probes...) flag their own IRQ with
+ * IRQ_FLAG_DEFERRED and chain it from the signal. When deferring is on,
+ * raising such an IRQ only queues the value with its cycle stamp; the
+ * queue is delivered in order by avr_irq_pool_flush(), which the core
+ * calls before running the cycle timers, at the end of each run quantum.
+ * Every other IRQ, and every hook, is still called synchronously.
+ */
+//! Turns deferring on or off for the pool; off delivers what is queued
+int
+avr_irq_pool_defer(
+		avr_irq_pool_t * pool,
+		int on);
+//! Delivers the queued raises
+void
+avr_irq_pool_flush(
+		avr_irq_pool_t * pool);
+//! Cycle stamp of the raise being notified: the cycle it was queued on if deferred
+uint64_t
+avr_irq_get_stamp(
+		avr_irq_t * irq);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,678 @@
+/*
+	sim_jit.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// size of the executable buffer, it is flushed when full
+#define AVR_JIT_CODE_SIZE	(1024 * 1024)
+// worst case size of a block: header, prologue, instructions, epilogue
+#define AVR_JIT_BLOCK_MAX	(64 + (AVR_JIT_MAX_INSN * 160))
+
+int
+avr_jit_init(
+		avr_t * avr)
+{
+	avr_jit_t * jit = calloc(1, sizeof(avr_jit_t));
+
+	jit->code_size = AVR_JIT_CODE_SIZE;
+	// made writable, then executable, a block at a time as it's translated
+	jit->code = mmap(NULL, jit->code_size, PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		AVR_LOG(avr, LOG_WARNING, "JIT: can't map the code buffer, disabled\n");
+		free(jit);
+		return -1;
+	}
+	jit->words = (avr->flashend + 1) / 2;
+	jit->block = calloc(jit->words, sizeof(avr_jit_block_t *));
+	jit->heat = calloc(jit->words, sizeof(uint8_t));
+	avr->jit = jit;
+	return 0;
+}
+
+void
+avr_jit_terminate(
+		avr_t * avr)
+{
+	avr_jit_t * jit = avr->jit;
+
+	if (!jit)
+		return;
+	munmap(jit->code, jit->code_size);
+	free(jit->block);
+	free(jit->heat);
+	free(jit);
+	avr->jit = NULL;
+}
+
+/*
+ * Forget all the blocks, and start filling the code buffer from scratch
+ */
+static void
+avr_jit_flush(
+		avr_t * avr)
+{
+	avr_jit_t * jit = avr->jit;
+
+	AVR_LOG(avr, LOG_TRACE, "JIT: code buffer full, flushing\n");
+	memset(jit->block, 0, jit->words * sizeof(avr_jit_block_t *));
+	memset(jit->heat, 0, jit->words);
+	jit->code_used = 0;
+}
+
+void
+avr_jit_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size)
+{
+	avr_jit_t * jit = avr->jit;
+	uint32_t start = address >> 1;
+	uint32_t end = (address + size + 1) >> 1;
+
+	// blocks starting before the range can still run into it
+	start = start > AVR_JIT_MAX_INSN ? start - AVR_JIT_MAX_INSN : 0;
+	if (end > jit->words)
+		end = jit->words;
+	if (start >= end)
+		return;
+	memset(jit->block + start, 0, (end - start) * sizeof(avr_jit_block_t *));
+	memset(jit->heat + start, 0, end - start);
+}
+
+/*
+ * x86_64 code emitters. While a block runs, rbx holds avr, r12
+ * holds avr->data and r13 the cycle counter pointer; eax, ecx, edx
+ * and esi are scratch.
+ */
+#define EMIT8(_b) *p++ = (_b)
+#define EMIT32(_v) { uint32_t _x = (_v); memcpy(p, &_x, 4); p += 4; }
+#define EMIT64(_v) { uint64_t _x = (uint64_t)(_v); memcpy(p, &_x, 8); p += 8; }
+
+enum { EAX = 0, ECX, EDX, ESI = 6 };
+
+// 32 bits ALU opcodes, 'op reg, reg'; op >> 3 is the '81 /x' immediate form
+enum {
+	JIT_ADD = 0x01, JIT_OR = 0x09, JIT_AND = 0x21, JIT_SUB = 0x29,
+	JIT_XOR = 0x31, JIT_CMP = 0x39, JIT_MOV = 0x89,
+};
+
+// condition codes, the low nibble of the jcc/setcc opcodes
+#define JIT_CC_E	0x4
+#define JIT_CC_NE	0x5
+#define JIT_CC_BE	0x6
+#define JIT_CC_S	0x8
+
+#define SREG_OFF(_s)	(offsetof(avr_t, sreg) + (_s))
+#define LAZY_OFF(_f)	offsetof(avr_t, sreg_lazy._f)
+
+// the lazy SREG op is not known at translation time
+#define JIT_LAZY_UNKNOWN	0xff
+
+static uint8_t *
+_jit_prologue(uint8_t * p)
+{
+	EMIT8(0x53);						// push rbx
+	EMIT8(0x41); EMIT8(0x54);			// push r12
+	EMIT8(0x41); EMIT8(0x55);			// push r13
+	EMIT8(0x48); EMIT8(0x89); EMIT8(0xfb);	// mov rbx, rdi
+	EMIT8(0x4c); EMIT8(0x8b); EMIT8(0xa7);	// mov r12, [rdi + data]
+	EMIT32(offsetof(avr_t, data));
+	EMIT8(0x49); EMIT8(0x89); EMIT8(0xf5);	// mov r13, rsi
+	return p;
+}
+
+static uint8_t *
+_jit_epilogue(uint8_t * p)
+{
+	EMIT8(0x41); EMIT8(0x5d);			// pop r13
+	EMIT8(0x41); EMIT8(0x5c);			// pop r12
+	EMIT8(0x5b);						// pop rbx
+	EMIT8(0xc3);						// ret
+	return p;
+}
+
+/*
+ * Calls i->handler(avr, i, new_pc, cycle), new pc ends up in eax
+ */
+static uint8_t *
+_jit_call(
+		uint8_t * p,
+		avr_insn_t * i,
+		avr_flashaddr_t new_pc)
+{
+	EMIT8(0x48); EMIT8(0x89); EMIT8(0xdf);	// mov rdi, rbx
+	EMIT8(0x48); EMIT8(0xbe); EMIT64(i);	// mov rsi, i
+	EMIT8(0xba); EMIT32(new_pc);			// mov edx, new_pc
+	EMIT8(0x4c); EMIT8(0x89); EMIT8(0xe9);	// mov rcx, r13
+	EMIT8(0x48); EMIT8(0xb8); EMIT64(i->handler);	// mov rax, handler
+	EMIT8(0xff); EMIT8(0xd0);				// call rax
+	return p;
+}
+
+// movzx reg, byte [r12 + r]
+static uint8_t *
+_jit_ld(uint8_t * p, int reg, uint8_t r)
+{
+	EMIT8(0x41); EMIT8(0x0f); EMIT8(0xb6); EMIT8(0x44 | (reg << 3)); EMIT8(0x24);
+	EMIT8(r);
+	return p;
+}
+
+// mov [r12 + r], reg8
+static uint8_t *
+_jit_st(uint8_t * p, int reg, uint8_t r)
+{
+	EMIT8(0x41); EMIT8(0x88); EMIT8(0x44 | (reg << 3)); EMIT8(0x24);
+	EMIT8(r);
+	return p;
+}
+
+// movzx reg, byte [rbx + off]
+static uint8_t *
+_jit_avr_ld(uint8_t * p, int reg, uint32_t off)
+{
+	EMIT8(0x0f); EMIT8(0xb6); EMIT8(0x83 | (reg << 3)); EMIT32(off);
+	return p;
+}
+
+// mov [rbx + off], reg8
+static uint8_t *
+_jit_avr_st(uint8_t * p, int reg, uint32_t off)
+{
+	EMIT8(0x88); EMIT8(0x83 | (reg << 3)); EMIT32(off);
+	return p;
+}
+
+// mov byte [rbx + off], v
+static uint8_t *
+_jit_avr_sti(uint8_t * p, uint32_t off, uint8_t v)
+{
+	EMIT8(0xc6); EMIT8(0x83); EMIT32(off); EMIT8(v);
+	return p;
+}
+
+// setcc byte [rbx + off]
+static uint8_t *
+_jit_avr_setcc(uint8_t * p, uint8_t cc, uint32_t off)
+{
+	EMIT8(0x0f); EMIT8(0x90 | cc); EMIT8(0x83); EMIT32(off);
+	return p;
+}
+
+// op dst, src
+static uint8_t *
+_jit_alu(uint8_t * p, uint8_t op, int dst, int src)
+{
+	EMIT8(op); EMIT8(0xc0 | (src << 3) | dst);
+	return p;
+}
+
+// op dst, imm
+static uint8_t *
+_jit_alui(uint8_t * p, uint8_t op, int dst, uint32_t imm)
+{
+	EMIT8(0x81); EMIT8(0xc0 | (op & 0x38) | dst); EMIT32(imm);
+	return p;
+}
+
+// shr reg, n
+static uint8_t *
+_jit_shr(uint8_t * p, int reg, uint8_t n)
+{
+	EMIT8(0xc1); EMIT8(0xe8 | reg); EMIT8(n);
+	return p;
+}
+
+// not reg
+static uint8_t *
+_jit_not(uint8_t * p, int reg)
+{
+	EMIT8(0xf7); EMIT8(0xd0 | reg);
+	return p;
+}
+
+/*
+ * Ends a branch: eax gets 'pc', or if the condition 'cc' is false,
+ * 'cycles' more cycles and 'taken'
+ */
+static uint8_t *
+_jit_branch(
+		uint8_t * p,
+		uint8_t cc,
+		avr_flashaddr_t pc,
+		uint8_t cycles,
+		avr_flashaddr_t taken)
+{
+	EMIT8(0xb8); EMIT32(pc);				// mov eax, pc
+	EMIT8(0x70 | cc); EMIT8(10);			// jcc .+10
+	EMIT8(0x41); EMIT8(0x83); EMIT8(0x45); EMIT8(0x00);	// add dword [r13], cycles
+	EMIT8(cycles);
+	EMIT8(0xb8); EMIT32(taken);				// mov eax, taken
+	return p;
+}
+
+/*
+ * Calls _avr_sreg_flush(avr), if the pending lazy op 'lazy' needs it:
+ * any op for a sync, or for a logic op, one that sets H and C.
+ */
+static uint8_t *
+_jit_flush(
+		uint8_t * p,
+		uint8_t * lazy,
+		uint8_t keep)
+{
+	if (*lazy <= keep)
+		return p;
+	if (*lazy == JIT_LAZY_UNKNOWN) {
+		EMIT8(0x80); EMIT8(0xbb); EMIT32(LAZY_OFF(op)); EMIT8(keep);	// cmp byte [rbx + op], keep
+		EMIT8(0x70 | JIT_CC_BE); EMIT8(15);	// jbe .+15
+	}
+	EMIT8(0x48); EMIT8(0x89); EMIT8(0xdf);	// mov rdi, rbx
+	EMIT8(0x48); EMIT8(0xb8); EMIT64(_avr_sreg_flush);	// mov rax, _avr_sreg_flush
+	EMIT8(0xff); EMIT8(0xd0);				// call rax
+	*lazy = AVR_SREG_LAZY_NONE;
+	return p;
+}
+
+#define _jit_sync(_p, _lazy) _jit_flush(_p, _lazy, AVR_SREG_LAZY_NONE)
+
+/*
+ * The ALU ops with lazy flags, as in their handlers; the result is
+ * computed in edx from rd in eax and rr in ecx (or the constant k),
+ * plus the carry in esi.
+ */
+enum {
+	JIT_CARRY	= (1 << 0),		// adds/subtracts the carry, needs SREG in sync
+	JIT_IMM		= (1 << 1),		// rr is the constant k
+	JIT_NOSTORE	= (1 << 2),		// compare, the result is dropped
+};
+
+static const struct {
+	uint16_t	mask, opcode;
+	uint8_t		alu, lazy, flags;
+} _jit_alu_ops[] = {
+	{ 0xfc00, 0x0c00, JIT_ADD, AVR_SREG_LAZY_ADD, 0 },					// ADD
+	{ 0xfc00, 0x1c00, JIT_ADD, AVR_SREG_LAZY_ADD, JIT_CARRY },			// ADC
+	{ 0xfc00, 0x1800, JIT_SUB, AVR_SREG_LAZY_SUB, 0 },					// SUB
+	{ 0xfc00, 0x0800, JIT_SUB, AVR_SREG_LAZY_SUB_R, JIT_CARRY },		// SBC
+	{ 0xfc00, 0x1400, JIT_SUB, AVR_SREG_LAZY_SUB, JIT_NOSTORE },		// CP
+	{ 0xfc00, 0x0400, JIT_SUB, AVR_SREG_LAZY_SUB_R, JIT_CARRY | JIT_NOSTORE },	// CPC
+	{ 0xfc00, 0x2000, JIT_AND, AVR_SREG_LAZY_LOGIC, 0 },				// AND
+	{ 0xfc00, 0x2400, JIT_XOR, AVR_SREG_LAZY_LOGIC, 0 },				// EOR
+	{ 0xfc00, 0x2800, JIT_OR, AVR_SREG_LAZY_LOGIC, 0 },					// OR
+	{ 0xf000, 0x3000, JIT_SUB, AVR_SREG_LAZY_SUB, JIT_IMM | JIT_NOSTORE },	// CPI
+	{ 0xf000, 0x4000, JIT_SUB, AVR_SREG_LAZY_SUB_R, JIT_IMM | JIT_CARRY },	// SBCI
+	{ 0xf000, 0x5000, JIT_SUB, AVR_SREG_LAZY_SUB, JIT_IMM },			// SUBI
+	{ 0xf000, 0x6000, JIT_OR, AVR_SREG_LAZY_LOGIC, JIT_IMM },			// ORI
+	{ 0xf000, 0x7000, JIT_AND, AVR_SREG_LAZY_LOGIC, JIT_IMM },			// ANDI
+};
+
+static uint8_t *
+_jit_alu_op(
+		uint8_t * p,
+		avr_insn_t * i,
+		uint8_t * lazy)
+{
+	int o = 0, count = sizeof(_jit_alu_ops) / sizeof(_jit_alu_ops[0]);
+	while (o < count && (i->opcode & _jit_alu_ops[o].mask) != _jit_alu_ops[o].opcode)
+		o++;
+	if (o == count)
+		return NULL;
+	uint8_t op = _jit_alu_ops[o].lazy, flags = _jit_alu_ops[o].flags;
+
+	if (flags & JIT_CARRY) {
+		p = _jit_sync(p, lazy);
+		p = _jit_avr_ld(p, ESI, SREG_OFF(S_C));
+	} else if (op == AVR_SREG_LAZY_LOGIC)	// leaves H and C alone
+		p = _jit_flush(p, lazy, AVR_SREG_LAZY_LOGIC);
+	p = _jit_ld(p, EAX, i->d);
+	if (!(flags & JIT_IMM))
+		p = _jit_ld(p, ECX, i->r);
+	p = _jit_alu(p, JIT_MOV, EDX, EAX);
+	if (flags & JIT_IMM)
+		p = _jit_alui(p, _jit_alu_ops[o].alu, EDX, i->k);
+	else
+		p = _jit_alu(p, _jit_alu_ops[o].alu, EDX, ECX);
+	if (flags & JIT_CARRY)
+		p = _jit_alu(p, _jit_alu_ops[o].alu, EDX, ESI);
+	if (!(flags & JIT_NOSTORE))
+		p = _jit_st(p, EDX, i->d);
+
+	p = _jit_avr_sti(p, LAZY_OFF(op), op);
+	p = _jit_avr_st(p, EDX, LAZY_OFF(res));
+	if (op == AVR_SREG_LAZY_LOGIC) {
+		p = _jit_avr_sti(p, LAZY_OFF(rd), 0);
+		p = _jit_avr_sti(p, LAZY_OFF(rr), 0);
+	} else {
+		p = _jit_avr_st(p, EAX, LAZY_OFF(rd));
+		if (flags & JIT_IMM)
+			p = _jit_avr_sti(p, LAZY_OFF(rr), i->k);
+		else
+			p = _jit_avr_st(p, ECX, LAZY_OFF(rr));
+	}
+	*lazy = op;
+	return p;
+}
+
+// S = N ^ V, from avr->sreg[]
+static uint8_t *
+_jit_flag_s(uint8_t * p)
+{
+	p = _jit_avr_ld(p, EAX, SREG_OFF(S_N));
+	p = _jit_avr_ld(p, ECX, SREG_OFF(S_V));
+	p = _jit_alu(p, JIT_XOR, EAX, ECX);
+	return _jit_avr_st(p, EAX, SREG_OFF(S_S));
+}
+
+// avr->sreg[s] = ((~a & b) >> 15) & 1
+static uint8_t *
+_jit_flag_bit15(uint8_t * p, int a, int b, uint8_t s)
+{
+	p = _jit_alu(p, JIT_MOV, ECX, a);
+	p = _jit_not(p, ECX);
+	p = _jit_alu(p, JIT_AND, ECX, b);
+	p = _jit_shr(p, ECX, 15);
+	p = _jit_alui(p, JIT_AND, ECX, 1);
+	return _jit_avr_st(p, ECX, SREG_OFF(s));
+}
+
+/*
+ * The other register only instructions done inline. The register moves
+ * are the same as _avr_set_r() since the destination is always < 32, the
+ * ones with flags are the same as their handlers.
+ */
+static uint8_t *
+_jit_inline(
+		uint8_t * p,
+		avr_insn_t * i,
+		uint8_t * lazy)
+{
+	if ((i->opcode & 0xf000) == 0xe000) {	// LDI
+		EMIT8(0x41); EMIT8(0xc6); EMIT8(0x44); EMIT8(0x24);	// mov byte [r12 + d], k
+		EMIT8(i->d); EMIT8(i->k);
+	} else if ((i->opcode & 0xfc00) == 0x2c00) {	// MOV
+		EMIT8(0x41); EMIT8(0x8a); EMIT8(0x44); EMIT8(0x24);	// mov al, [r12 + r]
+		EMIT8(i->r);
+		EMIT8(0x41); EMIT8(0x88); EMIT8(0x44); EMIT8(0x24);	// mov [r12 + d], al
+		EMIT8(i->d);
+	} else if ((i->opcode & 0xff00) == 0x0100) {	// MOVW
+		EMIT8(0x66); EMIT8(0x41); EMIT8(0x8b); EMIT8(0x44); EMIT8(0x24);	// mov ax, [r12 + r]
+		EMIT8(i->r);
+		EMIT8(0x66); EMIT8(0x41); EMIT8(0x89); EMIT8(0x44); EMIT8(0x24);	// mov [r12 + d], ax
+		EMIT8(i->d);
+	} else if (i->opcode == 0x0000) {	// NOP
+	} else if ((i->opcode & 0xfe0f) == 0x9402) {	// SWAP
+		p = _jit_ld(p, EAX, i->d);
+		EMIT8(0xc0); EMIT8(0xc0); EMIT8(4);	// rol al, 4
+		p = _jit_st(p, EAX, i->d);
+	} else if ((i->opcode & 0xfe0f) == 0x9403 ||	// INC
+			(i->opcode & 0xfe0f) == 0x940a) {		// DEC
+		int inc = (i->opcode & 0xf) == 0x3;
+		p = _jit_sync(p, lazy);
+		p = _jit_ld(p, EDX, i->d);
+		p = _jit_alui(p, inc ? JIT_ADD : JIT_SUB, EDX, 1);
+		p = _jit_st(p, EDX, i->d);
+		EMIT8(0x80); EMIT8(0xfa); EMIT8(inc ? 0x80 : 0x7f);	// cmp dl, 0x80/0x7f
+		p = _jit_avr_setcc(p, JIT_CC_E, SREG_OFF(S_V));
+		EMIT8(0x84); EMIT8(0xd2);			// test dl, dl
+		p = _jit_avr_setcc(p, JIT_CC_E, SREG_OFF(S_Z));
+		p = _jit_avr_setcc(p, JIT_CC_S, SREG_OFF(S_N));
+		p = _jit_flag_s(p);
+	} else if ((i->opcode & 0xfe00) == 0x9600) {	// ADIW, SBIW
+		int add = !(i->opcode & 0x0100);
+		p = _jit_sync(p, lazy);
+		EMIT8(0x41); EMIT8(0x0f); EMIT8(0xb7); EMIT8(0x44); EMIT8(0x24);	// movzx eax, word [r12 + p]
+		EMIT8(i->d);
+		p = _jit_alu(p, JIT_MOV, EDX, EAX);
+		p = _jit_alui(p, add ? JIT_ADD : JIT_SUB, EDX, i->k);
+		EMIT8(0x66); EMIT8(0x41); EMIT8(0x89); EMIT8(0x54); EMIT8(0x24);	// mov [r12 + p], dx
+		EMIT8(i->d);
+		// V and C are the same terms, swapped for SBIW
+		p = _jit_flag_bit15(p, EAX, EDX, add ? S_V : S_C);
+		p = _jit_flag_bit15(p, EDX, EAX, add ? S_C : S_V);
+		EMIT8(0x66); EMIT8(0x85); EMIT8(0xd2);	// test dx, dx
+		p = _jit_avr_setcc(p, JIT_CC_E, SREG_OFF(S_Z));
+		p = _jit_alu(p, JIT_MOV, ECX, EDX);
+		p = _jit_shr(p, ECX, 15);
+		p = _jit_alui(p, JIT_AND, ECX, 1);
+		p = _jit_avr_st(p, ECX, SREG_OFF(S_N));
+		p = _jit_flag_s(p);
+	} else
+		return _jit_alu_op(p, i, lazy);
+	return p;
+}
+
+/*
+ * Puts SREG bit 's' in cl. Z, N and C are worked out from the pending
+ * lazy op when it is known, without computing all the flags.
+ */
+static uint8_t *
+_jit_sreg_bit(
+		uint8_t * p,
+		uint8_t s,
+		uint8_t * lazy)
+{
+	uint8_t l = *lazy;
+
+	if (s == S_Z && l >= AVR_SREG_LAZY_LOGIC && l <= AVR_SREG_LAZY_SUB) {
+		p = _jit_avr_ld(p, ECX, LAZY_OFF(res));
+		EMIT8(0x84); EMIT8(0xc9);				// test cl, cl
+		EMIT8(0x0f); EMIT8(0x94); EMIT8(0xc1);	// sete cl
+	} else if (s == S_N && l >= AVR_SREG_LAZY_LOGIC && l <= AVR_SREG_LAZY_SUB_R) {
+		p = _jit_avr_ld(p, ECX, LAZY_OFF(res));
+		p = _jit_shr(p, ECX, 7);
+	} else if (s == S_C && l >= AVR_SREG_LAZY_ADD && l <= AVR_SREG_LAZY_SUB_R) {
+		p = _jit_avr_ld(p, EAX, LAZY_OFF(rd));
+		p = _jit_avr_ld(p, EDX, LAZY_OFF(rr));
+		p = _jit_avr_ld(p, ECX, LAZY_OFF(res));
+		p = _jit_alu(p, JIT_MOV, ESI, EDX);
+		if (l == AVR_SREG_LAZY_ADD) {
+			// (rd & rr) | (rr & ~res) | (~res & rd)
+			p = _jit_alu(p, JIT_AND, ESI, EAX);
+			p = _jit_alu(p, JIT_OR, EAX, EDX);
+			p = _jit_not(p, ECX);
+			p = _jit_alu(p, JIT_AND, ECX, EAX);
+			p = _jit_alu(p, JIT_OR, ECX, ESI);
+		} else {
+			// (~rd & rr) | (rr & res) | (res & ~rd)
+			p = _jit_alu(p, JIT_AND, ESI, ECX);
+			p = _jit_alu(p, JIT_OR, EDX, ECX);
+			p = _jit_not(p, EAX);
+			p = _jit_alu(p, JIT_AND, EAX, EDX);
+			p = _jit_alu(p, JIT_OR, EAX, ESI);
+			p = _jit_alu(p, JIT_MOV, ECX, EAX);
+		}
+		p = _jit_alui(p, JIT_AND, ECX, 0x80);
+	} else {
+		// T and I are never lazy
+		if (s != S_T && s != S_I)
+			p = _jit_sync(p, lazy);
+		p = _jit_avr_ld(p, ECX, SREG_OFF(s));
+	}
+	return p;
+}
+
+/*
+ * The branch that ends a block, the new pc ends up in eax. Returns NULL
+ * if it has to be left to its handler.
+ */
+static uint8_t *
+_jit_branch_op(
+		uint8_t * p,
+		avr_t * avr,
+		avr_insn_t * i,
+		avr_flashaddr_t a,
+		uint8_t * lazy)
+{
+	if ((i->opcode & 0xf000) == 0xc000) {	// RJMP
+		EMIT8(0xb8); EMIT32((a + (int16_t)i->k) % (avr->flashend + 1));	// mov eax, pc
+		return p;
+	}
+	if ((i->opcode & 0xf800) == 0xf000) {	// BRxS, BRxC
+		p = _jit_sreg_bit(p, i->r, lazy);
+		EMIT8(0x84); EMIT8(0xc9);			// test cl, cl
+		return _jit_branch(p, i->d ? JIT_CC_E : JIT_CC_NE, a, 1,
+				a + ((int16_t)i->k << 1));
+	}
+	// the skips, the size of the next instruction is known from here
+	if (a + 1 > avr->flashend)
+		return NULL;
+	int skip = avr_insn_is_32_bits(avr, a) ? 2 : 1;
+	if ((i->opcode & 0xfc00) == 0x1000) {	// CPSE
+		p = _jit_ld(p, EAX, i->d);
+		p = _jit_ld(p, ECX, i->r);
+		p = _jit_alu(p, JIT_CMP, EAX, ECX);
+		return _jit_branch(p, JIT_CC_NE, a, skip, a + (skip << 1));
+	}
+	if ((i->opcode & 0xfc08) == 0xfc00) {	// SBRC, SBRS
+		p = _jit_ld(p, EAX, i->d);
+		EMIT8(0xa8); EMIT8(1 << i->r);		// test al, mask
+		return _jit_branch(p, i->k ? JIT_CC_E : JIT_CC_NE, a, skip,
+				a + (skip << 1));
+	}
+	return NULL;
+}
+
+/*
+ * Makes the pages the block at 'at' goes in writable, or executable
+ * again; the code buffer is never both.
+ */
+static int
+_jit_protect(
+		avr_jit_t * jit,
+		uint32_t at,
+		int prot)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)(jit->code + at) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)(jit->code + at) + AVR_JIT_BLOCK_MAX + page - 1) &
+			~(page - 1);
+
+	if (end > (uintptr_t)(jit->code + jit->code_size))
+		end = (uintptr_t)(jit->code + jit->code_size);
+	return mprotect((void *)start, end - start, prot);
+}
+
+avr_jit_block_t *
+avr_jit_translate(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	avr_jit_t * jit = avr->jit;
+
+	if (jit->code_used + AVR_JIT_BLOCK_MAX > jit->code_size)
+		avr_jit_flush(avr);
+	uint32_t at = jit->code_used;
+	if (_jit_protect(jit, at, PROT_READ | PROT_WRITE))
+		return NULL;
+
+	avr_jit_block_t * b = (avr_jit_block_t *)(jit->code + at);
+	uint8_t * code = (uint8_t *)(b + 1);
+	uint8_t * p = _jit_prologue(code);
+	int count = 0, cycles = 0, branch = 0;
+	uint8_t lazy = JIT_LAZY_UNKNOWN;
+	avr_flashaddr_t a = pc;
+
+	while (count < AVR_JIT_MAX_INSN && a < avr->flashend) {
+		avr_insn_t * i = avr_insn_at(avr, a);
+		uint8_t props = avr_insn_props(i);
+
+		if (!(props & (AVR_INSN_REGONLY | AVR_INSN_BRANCH)))
+			break;
+		cycles += i->cycles;
+		count++;
+		a += 2;
+		if (props & AVR_INSN_BRANCH) {
+			branch = 1;
+			uint8_t * n = _jit_branch_op(p, avr, i, a, &lazy);
+			p = n ? n : _jit_call(p, i, a);
+			break;
+		}
+		uint8_t * n = _jit_inline(p, i, &lazy);
+		if (!n) {
+			p = _jit_call(p, i, a);
+			lazy = JIT_LAZY_UNKNOWN;
+		} else
+			p = n;
+	}
+	if (count >= 2) {
+		if (!branch) {
+			EMIT8(0xb8); EMIT32(a);		// mov eax, a
+		}
+		p = _jit_epilogue(p);
+		b->code = (avr_jit_code_t)code;
+		b->cycles = cycles;
+		// branch taken, or skip over a 32 bits instruction
+		b->max_cycles = cycles + (branch ? 2 : 0);
+		b->count = count;
+		jit->code_used = ((p - jit->code) + 15) & ~15;
+	} else	// not worth it
+		b = NULL;
+	if (_jit_protect(jit, at, PROT_READ | PROT_EXEC)) {
+		AVR_LOG(avr, LOG_WARNING, "JIT: can't make the code executable\n");
+		return NULL;
+	}
+	if (b)
+		jit->block[pc >> 1] = b;
+	return b;
+}
+
+#else /* no translator for this host */
+
+int
+avr_jit_init(
+		avr_t * avr)
+{
+	return -1;
+}
+
+void
+avr_jit_terminate(
+		avr_t * avr)
+{
+}
+
+void
+avr_jit_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size)
+{
+}
+
+avr_jit_block_t *
+avr_jit_translate(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+	sim_jit.h
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Basic block translator.
+ *
+ * Hot code (branch targets that are reached often) is translated into
+ * host code "blocks". A block is a straight run of instructions that
+ * only touch r0-r31 and SREG, optionally ended by a branch. Anything
+ * else (IO, SRAM, stack, SLEEP, SPM, SEI/CLI...) ends the block and
+ * is left to the interpreter.
+ *
+ * The register moves, the ALU instructions (with the same lazy SREG
+ * as the interpreter) and the branches and skips are translated to host
+ * code, the others become direct calls to the predecoded instruction
+ * handlers, so the results are exactly the same as interpreting them.
+ * The code buffer is made writable while a block is translated, and
+ * executable again after, never both at once.
+ *
+ * Currently this is only available on x86_64 Linux hosts; elsewhere
+ * avr_jit_init() fails and avr_callback_run_jit() falls back to the
+ * normal interpreter.
+ */
+#ifndef __SIM_JIT_H__
+#define __SIM_JIT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of entries into a pc before it gets translated
+#ifndef AVR_JIT_HOT
+#define AVR_JIT_HOT			32
+#endif
+// maximum number of instructions in a block
+#define AVR_JIT_MAX_INSN	64
+
+typedef avr_flashaddr_t (*avr_jit_code_t)(
+		avr_t * avr,
+		int * cycle);
+
+typedef struct avr_jit_block_t {
+	avr_jit_code_t	code;
+	uint16_t		cycles;		// cycles for the whole block, branch not taken
+	uint16_t		max_cycles;	// worst case, branch taken/skip
+	uint16_t		count;		// number of instructions
+} avr_jit_block_t;
+
+typedef struct avr_jit_t {
+	uint32_t			words;	// flash size, in words
+	avr_jit_block_t **	block;	// translated block starting at each flash word
+	uint8_t *			heat;	// number of times each flash word was jumped to
+	uint8_t *			code;	// executable buffer
+	uint32_t			code_size;
+	uint32_t			code_used;
+} avr_jit_t;
+
+/*
+ * Allocates the translator for this avr, returns 0 if all is fine, or
+ * nonzero if the host can't run translated code.
+ */
+int
+avr_jit_init(
+		avr_t * avr);
+void
+avr_jit_terminate(
+		avr_t * avr);
+/*
+ * Drop any block that covers this range of flash, called by
+ * avr_invalidate_code()
+ */
+void
+avr_jit_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size);
+/*
+ * Translate the block starting at pc, returns NULL if there is
+ * nothing worth translating there.
+ */
+avr_jit_block_t *
+avr_jit_translate(
+		avr_t * avr,
+		avr_flashaddr_t pc);
+
+/*
+ * Returns the block starting at pc, if any. 'entry' tells if pc was
+ * reached by a jump, these are the ones that are counted and eventually
+ * translated.
+ */
+static inline avr_jit_block_t *
+avr_jit_lookup(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		int entry)
+{
+	avr_jit_t * jit = avr->jit;
+	avr_jit_block_t * b = jit->block[pc >> 1];
+
+	if (!b && entry && jit->heat[pc >> 1] < AVR_JIT_HOT &&
+			++jit->heat[pc >> 1] == AVR_JIT_HOT)
+		b = avr_jit_translate(avr, pc);
+	return b;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_JIT_H__ */
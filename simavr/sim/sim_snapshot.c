@@ -0,0 +1,432 @@
+/*
+	sim_snapshot.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "sim_snapshot.h"
+
+/*
+ * The blob is the header, then the core struct (the avr_t and the IO
+ * modules in it), the data space, the flash, the values of the IRQs of the
+ * pool, and the chunks of the cycle timers and of each IO module, each one
+ * after its size.
+ */
+#define AVR_SNAPSHOT_MAGIC		"simavrSN"
+#define AVR_SNAPSHOT_VERSION	1
+
+typedef struct avr_snapshot_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	core_size;
+	uint32_t	flashend;
+	uint32_t	ramend;
+	uint32_t	irq_count;	// slots of the IRQ pool
+	uint32_t	io_count;
+} avr_snapshot_header_t;	// 32 bytes, the core struct after it stays aligned
+
+typedef struct avr_snapshot_irq_t {
+	avr_irq_t *	irq;	// to check it's the same one when restoring
+	uint32_t	value;
+	uint8_t		flags;	// only the AVR_SNAPSHOT_IRQ_FLAGS ones
+} avr_snapshot_irq_t;
+
+// the other flags are how the IRQ is set up, not its state
+#define AVR_SNAPSHOT_IRQ_FLAGS	(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING)
+
+void
+avr_snapshot_put(
+		avr_snapshot_t * s,
+		const void * data,
+		uint32_t size)
+{
+	if (s->error)
+		return;
+	if (size > s->alloc - s->size) {
+		uint32_t alloc = s->alloc ? s->alloc : 4096;
+		while (alloc - s->size < size)
+			alloc *= 2;
+		uint8_t * d = realloc(s->data, alloc);
+		if (!d) {
+			s->error = 1;
+			return;
+		}
+		s->data = d;
+		s->alloc = alloc;
+	}
+	memcpy(s->data + s->size, data, size);
+	s->size += size;
+}
+
+// starts a chunk, returns where its data starts for _avr_snapshot_chunk_end()
+static uint32_t
+_avr_snapshot_chunk_start(
+		avr_snapshot_t * s)
+{
+	uint32_t size = 0;
+	avr_snapshot_put(s, &size, sizeof(size));
+	return s->size;
+}
+
+static void
+_avr_snapshot_chunk_end(
+		avr_snapshot_t * s,
+		uint32_t start)
+{
+	uint32_t size = s->size - start;
+	if (!s->error)
+		memcpy(s->data + start - sizeof(size), &size, sizeof(size));
+}
+
+/*
+ * Copies the machine state kept in the avr_t itself, the rest of it is how
+ * the AVR is set up. 'from' is a saved copy of 'avr', or the AVR it's a
+ * clone of.
+ */
+static void
+_avr_snapshot_machine(
+		avr_t * avr,
+		const avr_t * from)
+{
+	avr->codeend = from->codeend;
+	avr->state = from->state;
+	avr->frequency = from->frequency;
+	avr->vcc = from->vcc;
+	avr->avcc = from->avcc;
+	avr->aref = from->aref;
+	avr->cycle = from->cycle;
+	avr->run_cycle_count = from->run_cycle_count;
+	avr->idle = from->idle;
+	memcpy(avr->sreg, from->sreg, sizeof(avr->sreg));
+	avr->sreg_lazy = from->sreg_lazy;
+	avr->interrupt_state = from->interrupt_state;
+	avr->pc = from->pc;
+	avr->reset_pc = from->reset_pc;
+	memcpy(avr->fuse, from->fuse, sizeof(avr->fuse));
+	avr->lockbits = from->lockbits;
+	avr->interrupts.pending = from->interrupts.pending;
+	avr->interrupts.running_ptr = from->interrupts.running_ptr;
+	for (int i = 0; i < from->interrupts.running_ptr; i++)
+		avr->interrupts.running[i] =
+				avr->interrupts.vector[from->interrupts.running[i]->index];
+}
+
+avr_snapshot_t *
+avr_snapshot_save(
+		avr_t * avr)
+{
+	if (avr->core_size < sizeof(avr_t)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: core not made by avr_core_allocate()\n",
+				__func__);
+		return NULL;
+	}
+	avr_snapshot_t * s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	// the raises still queued are part of the state
+	avr_irq_pool_flush(&avr->irq_pool);
+
+	avr_snapshot_header_t h = {
+		.version = AVR_SNAPSHOT_VERSION,
+		.core_size = avr->core_size,
+		.flashend = avr->flashend,
+		.ramend = avr->ramend,
+		.irq_count = avr->irq_pool.count,
+	};
+	memcpy(h.magic, AVR_SNAPSHOT_MAGIC, sizeof(h.magic));
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		h.io_count++;
+	avr_snapshot_put(s, &h, sizeof(h));
+	avr_snapshot_put(s, avr, avr->core_size);
+	avr_snapshot_put(s, avr->data, avr->ramend + 1);
+	avr_snapshot_put(s, avr->flash, avr->flashend + 1);
+
+	for (int i = 0; i < avr->irq_pool.count; i++) {
+		avr_irq_t * irq = avr->irq_pool.irq[i];
+		avr_snapshot_irq_t e = {
+			.irq = irq,
+			.value = irq ? irq->value : 0,
+			.flags = irq ? irq->flags & AVR_SNAPSHOT_IRQ_FLAGS : 0,
+		};
+		avr_snapshot_put(s, &e, sizeof(e));
+	}
+
+	uint32_t start = _avr_snapshot_chunk_start(s);
+	avr_cycle_timer_serialize(avr, s);
+	_avr_snapshot_chunk_end(s, start);
+
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		start = _avr_snapshot_chunk_start(s);
+		if (io->serialize)
+			io->serialize(io, s);
+		_avr_snapshot_chunk_end(s, start);
+	}
+
+	if (s->error) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: out of memory\n", __func__);
+		avr_snapshot_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+typedef struct avr_snapshot_reader_t {
+	const uint8_t *	data;
+	uint32_t		size, pos;
+} avr_snapshot_reader_t;
+
+// returns the next 'size' bytes, or NULL if there aren't that many left
+static const uint8_t *
+_avr_snapshot_get(
+		avr_snapshot_reader_t * r,
+		uint32_t size)
+{
+	if (size > r->size - r->pos)
+		return NULL;
+	const uint8_t * res = r->data + r->pos;
+	r->pos += size;
+	return res;
+}
+
+static const uint8_t *
+_avr_snapshot_get_chunk(
+		avr_snapshot_reader_t * r,
+		uint32_t * size)
+{
+	const uint8_t * p = _avr_snapshot_get(r, sizeof(*size));
+	if (!p)
+		return NULL;
+	memcpy(size, p, sizeof(*size));
+	return _avr_snapshot_get(r, *size);
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		const avr_snapshot_t * s)
+{
+	avr_snapshot_reader_t r = { .data = s->data, .size = s->size };
+	avr_snapshot_header_t h;
+	uint32_t io_count = 0;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		io_count++;
+
+	// check it all before changing anything
+	const uint8_t * p = _avr_snapshot_get(&r, sizeof(h));
+	if (!p)
+		goto invalid;
+	memcpy(&h, p, sizeof(h));
+	if (memcmp(h.magic, AVR_SNAPSHOT_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_SNAPSHOT_VERSION ||
+			h.core_size != avr->core_size || h.core_size < sizeof(avr_t) ||
+			h.flashend != avr->flashend || h.ramend != avr->ramend ||
+			h.io_count != io_count)
+		goto invalid;
+	const avr_t * saved = (const avr_t *)_avr_snapshot_get(&r, h.core_size);
+	const uint8_t * data = _avr_snapshot_get(&r, h.ramend + 1);
+	const uint8_t * flash = _avr_snapshot_get(&r, h.flashend + 1);
+	const uint8_t * irq = h.irq_count > (UINT32_MAX / sizeof(avr_snapshot_irq_t)) ? NULL :
+			_avr_snapshot_get(&r, h.irq_count * sizeof(avr_snapshot_irq_t));
+	uint32_t timers_size;
+	const uint8_t * timers = _avr_snapshot_get_chunk(&r, &timers_size);
+	if (!saved || !data || !flash || !irq || !timers ||
+			saved->data != avr->data)	// another AVR
+		goto invalid;
+	uint32_t modules = r.pos;
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		uint32_t size;
+		if (!_avr_snapshot_get_chunk(&r, &size) || (size && !io->deserialize))
+			goto invalid;
+	}
+	if (r.pos != r.size)
+		goto invalid;
+	r.pos = modules;
+
+	avr_irq_pool_flush(&avr->irq_pool);
+	/*
+	 * The IRQs in the modules are restored with them, but they keep their
+	 * hooks, only their value is the saved one
+	 */
+	avr_irq_pool_t * pool = &avr->irq_pool;
+	avr_irq_t * irqs = NULL;
+	if (pool->count && !(irqs = malloc(pool->count * sizeof(irqs[0]))))
+		return -1;
+	for (int i = 0; i < pool->count; i++)
+		if (pool->irq[i])
+			irqs[i] = *pool->irq[i];
+
+	int res = 0;
+	memcpy((uint8_t *)avr + sizeof(avr_t), (const uint8_t *)saved + sizeof(avr_t),
+			h.core_size - sizeof(avr_t));
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		uint32_t size = 0;
+		const uint8_t * d = _avr_snapshot_get_chunk(&r, &size);
+		if (io->deserialize && io->deserialize(io, d, size)) {
+			AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: %s state invalid\n",
+					__func__, io->kind);
+			res = -1;
+		}
+	}
+
+	for (int i = 0; i < pool->count; i++)
+		if (pool->irq[i])
+			*pool->irq[i] = irqs[i];
+	free(irqs);
+	for (uint32_t i = 0; i < h.irq_count && i < (uint32_t)pool->count; i++) {
+		avr_snapshot_irq_t e;
+		memcpy(&e, irq + (i * sizeof(e)), sizeof(e));
+		avr_irq_t * q = pool->irq[i];
+		if (!q || q != e.irq)
+			continue;
+		q->value = e.value;
+		q->flags = (q->flags & ~AVR_SNAPSHOT_IRQ_FLAGS) | e.flags;
+	}
+
+	memcpy(avr->data, data, avr->ramend + 1);
+	if (memcmp(avr->flash, flash, avr->flashend + 1)) {
+		avr_invalidate_code(avr, 0, avr->flashend + 1);
+		memcpy(avr->flash, flash, avr->flashend + 1);
+	}
+	if (avr_cycle_timer_deserialize(avr, timers, timers_size)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: cycle timers invalid\n", __func__);
+		res = -1;
+	}
+
+	_avr_snapshot_machine(avr, saved);
+	return res;
+
+invalid:
+	AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: not a snapshot of this AVR\n", __func__);
+	return -1;
+}
+
+static int
+_avr_irq_same_name(
+		const avr_irq_t * a,
+		const avr_irq_t * b)
+{
+	return a->name == b->name || (a->name && b->name && !strcmp(a->name, b->name));
+}
+
+avr_t *
+avr_clone(
+		avr_t * avr)
+{
+	if (avr->core_size < sizeof(avr_t)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: core not made by avr_core_allocate()\n",
+				__func__);
+		return NULL;
+	}
+	avr_t * clone = avr_make_mcu_by_name(avr->mmcu);
+	if (!clone)
+		return NULL;
+	avr_init(clone);
+
+	avr_irq_pool_flush(&avr->irq_pool);
+	/*
+	 * The clone keeps its own IRQs, io modules headers and buffers, all the
+	 * rest of its core struct is copied from the original
+	 */
+	uint8_t * base = (uint8_t *)clone + sizeof(avr_t);
+	uint32_t size = avr->core_size - sizeof(avr_t);
+	avr_irq_pool_t * pool = &clone->irq_pool;
+	uint8_t * own = malloc(size);
+	avr_irq_t * irqs = malloc((pool->count + 1) * sizeof(irqs[0]));
+	if (clone->core_size != avr->core_size || !own || !irqs) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: can't clone %s\n", __func__, avr->mmcu);
+		free(own);
+		free(irqs);
+		avr_terminate(clone);
+		free(clone);
+		return NULL;
+	}
+	memcpy(own, base, size);
+	for (int i = 0; i < pool->count; i++)
+		if (pool->irq[i])
+			irqs[i] = *pool->irq[i];
+	memcpy(base, (uint8_t *)avr + sizeof(avr_t), size);
+
+	// the original's version of something in the clone's core struct
+	#define OWN(_p) ((void *)(own + ((uint8_t *)(_p) - base)))
+	#define IN_CORE(_p) ((uint8_t *)(_p) >= base && (uint8_t *)(_p) < base + size)
+	for (avr_io_t * io = clone->io_port; io; io = io->next)
+		if (IN_CORE(io))
+			memcpy(io, OWN(io), sizeof(*io));
+
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		*irq = irqs[i];
+		avr_irq_t * from = i < avr->irq_pool.count ? avr->irq_pool.irq[i] : NULL;
+		if (!from || !_avr_irq_same_name(irq, from))
+			continue;
+		irq->value = from->value;
+		irq->flags = (irq->flags & ~AVR_SNAPSHOT_IRQ_FLAGS) |
+				(from->flags & AVR_SNAPSHOT_IRQ_FLAGS);
+	}
+	free(irqs);
+
+	memcpy(clone->data, avr->data, avr->ramend + 1);
+	// a custom init can have its own flash, that isn't shared
+	if (!avr->custom.init && !avr->flash_refs &&
+			(avr->flash_refs = malloc(sizeof(*avr->flash_refs))))
+		*avr->flash_refs = 1;
+	if (avr->flash_refs) {
+		__atomic_add_fetch(avr->flash_refs, 1, __ATOMIC_ACQ_REL);
+		free(clone->flash);
+		clone->flash = avr->flash;
+		clone->flash_refs = avr->flash_refs;
+	} else
+		memcpy(clone->flash, avr->flash, avr->flashend + 1);
+
+	for (avr_io_t * io = clone->io_port; io; io = io->next)
+		if (io->clone && IN_CORE(io))
+			io->clone(io, OWN(io));
+	#undef OWN
+	#undef IN_CORE
+	free(own);
+
+	if (avr_cycle_timer_clone(clone, avr))
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s: out of memory for timers\n", __func__);
+	_avr_snapshot_machine(clone, avr);
+
+	// and it runs the same way
+	if (!avr->gdb)
+		clone->run = avr->run;
+	clone->run_cycle_limit = avr->run_cycle_limit;
+	clone->time_policy = avr->time_policy;
+	clone->time_scale = avr->time_scale;
+	clone->idle_skip = avr->idle_skip;
+	clone->log = avr->log;
+	clone->logger = avr->logger;
+	return clone;
+}
+
+void
+avr_snapshot_free(
+		avr_snapshot_t * s)
+{
+	if (!s)
+		return;
+	free(s->data);
+	free(s);
+}
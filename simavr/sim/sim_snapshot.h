@@ -0,0 +1,111 @@
+/*
+	sim_snapshot.h
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine snapshots.
+ *
+ * avr_snapshot_save() copies the whole state of a simulated AVR in a blob:
+ * the core registers and cycle counter, the data space, the flash, the IO
+ * modules, the IRQ values, the pending and running interrupts and the cycle
+ * timers. avr_snapshot_restore() puts it back, any number of times; the
+ * AVR then runs on exactly as it did from the point the snapshot was taken,
+ * cycle for cycle.
+ *
+ * The IO modules are saved whole, as they are in the core struct, since
+ * that's where they keep their state. The ones that also have some state
+ * allocated on the side (EEPROM, SPM page buffer...) save it with their
+ * serialize()/deserialize() hooks.
+ *
+ * What is not part of the machine is left alone by a restore: the IO and
+ * IRQ callbacks, the IRQ hooks and their connections, the gdb, VCD and
+ * trace state, the run settings (run callback, run quantum, time policy).
+ *
+ * A snapshot is only meant for the avr_t that made it: the modules keep
+ * pointers to their AVR and to their buffers, and the cycle timers are
+ * saved as the function pointers and params they are. The parts connected
+ * to the AVR outside of its core struct (see examples/parts) aren't saved
+ * either.
+ *
+ * Take and restore snapshots between two avr_run() calls.
+ *
+ * avr_clone() branches a running AVR instead: the clone is a new avr_t,
+ * made and initialized like the original, that then gets its state the
+ * same way. The flash is shared until one of them writes it, the data
+ * space and EEPROM are small enough to be copied. The modules that own
+ * buffers give the clone its own with their clone() hooks. The cycle
+ * timers of the AVR are copied, those of the parts connected to it (with
+ * a param outside of its core struct) are not, nor are the parts. A clone
+ * can run on another thread than the original.
+ */
+#ifndef __SIM_SNAPSHOT_H__
+#define __SIM_SNAPSHOT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avr_snapshot_t {
+	uint32_t	size;	// bytes used in data
+	uint32_t	alloc;	// bytes allocated for data
+	int			error;	// ran out of memory, while saving
+	uint8_t *	data;
+} avr_snapshot_t;
+
+/*
+ * Saves the state of 'avr'. Returns a snapshot to be freed with
+ * avr_snapshot_free(), or NULL if it ran out of memory.
+ */
+avr_snapshot_t *
+avr_snapshot_save(
+		avr_t * avr);
+/*
+ * Sets 'avr' back to the state saved in 's'. 's' is not changed, it can be
+ * restored again. Returns 0, or -1 if 's' wasn't made from this AVR.
+ */
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		const avr_snapshot_t * s);
+void
+avr_snapshot_free(
+		avr_snapshot_t * s);
+
+/*
+ * Returns a new AVR in the same state as 'avr', to be run on its own and
+ * terminated with avr_terminate(), or NULL if it can't be made. 'avr' must not
+ * be running meanwhile.
+ */
+avr_t *
+avr_clone(
+		avr_t * avr);
+
+// for the serialize() hook of the IO modules, appends to the snapshot
+void
+avr_snapshot_put(
+		avr_snapshot_t * s,
+		const void * data,
+		uint32_t size);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H__ */
@@ -0,0 +1,143 @@
+/*
+	sim_trace.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "sim_trace.h"
+
+/*
+ * The writer thread. It polls, the core never signals it, so adding a
+ * record costs a store and nothing else; the ring is big enough for a few
+ * milliseconds of a busy simulation.
+ */
+static void *
+_avr_trace_writer(
+		void * param)
+{
+	avr_trace_ring_t * t = param;
+
+	for (;;) {
+		// the last records are published before stop is set
+		int stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+		uint32_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		if (head == t->tail) {
+			if (stop)
+				break;
+			usleep(1000);
+			continue;
+		}
+		uint32_t i = t->tail & (AVR_TRACE_RING_SIZE - 1);
+		uint32_t count = head - t->tail;
+		if (count > AVR_TRACE_RING_SIZE - i)
+			count = AVR_TRACE_RING_SIZE - i;	// up to the end of the ring
+		if (fwrite(t->rec + i, sizeof(t->rec[0]), count, t->file) != count &&
+				!t->error)
+			t->error = errno ? errno : EIO;
+		__atomic_store_n(&t->tail, t->tail + count, __ATOMIC_RELEASE);
+	}
+	if (fflush(t->file) && !t->error)
+		t->error = errno;
+	return NULL;
+}
+
+void
+avr_trace_wait(
+		avr_trace_ring_t * t)
+{
+	for (;;) {
+		t->tail_seen = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+		if (t->head - t->tail_seen < AVR_TRACE_RING_SIZE)
+			return;
+		usleep(100);
+	}
+}
+
+int
+avr_trace_start(
+		avr_t * avr,
+		const char * filename)
+{
+	if (avr->trace_ring) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: %s: already tracing\n", __func__);
+		return -1;
+	}
+	avr_trace_ring_t * t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->rec = malloc(AVR_TRACE_RING_SIZE * sizeof(t->rec[0]));
+	t->file = fopen(filename, "wb");
+	if (!t->rec || !t->file) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: %s: can't create %s: %s\n",
+				__func__, filename, strerror(errno));
+		goto error;
+	}
+	setvbuf(t->file, NULL, _IOFBF, 1 << 20);
+
+	avr_trace_header_t h = {
+		.version = AVR_TRACE_VERSION,
+		.rec_size = sizeof(avr_trace_rec_t),
+		.frequency = avr->frequency,
+	};
+	memcpy(h.magic, AVR_TRACE_MAGIC, sizeof(h.magic));
+	strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	if (fwrite(&h, sizeof(h), 1, t->file) != 1) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: %s: can't write %s: %s\n",
+				__func__, filename, strerror(errno));
+		goto error;
+	}
+	if (pthread_create(&t->thread, NULL, _avr_trace_writer, t)) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: %s: can't start the writer\n",
+				__func__);
+		goto error;
+	}
+	// the run callbacks switch to the traced core, see avr_core_traced()
+	avr->trace_ring = t;
+	return 0;
+error:
+	if (t->file)
+		fclose(t->file);
+	free(t->rec);
+	free(t);
+	return -1;
+}
+
+int
+avr_trace_stop(
+		avr_t * avr)
+{
+	avr_trace_ring_t * t = avr->trace_ring;
+	if (!t)
+		return 0;
+	avr->trace_ring = NULL;
+
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->thread, NULL);
+	int res = 0;
+	if (fclose(t->file) || t->error) {
+		AVR_LOG(avr, LOG_ERROR, "TRACE: %s: writing the trace failed: %s\n",
+				__func__, strerror(t->error ? t->error : errno));
+		res = -1;
+	}
+	free(t->rec);
+	free(t);
+	return res;
+}
@@ -0,0 +1,138 @@
+/*
+	sim_trace.h
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary instruction trace.
+ *
+ * Turned on and off at runtime with avr_trace_start() and avr_trace_stop().
+ * While it is on, the core runs with its traced build, avr_run_one_trace(),
+ * that fills one fixed size record per instruction into a ring buffer.
+ * A writer thread drains the ring to a file: the simulation thread never
+ * does any IO or formatting, and only waits if the writer falls a whole
+ * ring behind.
+ *
+ * The file is an avr_trace_header_t followed by the records, in the host
+ * byte order. The trace_avr tool prints them, with the firmware symbols.
+ */
+#ifndef __SIM_TRACE_H__
+#define __SIM_TRACE_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// avr_trace_rec_t flags
+enum {
+	AVR_TRACE_READ	= (1 << 0),	// addr/value is a data space read
+	AVR_TRACE_WRITE	= (1 << 1),	// ... a write, these win over the reads
+};
+
+typedef struct avr_trace_rec_t {
+	avr_cycle_count_t	cycle;	// when the instruction started
+	uint32_t	pc;
+	uint16_t	opcode;		// first word of the instruction
+	uint16_t	sp;			// after the instruction
+	uint32_t	touched;	// r0..r31 changed by the instruction, one bit each
+	uint16_t	addr;		// first data space write, or first read
+	uint8_t		value;
+	uint8_t		flags;		// AVR_TRACE_READ/WRITE, none if no access
+} avr_trace_rec_t;
+
+#define AVR_TRACE_MAGIC		"simavrTR"
+#define AVR_TRACE_VERSION	1
+
+typedef struct avr_trace_header_t {
+	char		magic[8];	// AVR_TRACE_MAGIC, not terminated
+	uint32_t	version;	// AVR_TRACE_VERSION
+	uint32_t	rec_size;	// sizeof(avr_trace_rec_t)
+	uint32_t	frequency;
+	char		mmcu[20];
+} avr_trace_header_t;
+
+#define AVR_TRACE_RING_SIZE	(1 << 16)	// records, power of two
+
+/*
+ * Single producer (the core), single consumer (the writer thread) ring.
+ * Each side only writes its own index, and reads the other one.
+ */
+typedef struct avr_trace_ring_t {
+	// simulation thread side
+	uint32_t	head;		// records filled, published to the writer
+	uint32_t	tail_seen;	// last tail read, to not read it every time
+	avr_trace_rec_t * rec;
+	uint8_t		pad[64];	// keeps the two sides on different cache lines
+
+	// writer thread side
+	uint32_t	tail;		// records written out
+	int			stop;
+	int			error;		// errno of a failed write, tracing goes on
+	FILE *		file;
+	pthread_t	thread;
+} avr_trace_ring_t;
+
+/*
+ * Starts tracing every instruction of 'avr' to 'filename', until
+ * avr_trace_stop() or avr_terminate(). The idle loop skipping is off
+ * while tracing, so the trace has all the instructions.
+ * Returns 0, or -1 if the file or the writer thread can't be created.
+ */
+int
+avr_trace_start(
+		avr_t * avr,
+		const char * filename);
+/*
+ * Stops tracing, and waits for all the records to be written.
+ * Returns 0, or -1 if writing the file failed at some point.
+ */
+int
+avr_trace_stop(
+		avr_t * avr);
+
+// waits until the writer makes room in the ring, for the core
+void
+avr_trace_wait(
+		avr_trace_ring_t * t);
+
+// next record to fill, waiting for room if needed
+static inline avr_trace_rec_t *
+avr_trace_rec_next(
+		avr_trace_ring_t * t)
+{
+	if (t->head - t->tail_seen == AVR_TRACE_RING_SIZE)
+		avr_trace_wait(t);
+	return t->rec + (t->head & (AVR_TRACE_RING_SIZE - 1));
+}
+
+// hands the record returned by avr_trace_rec_next() to the writer
+static inline void
+avr_trace_rec_commit(
+		avr_trace_ring_t * t)
+{
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TRACE_H__ */
@@ -456,7 +456,7 @@ _avr_vcd_notify(
 	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
 	avr_vcd_log_t l = {
 		.sigindex = s->irq.irq,
-		.when = vcd->avr->cycle,
+		.when = avr_irq_get_stamp(irq),
 		.value = value,
 		.floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING),
 	};
@@ -496,6 +496,8 @@ avr_vcd_add_signal(
 
 	const char * names[1] = { iname };
 	avr_init_irq(&vcd->avr->irq_pool, &s->irq, index, 1, names);
+	// the VCD doesn't need the values inside the instruction
+	s->irq.flags |= IRQ_FLAG_DEFERRED;
 	avr_irq_register_notify(&s->irq, _avr_vcd_notify, vcd);
 
 	avr_connect_irq(signal_irq, &s->irq);
@@ -555,6 +557,7 @@ avr_vcd_stop(
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_input_timer, vcd);
 
+	avr_irq_pool_flush(&vcd->avr->irq_pool);
 	avr_vcd_flush_log(vcd);
 
 	if (vcd->input_line)
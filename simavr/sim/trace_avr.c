@@ -0,0 +1,181 @@
+/*
+	trace_avr.c
+
+	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prints a binary trace made with avr_trace_start() (run_avr --trace-file)
+ * one instruction per line, with the code and data addresses resolved to
+ * the symbols of the firmware if its ELF file is given.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_trace.h"
+
+static void
+display_usage(
+	const char * app)
+{
+	printf("Usage: %s [...] <trace file>\n", app);
+	printf( "       [--elf|-e <file>]   Firmware, to resolve the symbols\n"
+			"       [--from <cycle>]    Skip the instructions before <cycle>\n"
+			"       [--to <cycle>]      Stop at <cycle>\n"
+			"       [--help|-h]         Display this usage message and exit\n");
+	exit(1);
+}
+
+static avr_symbol_t ** symbol;
+static int symbolcount;
+
+/*
+ * Formats "name+offset" for the symbol at or before 'addr', looking only
+ * at the symbols in [base, end), the symbols are sorted by address.
+ */
+static const char *
+symbol_name(
+		uint32_t addr,
+		uint32_t base,
+		uint32_t end,
+		char * buf,
+		int size)
+{
+	addr += base;
+	int lo = 0, hi = symbolcount;	// first symbol after addr
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (symbol[mid]->addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || symbol[lo - 1]->addr < base || addr >= end) {
+		buf[0] = 0;
+		return buf;
+	}
+	avr_symbol_t * s = symbol[lo - 1];
+	if (s->addr == addr)
+		snprintf(buf, size, "%s", s->symbol);
+	else
+		snprintf(buf, size, "%s+0x%x", s->symbol, addr - s->addr);
+	return buf;
+}
+
+static void
+print_rec(
+		const avr_trace_rec_t * r)
+{
+	char code[64], data[64];
+
+	printf("%12" PRIu64 " %06x %04x %-24s sp %04x", (uint64_t)r->cycle, r->pc,
+			r->opcode, symbol_name(r->pc, AVR_SEGMENT_OFFSET_FLASH,
+					AVR_SEGMENT_OFFSET_DATA, code, sizeof(code)),
+			r->sp);
+	if (r->flags)
+		printf(" %c %04x=%02x%s%s", r->flags & AVR_TRACE_WRITE ? 'W' : 'R',
+				r->addr, r->value,
+				symbol_name(r->addr, AVR_SEGMENT_OFFSET_DATA,
+						AVR_SEGMENT_OFFSET_EEPROM, data, sizeof(data))[0] ?
+						" " : "", data);
+	for (int i = 0; i < 32; i++)
+		if (r->touched & (1u << i))
+			printf(" r%d", i);
+	printf("\n");
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	const char * elf = NULL, * filename = NULL;
+	uint64_t from = 0, to = UINT64_MAX;
+
+	for (int pi = 1; pi < argc; pi++) {
+		if (!strcmp(argv[pi], "-h") || !strcmp(argv[pi], "--help")) {
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-e") || !strcmp(argv[pi], "--elf")) {
+			if (pi < argc-1)
+				elf = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--from")) {
+			if (pi < argc-1)
+				from = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--to")) {
+			if (pi < argc-1)
+				to = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (argv[pi][0] != '-' && !filename) {
+			filename = argv[pi];
+		} else
+			display_usage(basename(argv[0]));
+	}
+	if (!filename)
+		display_usage(basename(argv[0]));
+
+	if (elf) {
+		elf_firmware_t f = {{0}};
+		if (elf_read_firmware(elf, &f) == -1) {
+			fprintf(stderr, "%s: Unable to load firmware from file %s\n",
+					argv[0], elf);
+			exit(1);
+		}
+		symbol = f.symbol;
+		symbolcount = f.symbolcount;
+	}
+
+	FILE * file = fopen(filename, "rb");
+	if (!file) {
+		perror(filename);
+		exit(1);
+	}
+	avr_trace_header_t h;
+	if (fread(&h, sizeof(h), 1, file) != 1 ||
+			memcmp(h.magic, AVR_TRACE_MAGIC, sizeof(h.magic))) {
+		fprintf(stderr, "%s: %s is not a simavr trace\n", argv[0], filename);
+		exit(1);
+	}
+	if (h.version != AVR_TRACE_VERSION || h.rec_size != sizeof(avr_trace_rec_t)) {
+		fprintf(stderr, "%s: %s: unsupported version %d, record size %d\n",
+				argv[0], filename, h.version, h.rec_size);
+		exit(1);
+	}
+	h.mmcu[sizeof(h.mmcu) - 1] = 0;
+	printf("# %s at %u Hz\n", h.mmcu, h.frequency);
+
+	avr_trace_rec_t rec[1024];
+	size_t count;
+	while ((count = fread(rec, sizeof(rec[0]), 1024, file)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			if (rec[i].cycle > to)
+				goto done;
+			if (rec[i].cycle >= from)
+				print_rec(rec + i);
+		}
+	}
+done:
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Core microbenchmarks. These don't need avr-gcc, the firmwares are tiny
+ * hand assembled loops loaded with avr_loadcode(); each one is run for
+ * a fixed number of cycles and the simulated MHz are printed, on the
+ * default engine or the one given with --engine.
+ *
+ * Usage: bench_core.bench [cycles] [--engine raw|threaded|jit] [name...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim_avr.h"
+#include "avr_ioport.h"
+
+typedef struct bench_t {
+	const char * name;
+	const char * mmcu;
+	const uint16_t * code;
+	int size;
+	void (*setup)(avr_t * avr);	// optional
+} bench_t;
+
+// ldi/sub/sbc/mov/eor loop, register only
+static const uint16_t bench_alu[] = {
+	0xe000,		// ldi r16, 0x00
+	0xe010,		// ldi r17, 0x00
+	0x5001,		// loop: subi r16, 0x01
+	0x4010,		// sbci r17, 0x00
+	0x0c23,		// add r2, r3
+	0x2445,		// eor r4, r5
+	0x2c67,		// mov r6, r7
+	0xcffa,		// rjmp loop
+};
+
+// copies 256 bytes from 0x100 to 0x300, forever
+static const uint16_t bench_memcpy[] = {
+	0xe0a0,		// start: ldi r26, 0x00
+	0xe0b1,		// ldi r27, 0x01
+	0xe0e0,		// ldi r30, 0x00
+	0xe0f3,		// ldi r31, 0x03
+	0xe080,		// ldi r24, 0x00
+	0x900d,		// loop: ld r0, X+
+	0x9201,		// st Z+, r0
+	0x958a,		// dec r24
+	0xf7f1,		// brne loop
+	0xcff6,		// rjmp start
+};
+
+// call/push/pop/ret
+static const uint16_t bench_stack[] = {
+	0xd001,		// loop: rcall func
+	0xcffe,		// rjmp loop
+	0x930f,		// func: push r16
+	0x931f,		// push r17
+	0x93cf,		// push r28
+	0x93df,		// push r29
+	0x91df,		// pop r29
+	0x91cf,		// pop r28
+	0x911f,		// pop r17
+	0x910f,		// pop r16
+	0x9508,		// ret
+};
+
+// bit banging on PORTB, with a listener on PB0 like a part would have
+static const uint16_t bench_gpio[] = {
+	0xef0f,		// ldi r16, 0xff
+	0xb904,		// out DDRB, r16
+	0xe515,		// ldi r17, 0x55
+	0xe2ea,		// ldi r30, 0x2a
+	0x9a28,		// loop: sbi PORTB, 0
+	0x9828,		// cbi PORTB, 0
+	0xb915,		// out PORTB, r17
+	0xb9e5,		// out PORTB, r30
+	0xcffb,		// rjmp loop
+};
+
+static void
+gpio_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	(*(uint32_t *)param)++;
+}
+
+static void
+bench_gpio_setup(
+		avr_t * avr)
+{
+	static uint32_t toggles;
+	avr_irq_register_notify(
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0),
+			gpio_notify, &toggles);
+}
+
+/*
+ * PWM, in the style of board_timer_64led: the three timers in fast PWM
+ * mode, clk/1, with the compare and overflow interrupts on (the vectors
+ * are just a reti). Lots of cycle timers are due on the same cycles.
+ */
+static const uint16_t bench_pwm[] = {
+	[0]  = 0xc01f,		// rjmp main
+	[7 ... 16] = 0x9518,	// TIMER2_COMPA..TIMER0_OVF: reti
+	[32] = 0xef0f,		// main: ldi r16, 0xff
+	0xb904,		// out DDRB, r16
+	0xea03,		// ldi r16, 0xa3 (COMxA1 COMxB1 WGMx1 WGMx0)
+	0xbd04,		// out TCCR0A, r16
+	0x9300, 0x00b0,	// sts TCCR2A, r16
+	0xe400,		// ldi r16, 0x40
+	0xbd07,		// out OCR0A, r16
+	0x9300, 0x00b3,	// sts OCR2A, r16
+	0x9300, 0x0088,	// sts OCR1AL, r16
+	0xe800,		// ldi r16, 0x80
+	0xbd08,		// out OCR0B, r16
+	0x9300, 0x00b4,	// sts OCR2B, r16
+	0x9300, 0x008a,	// sts OCR1BL, r16
+	0xea01,		// ldi r16, 0xa1 (COM1A1 COM1B1 WGM10)
+	0x9300, 0x0080,	// sts TCCR1A, r16
+	0xe007,		// ldi r16, 0x07 (OCIExA OCIExB TOIEx)
+	0x9300, 0x006e,	// sts TIMSK0, r16
+	0x9300, 0x006f,	// sts TIMSK1, r16
+	0x9300, 0x0070,	// sts TIMSK2, r16
+	0xe001,		// ldi r16, 0x01 (CSx0)
+	0xbd05,		// out TCCR0B, r16
+	0x9300, 0x00b1,	// sts TCCR2B, r16
+	0xe009,		// ldi r16, 0x09 (WGM12 CS10)
+	0x9300, 0x0081,	// sts TCCR1B, r16
+	0x9478,		// sei
+	0xcfff,		// loop: rjmp loop
+};
+
+#define BENCH(_n, _mmcu) { #_n, _mmcu, bench_##_n, sizeof(bench_##_n) }
+#define BENCH_SETUP(_n, _mmcu) \
+	{ #_n, _mmcu, bench_##_n, sizeof(bench_##_n), bench_##_n##_setup }
+
+static const bench_t benches[] = {
+	BENCH(alu, "atmega88"),
+	BENCH(memcpy, "atmega88"),
+	BENCH(stack, "atmega88"),
+	BENCH_SETUP(gpio, "atmega88"),
+	BENCH(pwm, "atmega88"),
+	{ 0 },
+};
+
+static const struct {
+	const char * name;
+	void (*run)(avr_t * avr);
+} engines[] = {
+	{ "raw", avr_callback_run_raw },
+	{ "threaded", avr_callback_run_threaded },
+	{ "jit", avr_callback_run_jit },
+	{ 0 },
+};
+
+static int
+bench_run(
+		const bench_t * b,
+		avr_cycle_count_t cycles,
+		void (*run)(avr_t * avr))
+{
+	avr_t * avr = avr_make_mcu_by_name(b->mmcu);
+	if (!avr) {
+		fprintf(stderr, "%s: unknown mcu %s\n", b->name, b->mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	if (run)
+		avr->run = run;
+	avr_loadcode(avr, (uint8_t *)b->code, b->size, 0);
+	if (b->setup)
+		b->setup(avr);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int state = cpu_Running;
+	while (avr->cycle < cycles &&
+			(state == cpu_Running || state == cpu_Sleeping))
+		state = avr_run(avr);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double t = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-10s %12" PRI_avr_cycle_count " cycles %8.3fs %8.2f MHz\n",
+			b->name, avr->cycle, t, avr->cycle / t / 1e6);
+	if (state != cpu_Running && state != cpu_Sleeping) {
+		fprintf(stderr, "%s: stopped early, state %d\n", b->name, state);
+		state = 1;
+	} else
+		state = 0;
+	avr_terminate(avr);
+	return state;
+}
+
+int main(int argc, char **argv)
+{
+	avr_cycle_count_t cycles = argc > 1 ? atoll(argv[1]) : 100000000;
+	void (*engine)(avr_t * avr) = NULL;
+	int res = 0, first = 2;
+
+	if (argc > 3 && !strcmp(argv[2], "--engine")) {
+		for (int i = 0; engines[i].name && !engine; i++)
+			if (!strcmp(argv[3], engines[i].name))
+				engine = engines[i].run;
+		if (!engine) {
+			fprintf(stderr, "unknown engine %s\n", argv[3]);
+			return 1;
+		}
+		first = 4;
+	}
+	for (const bench_t * b = benches; b->name; b++) {
+		int run = argc <= first;
+		for (int i = first; i < argc && !run; i++)
+			run = !strcmp(argv[i], b->name);
+		if (run)
+			res |= bench_run(b, cycles, engine);
+	}
+	return res;
+}
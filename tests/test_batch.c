@@ -0,0 +1,199 @@
+/*
+ * Runs run_avr_batch (built in ../simavr) on a small manifest, on several
+ * workers: jobs that pass, fail, hit their cycle limit or can't be run, and
+ * checks the results file and the exit status. A manifest without jobs is
+ * refused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "tests.h"
+
+#define BATCH	"../simavr/run_avr_batch"
+
+// echoes UART0 up to a newline, then stops
+static const uint16_t echo[] = {
+	0xe108,					// ldi r16, (1 << RXEN0) | (1 << TXEN0)
+	0x9300, 0x00c1,			// sts UCSR0B, r16
+	0x9110, 0x00c0,			// rx: lds r17, UCSR0A
+	0xff17,					// sbrs r17, RXC0
+	0xcffc,					// rjmp rx
+	0x9120, 0x00c6,			// lds r18, UDR0
+	0x9110, 0x00c0,			// tx: lds r17, UCSR0A
+	0xff15,					// sbrs r17, UDRE0
+	0xcffc,					// rjmp tx
+	0x9320, 0x00c6,			// sts UDR0, r18
+	0x302a,					// cpi r18, '\n'
+	0xf791,					// brne rx
+	0x9110, 0x00c0,			// end: lds r17, UCSR0A
+	0xff16,					// sbrs r17, TXC0
+	0xcffc,					// rjmp end
+	0x94f8,					// cli
+	0x9588,					// sleep
+};
+
+static const uint16_t forever[] = {
+	0xcfff,					// rjmp .-2
+};
+
+static char dir[] = "/tmp/simavr-batch-XXXXXX";
+
+static void
+write_file(
+		const char * name,
+		const void * data,
+		size_t size)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE * f = fopen(path, "w");
+	if (!f || fwrite(data, 1, size, f) != size)
+		fail("Can't write %s", path);
+	fclose(f);
+}
+
+static void
+write_hex(
+		const char * name,
+		const uint16_t * code,
+		size_t size)
+{
+	char hex[1024] = "";
+	const uint8_t * b = (const uint8_t *)code;
+	for (size_t o = 0; o < size; o += 16) {
+		int n = size - o > 16 ? 16 : size - o;
+		uint8_t sum = n + (o >> 8) + o;
+		char * p = hex + strlen(hex);
+		p += sprintf(p, ":%02X%04X00", n, (int)o);
+		for (int i = 0; i < n; i++) {
+			p += sprintf(p, "%02X", b[o + i]);
+			sum += b[o + i];
+		}
+		sprintf(p, "%02X\n", (uint8_t)-sum);
+	}
+	strcat(hex, ":00000001FF\n");
+	write_file(name, hex, strlen(hex));
+}
+
+// runs the batch on 'manifest', returns its exit status
+static int
+run_batch(
+		const char * manifest)
+{
+	char cmd[512], cwd[256];
+	write_file("manifest", manifest, strlen(manifest));
+	if (!getcwd(cwd, sizeof(cwd)))
+		fail("Can't get the current directory");
+	snprintf(cmd, sizeof(cmd),
+			"cd %s && %s/" BATCH " -j 3 -o results manifest 2>log", dir, cwd);
+	int status = system(cmd);
+	if (status == -1 || !WIFEXITED(status))
+		fail("Can't run %s", cmd);
+	return WEXITSTATUS(status);
+}
+
+typedef struct result_t {
+	char	name[32], status[16], output[16];
+	unsigned long long cycles;
+} result_t;
+
+static int
+read_results(
+		result_t * r,
+		int max)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%s/results", dir);
+	FILE * f = fopen(path, "r");
+	if (!f)
+		fail("No results in %s", path);
+	int count = 0;
+	unsigned long long usec;
+	while (count < max && fscanf(f, "%31s %15s %15s %llu %llu", r[count].name,
+			r[count].status, r[count].output, &r[count].cycles, &usec) == 5)
+		count++;
+	fclose(f);
+	return count;
+}
+
+static void
+check(
+		result_t * r,
+		const char * name,
+		const char * status,
+		const char * output)
+{
+	if (strcmp(r->name, name) || strcmp(r->status, status) ||
+			strcmp(r->output, output))
+		fail("%s %s %s, expected %s %s %s", r->name, r->status, r->output,
+				name, status, output);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	if (access(BATCH, X_OK))
+		fail("%s isn't built", BATCH);
+	if (!mkdtemp(dir))
+		fail("Can't create %s", dir);
+	write_hex("echo.hex", echo, sizeof(echo));
+	write_hex("forever.hex", forever, sizeof(forever));
+	write_file("hello.txt", "hello\n", 6);
+	write_file("other.txt", "other\n", 6);
+
+	static const char manifest[] =
+		"# some of each\n"
+		"name=pass firmware=echo.hex mcu=atmega88 freq=16000000 "
+			"stdin=hello.txt expect=hello.txt\n"
+		"name=fail firmware=echo.hex mcu=atmega88 freq=16000000 "
+			"stdin=hello.txt expect=other.txt\n"
+		"\n"
+		"name=limit firmware=forever.hex mcu=atmega88 freq=8000000 cycles=100000\n"
+		"name=error firmware=missing.hex mcu=atmega88\n"
+		"firmware=echo.hex mcu=atmega88 freq=16000000 "
+			"stdin=other.txt expect=other.txt\n";
+	if (run_batch(manifest) != 1)
+		fail("Batch with failures didn't return 1");
+	result_t r[8];
+	if (read_results(r, 8) != 5)
+		fail("Not 5 results");
+	check(&r[0], "pass", "done", "pass");
+	check(&r[1], "fail", "done", "fail");
+	check(&r[2], "limit", "limit", "-");
+	check(&r[3], "error", "error", "-");
+	check(&r[4], "7", "done", "pass");	// its line
+	if (r[2].cycles < 100000 || r[2].cycles > 100004)
+		fail("Limited at cycle %llu", r[2].cycles);
+	if (r[0].cycles != r[1].cycles)
+		fail("Same job, %llu and %llu cycles", r[0].cycles, r[1].cycles);
+
+	// the same passing jobs alone
+	static const char passing[] =
+		"name=pass firmware=echo.hex mcu=atmega88 freq=16000000 "
+			"stdin=hello.txt expect=hello.txt\n"
+		"name=limit firmware=forever.hex mcu=atmega88 freq=8000000 cycles=100000\n";
+	if (run_batch(passing) != 0)
+		fail("Passing batch didn't return 0");
+	result_t p[2];
+	if (read_results(p, 2) != 2 || p[0].cycles != r[0].cycles ||
+			p[1].cycles != r[2].cycles)
+		fail("Passing batch results differ");
+	check(&p[0], "pass", "done", "pass");
+
+	// nothing to run
+	if (run_batch("# no jobs\n\n") != 1)
+		fail("Empty batch didn't return 1");
+
+	const char * files[] = { "echo.hex", "forever.hex", "hello.txt",
+			"other.txt", "manifest", "results", "log" };
+	for (int i = 0; i < 7; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	tests_success();
+	return 0;
+}
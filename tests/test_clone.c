@@ -0,0 +1,132 @@
+/*
+ * Checks avr_clone(): the clones of an AVR taken in the middle of an
+ * interrupt run on exactly as the original does, each on its own thread
+ * and at the same time as the original; they share its flash until one
+ * loads some code, and their data space, EEPROM, IRQs and cycle timers are
+ * their own.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_snapshot.h"
+#include "avr_ioport.h"
+
+static const uint16_t firmware[] = {
+	[0] = 0xc01f,			// rjmp main
+	[16] = 0xc01f,			// TIMER0_OVF: rjmp isr
+	[32] = 0xe001,			// main: ldi r16, 1
+	0xbd05,					// out TCCR0B, r16
+	0x9300, 0x006e,			// sts TIMSK0, r16
+	0x9478,					// sei
+	0x9180, 0x0100,			// loop: lds r24, 0x100
+	0x9583,					// inc r24
+	0x9380, 0x0100,			// sts 0x100, r24
+	0xb193,					// in r25, PINB
+	0x9390, 0x0102,			// sts 0x102, r25
+	0xcff7,					// rjmp loop
+	[48] = 0x938f,			// isr: push r24
+	0xb78f,					// in r24, SREG
+	0x938f,					// push r24
+	0x9180, 0x0101,			// lds r24, 0x101
+	0x9583,					// inc r24
+	0x9380, 0x0101,			// sts 0x101, r24
+	0x918f,					// pop r24
+	0xbf8f,					// out SREG, r24
+	0x918f,					// pop r24
+	0x9518,					// reti
+};
+
+#define RUN_CYCLES	200000
+#define CLONES		4
+
+static void *
+run_thread(
+		void * param)
+{
+	avr_run_cycles((avr_t *)param, RUN_CYCLES);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr_cycle_timer_register(avr, 1000, tests_bench_timer, avr);
+
+	avr_run_cycles(avr, 5001);
+	// clone it in the middle of the timer interrupt
+	while (!avr->interrupts.running_ptr)
+		avr_run_cycles(avr, 1);
+	tests_set_eeprom_byte(avr, 0x11);
+
+	avr_t * clone[CLONES];
+	for (int i = 0; i < CLONES; i++) {
+		clone[i] = avr_clone(avr);
+		if (!clone[i])
+			fail("Cloning failed");
+		if (clone[i]->flash != avr->flash)
+			fail("Clone %d doesn't share the flash", i);
+		if (clone[i]->cycle != avr->cycle || clone[i]->pc != avr->pc)
+			fail("Clone %d at cycle %d pc %04x, not %d pc %04x", i,
+					(int)clone[i]->cycle, clone[i]->pc, (int)avr->cycle, avr->pc);
+		if (tests_eeprom_byte(clone[i]) != 0x11)
+			fail("Clone %d EEPROM is 0x%02x", i, tests_eeprom_byte(clone[i]));
+		// all but the first see a different pin raised
+		if (i)
+			avr_raise_irq(avr_io_getirq(clone[i], AVR_IOCTL_IOPORT_GETIRQ('B'),
+					IOPORT_IRQ_PIN0 + i), 1);
+	}
+	tests_set_eeprom_byte(clone[1], 0x22);
+	if (tests_eeprom_byte(avr) != 0x11)
+		fail("Clone EEPROM write changed the original");
+
+	pthread_t thread[CLONES];
+	for (int i = 0; i < CLONES; i++)
+		if (pthread_create(&thread[i], NULL, run_thread, clone[i]))
+			fail("Can't create a thread");
+	run_thread(avr);
+	for (int i = 0; i < CLONES; i++)
+		pthread_join(thread[i], NULL);
+
+	if (!avr->data[0x101] || !avr->data[TESTS_BENCH_TIMER_COUNT])
+		fail("Interrupts (%d) or the timer (%d) didn't run",
+				avr->data[0x101], avr->data[TESTS_BENCH_TIMER_COUNT]);
+	if (avr->data[0x102])
+		fail("Clone pin seen by the original, PINB 0x%02x", avr->data[0x102]);
+	for (int i = 0; i < CLONES; i++) {
+		if (clone[i]->cycle != avr->cycle || clone[i]->pc != avr->pc)
+			fail("Clone %d ended at cycle %d pc %04x, not %d pc %04x", i,
+					(int)clone[i]->cycle, clone[i]->pc, (int)avr->cycle, avr->pc);
+		if (clone[i]->data[0x102] != (i ? 1 << i : 0))
+			fail("Clone %d PINB is 0x%02x", i, clone[i]->data[0x102]);
+		// but for the pins, in PINB, r25 and 0x102
+		for (int a = 0; a <= avr->ramend; a++)
+			if (a != 0x23 && a != 25 && a != 0x102 &&
+					clone[i]->data[a] != avr->data[a])
+				fail("Clone %d: data 0x%04x is 0x%02x, not 0x%02x", i, a,
+						clone[i]->data[a], avr->data[a]);
+	}
+
+	// loading code gives the clone its own flash
+	uint8_t nop[2] = { 0 };
+	avr_loadcode(clone[2], nop, sizeof(nop), 0x1000);
+	if (clone[2]->flash == avr->flash || avr->flash[0x1000] != 0xff ||
+			clone[2]->flash[0x1000] != 0)
+		fail("Loading code in a clone didn't unshare the flash");
+	if (clone[3]->flash != avr->flash)
+		fail("Loading code in a clone unshared the others");
+
+	// the others keep running on the flash after the original is gone
+	avr_terminate(avr);
+	avr_cycle_count_t cycle = clone[3]->cycle;
+	avr_run_cycles(clone[3], 1000);
+	if (clone[3]->cycle <= cycle)
+		fail("Clone stopped with the original");
+	for (int i = 0; i < CLONES; i++)
+		avr_terminate(clone[i]);
+	tests_success();
+	return 0;
+}
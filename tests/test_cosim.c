@@ -0,0 +1,167 @@
+/*
+ * Checks the co-simulation scheduler: two AVRs at different frequencies
+ * keep to the same clock, a pin of one wired to a pin of the other changes
+ * there one quantum after it did on the first, to the cycle, and the board
+ * runs exactly the same way on threads as on one thread, even with an AVR
+ * added half way.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_cosim.h"
+#include "avr_ioport.h"
+
+// toggles PB0, every 160 cycles or so
+static const uint16_t master[] = {
+	0xe001,					// ldi r16, 1
+	0xb904,					// out DDRB, r16
+	0xe011,					// ldi r17, 1
+	0xb105,					// loop: in r16, PORTB
+	0x2701,					// eor r16, r17
+	0xb905,					// out PORTB, r16
+	0xe322,					// ldi r18, 50
+	0x952a,					// delay: dec r18
+	0xf7f1,					// brne delay
+	0xcff9,					// rjmp loop
+};
+
+// copies PINB to 0x100
+static const uint16_t slave[] = {
+	0xb103,					// loop: in r16, PINB
+	0x9300, 0x0100,			// sts 0x100, r16
+	0xcffc,					// rjmp loop
+};
+
+#define QUANTUM		20000		// ns
+#define RUN_TIME	2000000		// ns
+#define MAX_EDGES	1000
+
+typedef struct edges_t {
+	int		count;
+	avr_cycle_count_t cycle[MAX_EDGES];
+	uint32_t value[MAX_EDGES];
+} edges_t;
+
+static void
+edge_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	edges_t * e = (edges_t *)param;
+	if (e->count < MAX_EDGES) {
+		e->cycle[e->count] = *irq->pool->clock;
+		e->value[e->count++] = value;
+	}
+}
+
+typedef struct board_t {
+	avr_t *	avr[3];
+	edges_t	sent, received;
+} board_t;
+
+static void
+run_board(
+		board_t * b,
+		int threads)
+{
+	const uint16_t * fw[2] = { master, slave };
+	int size[2] = { sizeof(master), sizeof(slave) };
+	uint32_t freq[2] = { 16000000, 4000000 };
+
+	avr_cosim_t * c = avr_cosim_new(QUANTUM, threads);
+	if (!c)
+		fail("Creating the board failed");
+	for (int i = 0; i < 2; i++) {
+		b->avr[i] = tests_init_avr_code("atmega88", fw[i], size[i]);
+		b->avr[i]->frequency = freq[i];
+		if (avr_cosim_add(c, b->avr[i]))
+			fail("Adding AVR failed");
+	}
+	avr_irq_t * src = avr_io_getirq(b->avr[0], AVR_IOCTL_IOPORT_GETIRQ('B'),
+			IOPORT_IRQ_PIN0);
+	avr_irq_t * dst = avr_io_getirq(b->avr[1], AVR_IOCTL_IOPORT_GETIRQ('B'),
+			IOPORT_IRQ_PIN0);
+	avr_irq_register_notify(src, edge_hook, &b->sent);
+	avr_irq_register_notify(dst, edge_hook, &b->received);
+	if (avr_cosim_connect(c, src, dst))
+		fail("Connecting failed");
+	static const char * name[] = { "foreign" };
+	avr_irq_t * foreign = avr_alloc_irq(NULL, 0, 1, name);
+	if (!avr_cosim_connect(c, foreign, dst))
+		fail("Connected an IRQ of no AVR of the board");
+	avr_free_irq(foreign, 1);
+
+	// in two goes, it carries on the same, with a third one from half way
+	if (avr_cosim_run(c, RUN_TIME / 2) != 2)
+		fail("AVRs stopped");
+	b->avr[2] = tests_init_avr_code("atmega88", slave, sizeof(slave));
+	b->avr[2]->frequency = 8000000;
+	if (avr_cosim_add(c, b->avr[2]))
+		fail("Adding AVR failed");
+	if (avr_cosim_run(c, RUN_TIME / 2) != 3)
+		fail("AVRs stopped");
+	if (c->time != RUN_TIME)
+		fail("Board at %d ns, not %d", (int)c->time, RUN_TIME);
+	avr_cosim_free(c);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	board_t * b = calloc(1, sizeof(*b));
+	run_board(b, 0);
+
+	// all got to the same time, give or take an instruction
+	for (int i = 0; i < 3; i++) {
+		avr_cycle_count_t end = (avr_cycle_count_t)(i == 2 ?
+				RUN_TIME / 2 : RUN_TIME) * b->avr[i]->frequency / 1000000000;
+		if (b->avr[i]->cycle < end || b->avr[i]->cycle > end + 4)
+			fail("AVR %d at cycle %d, not %d", i,
+					(int)b->avr[i]->cycle, (int)end);
+	}
+	// the edges that were due before the end got there, on time
+	int due = 0;
+	for (int i = 0; i < b->sent.count; i++) {
+		uint64_t when = b->sent.cycle[i] * 1000000000ULL / 16000000 + QUANTUM;
+		if (when >= RUN_TIME)
+			break;
+		due++;
+		avr_cycle_count_t at = (when * 4000000 + 999999999) / 1000000000;
+		if (i >= b->received.count)
+			fail("Edge %d never got there", i);
+		if (b->received.value[i] != b->sent.value[i] ||
+				b->received.cycle[i] < at || b->received.cycle[i] > at + 2)
+			fail("Edge %d: %d at cycle %d, not %d at %d", i,
+					b->received.value[i], (int)b->received.cycle[i],
+					b->sent.value[i], (int)at);
+	}
+	if (due < 100 || b->received.count != due)
+		fail("%d edges sent, %d due, %d received",
+				b->sent.count, due, b->received.count);
+	// and the firmware of the second saw them
+	if ((b->avr[1]->data[0x100] & 1) != b->received.value[due - 1])
+		fail("PINB 0x%02x, the last edge was %d",
+				b->avr[1]->data[0x100], b->received.value[due - 1]);
+
+	board_t * t = calloc(1, sizeof(*t));
+	run_board(t, 1);
+	for (int i = 0; i < 3; i++)
+		if (t->avr[i]->cycle != b->avr[i]->cycle || t->avr[i]->pc != b->avr[i]->pc ||
+				memcmp(t->avr[i]->data, b->avr[i]->data, t->avr[i]->ramend + 1))
+			fail("AVR %d ran differently on threads", i);
+	if (memcmp(&t->sent, &b->sent, sizeof(t->sent)) ||
+			memcmp(&t->received, &b->received, sizeof(t->received)))
+		fail("Edges differ on threads");
+
+	for (int i = 0; i < 3; i++) {
+		avr_terminate(b->avr[i]);
+		avr_terminate(t->avr[i]);
+	}
+	free(b);
+	free(t);
+	tests_success();
+	return 0;
+}
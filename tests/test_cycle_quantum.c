@@ -0,0 +1,111 @@
+/*
+ * Checks that the run quantum (avr_set_run_quantum) doesn't change the
+ * simulation: the cycle timers, the timer0 overflow interrupts and the
+ * IO writes of the firmware must all happen on the same cycles whether
+ * avr_run() returns after each instruction or after many.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+
+static const uint16_t firmware[] = {
+	[0]  = 0xc01f,	// rjmp main
+	[16] = 0xc021,	// TIMER0_OVF: rjmp isr
+	[32] = 0xef0f,	// main: ldi r16, 0xff
+	[33] = 0xb904,	// out DDRB, r16
+	[34] = 0xe001,	// ldi r16, 0x01
+	[35] = 0x9300,	// sts TIMSK0, r16
+	[36] = 0x006e,
+	[37] = 0xbd05,	// out TCCR0B, r16 (clk/1)
+	[38] = 0x9478,	// sei
+	[39] = 0x9513,	// loop: inc r17
+	[40] = 0x0f31,	// add r19, r17
+	[41] = 0xcffd,	// rjmp loop
+	[50] = 0xb125,	// isr: in r18, PORTB
+	[51] = 0x9523,	// inc r18
+	[52] = 0xb925,	// out PORTB, r18
+	[53] = 0x9518,	// reti
+};
+
+#define RUN_CYCLES	100000
+
+static avr_t * current;
+
+static void
+portb_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	tests_events_record(param, current->cycle, value);
+}
+
+static avr_cycle_count_t
+timer_cb(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	tests_events_record(param, avr->cycle, when);
+	return when + 37;
+}
+
+static void
+run(
+		avr_cycle_count_t quantum,
+		tests_events_t * port,
+		tests_events_t * timer)
+{
+	memset(port, 0, sizeof(*port));
+	memset(timer, 0, sizeof(*timer));
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr_set_run_quantum(avr, quantum);
+	current = avr;
+
+	avr_irq_register_notify(
+			avr_iomem_getirq(avr, 0x25, NULL, AVR_IOMEM_IRQ_ALL),
+			portb_notify, port);
+	avr_cycle_timer_register(avr, 100, timer_cb, timer);
+
+	while (avr->cycle < RUN_CYCLES) {
+		int state = avr_run(avr);
+		if (state != cpu_Running)
+			fail("Quantum %d: unexpected state %d",
+					(int)quantum, state);
+	}
+	avr_terminate(avr);
+}
+
+static void
+compare(
+		const char * what,
+		avr_cycle_count_t quantum,
+		tests_events_t * ref,
+		tests_events_t * e)
+{
+	char name[32];
+
+	if (ref->count < 10)
+		fail("Too few %s events (%d)", what, ref->count);
+	snprintf(name, sizeof(name), "Quantum %d %s", (int)quantum, what);
+	tests_events_compare(name, ref, e);
+}
+
+int main(int argc, char **argv) {
+	static tests_events_t ref_port, ref_timer, port, timer;
+	static const avr_cycle_count_t quantums[] = { 7, 256, 1000, 100000 };
+
+	tests_init(argc, argv);
+
+	run(1, &ref_port, &ref_timer);
+	for (int i = 0; i < sizeof(quantums) / sizeof(quantums[0]); i++) {
+		run(quantums[i], &port, &timer);
+		compare("PORTB", quantums[i], &ref_port, &port);
+		compare("timer", quantums[i], &ref_timer, &timer);
+	}
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Checks the cycle timer scheduler against a naive model (an unsorted
+ * array searched linearly) with a long series of random register, cancel,
+ * status and process calls. The timers must fire in the same order, on
+ * the same cycles, including the ones due on the same cycle, which fire
+ * in the order they were registered. There are more timers than fit in
+ * a chunk of the slot pool, so it has to grow, and the pool statistics
+ * have to match the model's.
+ */
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+
+#define KEYS	(AVR_CYCLE_TIMER_CHUNK * 3 + 5)
+#define STEPS	200000
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* the model: one entry per key, as register() cancels first */
+static struct {
+	int active;
+	avr_cycle_count_t when;
+	uint64_t seq;
+} model[KEYS];
+static uint64_t model_seq;
+static avr_cycle_timer_stats_t model_stats;
+
+static void
+model_update_peak(void)
+{
+	uint32_t active = 0;
+	for (int k = 0; k < KEYS; k++)
+		active += model[k].active;
+	if (active > model_stats.peak)
+		model_stats.peak = active;
+	model_stats.active = active;
+}
+
+static void
+model_register(
+		int key,
+		avr_cycle_count_t when)
+{
+	model[key].active = 1;
+	model[key].when = when;
+	model[key].seq = model_seq++;
+	model_stats.inserts++;
+}
+
+/* what the timer returns is a function of the key and when it fired */
+static avr_cycle_count_t
+next_when(
+		int key,
+		avr_cycle_count_t when)
+{
+	uint32_t h = (key * 2654435761u) ^ (uint32_t)when;
+	h ^= h >> 15;
+	return (h % 3) ? 0 : when + 1 + (h % 23);
+}
+
+static int fired_key[KEYS * 64];
+static avr_cycle_count_t fired_when[KEYS * 64];
+static int fired;
+
+static avr_cycle_count_t
+timer_cb(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	int key = (intptr_t)param;
+	if (fired < KEYS * 64) {
+		fired_key[fired] = key;
+		fired_when[fired] = when;
+	}
+	fired++;
+	return next_when(key, when);
+}
+
+/* replays the timers the way the scheduler should have, checking them */
+static void
+model_process(
+		avr_cycle_count_t cycle)
+{
+	int pos = 0;
+	for (;;) {
+		int best = -1;
+		for (int k = 0; k < KEYS; k++)
+			if (model[k].active && (best < 0 ||
+					model[k].when < model[best].when ||
+					(model[k].when == model[best].when &&
+						model[k].seq < model[best].seq)))
+				best = k;
+		if (best < 0 || model[best].when > cycle)
+			break;
+		avr_cycle_count_t when = model[best].when;
+		model[best].active = 0;
+		do {
+			if (pos >= fired || fired_key[pos] != best || fired_when[pos] != when)
+				fail("Timer %d should have fired at %d (event %d)",
+						best, (int)when, pos);
+			pos++;
+			model_stats.fired++;
+			avr_cycle_count_t w = next_when(best, when);
+			when = w > when ? w : 0;
+		} while (when && when <= cycle);
+		if (when) {
+			model_register(best, when);
+			model_update_peak();
+		}
+	}
+	if (pos != fired)
+		fail("Timer %d fired at %d, it shouldn't have",
+				fired_key[pos], (int)fired_when[pos]);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", NULL, 0);
+
+	for (int step = 0; step < STEPS; step++) {
+		int key = rnd() % KEYS;
+		void * param = (void *)(intptr_t)key;
+		switch (rnd() % 6) {
+			case 0:
+			case 1: {
+				avr_cycle_count_t when = rnd() % 2048;
+				avr_cycle_timer_register(avr, when, timer_cb, param);
+				if (model[key].active)
+					model_stats.cancels++;
+				model_register(key, avr->cycle + when);
+				model_update_peak();
+			}	break;
+			case 2:
+				avr_cycle_timer_cancel(avr, timer_cb, param);
+				if (model[key].active)
+					model_stats.cancels++;
+				model[key].active = 0;
+				break;
+			case 3: {
+				avr_cycle_count_t s = avr_cycle_timer_status(avr, timer_cb, param);
+				avr_cycle_count_t m = model[key].active ?
+						1 + model[key].when - avr->cycle : 0;
+				if (s != m)
+					fail("Status of timer %d is %d, expected %d",
+							key, (int)s, (int)m);
+			}	break;
+			default:
+				avr->cycle += rnd() % 16;
+				fired = 0;
+				avr_cycle_timer_process(avr);
+				model_process(avr->cycle);
+				break;
+		}
+	}
+	model_update_peak();
+	avr_cycle_timer_stats_t stats;
+	avr_cycle_timer_get_stats(avr, &stats);
+	if (model_stats.peak <= AVR_CYCLE_TIMER_CHUNK)
+		fail("Only %d timers at once, the pool didn't grow", model_stats.peak);
+	if (stats.slots < model_stats.peak)
+		fail("Pool has %d slots for %d timers", stats.slots, model_stats.peak);
+	if (stats.active != model_stats.active || stats.peak != model_stats.peak ||
+			stats.inserts != model_stats.inserts ||
+			stats.cancels != model_stats.cancels ||
+			stats.fired != model_stats.fired)
+		fail("Stats are active %d peak %d inserts %d cancels %d fired %d, "
+				"expected %d %d %d %d %d",
+				stats.active, stats.peak, (int)stats.inserts,
+				(int)stats.cancels, (int)stats.fired,
+				model_stats.active, model_stats.peak,
+				(int)model_stats.inserts, (int)model_stats.cancels,
+				(int)model_stats.fired);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
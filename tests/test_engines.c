@@ -0,0 +1,184 @@
+/*
+ * Runs the same firmware on the instruction dispatch engines side by side,
+ * avr_callback_run_raw() as the reference, in runs of all sorts of lengths,
+ * and checks they stay in the same state to the cycle: registers, SREG,
+ * SRAM and pc. The firmware mixes most ALU instructions and flag branches,
+ * skips over 16 and 32 bits instructions, memory and a timer interrupt;
+ * its loop is hot enough for the block translator to take it over.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_jit.h"
+
+static const uint16_t firmware[] = {
+	0xc01e,					// rjmp main
+	[16] = 0xc009,			// rjmp isr (TIMER0_OVF)
+	[26] = 0xb6df,			// isr: in r13, SREG
+	0x94f3,					// inc r15
+	0x0cef,					// add r14, r15
+	0xbedf,					// out SREG, r13
+	0x9518,					// reti
+	0xe001,					// main: ldi r16, 0x01
+	0xbd05,					// out TCCR0B, r16
+	0x9300, 0x006e,		// sts TIMSK0, r16
+	0x9478,					// sei
+	0xe50a,					// ldi r16, 0x5a
+	0xea15,					// ldi r17, 0xa5
+	0xe0a0,					// ldi r26, 0x00
+	0xe0b1,					// ldi r27, 0x01
+	0xe080,					// ldi r24, 0x00
+	0xe090,					// ldi r25, 0x00
+	0x2f20,					// loop: mov r18, r16
+	0x0f21,					// add r18, r17
+	0x1f30,					// adc r19, r16
+	0x2702,					// eor r16, r18
+	0x9512,					// swap r17
+	0x1e5f,					// adc r5, r31
+	0x1b13,					// sub r17, r19
+	0x0b42,					// sbc r20, r18
+	0x5357,					// subi r21, 0x37
+	0x4161,					// sbci r22, 0x11
+	0x1701,					// cp r16, r17
+	0x0723,					// cpc r18, r19
+	0xf008,					// brcs l1
+	0x9573,					// inc r23
+	0x732f,					// l1: andi r18, 0x3f
+	0x6831,					// ori r19, 0x81
+	0x2b45,					// or r20, r21
+	0x2360,					// and r22, r16
+	0x1e6f,					// adc r6, r31
+	0x3440,					// cpi r20, 0x40
+	0x076f,					// cpc r22, r31
+	0xf409,					// brne l2
+	0x957a,					// dec r23
+	0x1301,					// l2: cpse r16, r17
+	0xc001,					// rjmp l3
+	0x9553,					// inc r21
+	0xff23,					// l3: sbrs r18, 3
+	0x9563,					// inc r22
+	0xfd35,					// sbrc r19, 5
+	0x9546,					// lsr r20
+	0x9550,					// com r21
+	0x9561,					// neg r22
+	0x9601,					// adiw r24, 1
+	0x01e8,					// movw r28, r16
+	0x97ef,					// sbiw r28, 0x3f
+	0x1e8f,					// adc r8, r31
+	0x96ef,					// adiw r28, 0x3f
+	0x1e7f,					// adc r7, r31
+	0xf00a,					// brmi l4
+	0x9517,					// ror r17
+	0xf00b,					// l4: brvs l5
+	0x9505,					// asr r16
+	0x2344,					// l5: and r20, r20
+	0xf011,					// breq l6
+	0xfb41,					// bst r20, 1
+	0xf956,					// bld r21, 6
+	0x3220,					// l6: cpi r18, 0x20
+	0x074f,					// cpc r20, r31
+	0xf411,					// brne l7
+	0x9f01,					// mul r16, r17
+	0x0c20,					// add r2, r0
+	0xf00d,					// l7: brhs l8
+	0x9488,					// clc
+	0x2fe0,					// l8: mov r30, r16
+	0x70e1,					// andi r30, 0x01
+	0x13ef,					// cpse r30, r31
+	0x9360, 0x0160,		// sts 0x160, r22
+	0x2fe0,					// mov r30, r16
+	0xffe7,					// sbrs r30, 7
+	0x9030, 0x0160,		// lds r3, 0x160
+	0x0eb0,					// add r11, r16
+	0xf008,					// brcs l9
+	0x94ca,					// dec r12
+	0x5a67,					// l9: subi r22, 0xa7
+	0xf00c,					// brlt l10
+	0x9493,					// inc r9
+	0x0ea1,					// l10: add r10, r17
+	0xf011,					// breq l11
+	0x94a7,					// ror r10
+	0xc000,					// rjmp l11
+	0x9493,					// l11: inc r9
+	0xf00b,					// brvs l12
+	0x94ca,					// dec r12
+	0x930d,					// l12: st X+, r16
+	0x932d,					// st X+, r18
+	0x30b3,					// cpi r27, 0x03
+	0xf409,					// brne l13
+	0xe0b1,					// ldi r27, 0x01
+	0xcfaf,					// l13: rjmp loop
+};
+
+#define RUN_CYCLES	2000000
+
+typedef struct engine_t {
+	const char * name;
+	void (*run)(avr_t * avr);
+} engine_t;
+
+static const engine_t engines[] = {
+	{ "threaded", avr_callback_run_threaded },
+	{ "jit", avr_callback_run_jit },
+};
+
+static avr_t *
+start(
+		void (*run)(avr_t * avr))
+{
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr->run = run;
+	return avr;
+}
+
+static void
+compare(
+		const char * name,
+		avr_t * avr,
+		avr_t * ref)
+{
+	uint8_t sreg, ref_sreg;
+	READ_SREG_INTO(avr, sreg);
+	READ_SREG_INTO(ref, ref_sreg);
+	if (avr->cycle != ref->cycle || avr->pc != ref->pc)
+		fail("%s: at cycle %d pc 0x%04x, expected cycle %d pc 0x%04x",
+				name, (int)avr->cycle, avr->pc, (int)ref->cycle, ref->pc);
+	if (sreg != ref_sreg)
+		fail("%s: cycle %d SREG 0x%02x, expected 0x%02x", name,
+				(int)avr->cycle, sreg, ref_sreg);
+	for (int i = 0; i <= ref->ramend; i++)
+		if (avr->data[i] != ref->data[i])
+			fail("%s: cycle %d data[0x%03x] 0x%02x, expected 0x%02x", name,
+					(int)avr->cycle, i, avr->data[i], ref->data[i]);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	for (int e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+		avr_t * ref = start(avr_callback_run_raw);
+		avr_t * avr = start(engines[e].run);
+		for (int step = 1; ref->cycle < RUN_CYCLES; step = (step * 7) % 1000 + 1) {
+			avr_run_cycles(ref, step);
+			avr_run_cycles(avr, step);
+			if (ref->state != cpu_Running || avr->state != cpu_Running)
+				fail("%s: stopped, state %d, expected %d", engines[e].name,
+						avr->state, ref->state);
+			compare(engines[e].name, avr, ref);
+		}
+		// it did run the interrupt, and the loop plenty of times
+		int loops = ref->data[25] << 8 | ref->data[24];
+		if (!ref->data[15] || loops < 1000)
+			fail("Firmware didn't run through, r15 %d, %d loops",
+					ref->data[15], loops);
+		if (avr->run == avr_callback_run_jit &&
+				(!avr->jit || !avr->jit->code_used))
+			fail("%s: nothing was translated", engines[e].name);
+		avr_terminate(ref);
+		avr_terminate(avr);
+	}
+	tests_success();
+	return 0;
+}
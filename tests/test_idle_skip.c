@@ -0,0 +1,168 @@
+/*
+ * Checks the idle loop skipping (avr->idle_skip): the firmware polls a
+ * register that only changes from a cycle timer, and must see it change
+ * on the same cycles whether the idle turns of the loop are run or
+ * skipped. The read callback counts how many turns were really run.
+ * Probing a loop that isn't idle must not run past the end of the run
+ * either, even with a 5 cycles call at the end of the longest probe.
+ */
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+
+#define GPIOR0	0x3e
+#define PORTB	0x25
+
+static const uint16_t firmware[] = {
+	0xef0f,	// ldi r16, 0xff
+	0xb904,	// out DDRB, r16
+	0x9bf0,	// loop: sbis GPIOR0, 0
+	0xcffe,	// rjmp loop
+	0x9513,	// inc r17
+	0xb915,	// out PORTB, r17
+	0x99f0,	// wait: sbic GPIOR0, 0
+	0xcffe,	// rjmp wait
+	0xcff9,	// rjmp loop
+};
+
+/*
+ * A loop that isn't idle, 4096 times. Probed from the return of the call,
+ * it's 15 jmp of 3 cycles then a call of 5, on a 22 bits pc.
+ */
+static const uint16_t calling[] = {
+	0xe080,	// ldi r24, 0x00
+	0xe190,	// ldi r25, 0x10
+	[2] = 0x940c, 4,	// loop: jmp .+0
+	0x940c, 6, 0x940c, 8, 0x940c, 10, 0x940c, 12, 0x940c, 14,
+	0x940c, 16, 0x940c, 18, 0x940c, 20, 0x940c, 22, 0x940c, 24,
+	0x940c, 26, 0x940c, 28, 0x940c, 30,
+	[30] = 0x940e, 34,	// call sub
+	0x940c, 2,	// jmp loop
+	0x9701,	// sub: sbiw r24, 1
+	0xf009,	// breq done
+	0x9508,	// ret
+	0x94f8,	// done: cli
+	0x9588,	// sleep
+};
+
+#define EVENTS	256
+#define RUN_CYCLES	200000
+#define PERIOD	997
+
+typedef struct run_t {
+	int reads;
+	uint8_t ready;
+	int count;
+	avr_cycle_count_t cycle[EVENTS];
+	uint32_t value[EVENTS];
+} run_t;
+
+static avr_t * current;
+
+static void
+portb_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	run_t * r = param;
+	if (r->count < EVENTS) {
+		r->cycle[r->count] = current->cycle;
+		r->value[r->count] = value;
+	}
+	r->count++;
+}
+
+static uint8_t
+gpior_read(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	run_t * r = param;
+	r->reads++;
+	return r->ready;
+}
+
+static avr_cycle_count_t
+toggle_cb(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	run_t * r = param;
+	r->ready = !r->ready;
+	return when + PERIOD;
+}
+
+static void
+run(
+		int idle_skip,
+		run_t * r)
+{
+	memset(r, 0, sizeof(*r));
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr->idle_skip = idle_skip;
+	current = avr;
+
+	avr_register_io_read(avr, GPIOR0, gpior_read, r);
+	avr_register_io_read_idle(avr, GPIOR0);
+	avr_irq_register_notify(
+			avr_iomem_getirq(avr, PORTB, NULL, AVR_IOMEM_IRQ_ALL),
+			portb_notify, r);
+	avr_cycle_timer_register(avr, PERIOD, toggle_cb, r);
+
+	while (avr->cycle < RUN_CYCLES) {
+		int state = avr_run(avr);
+		if (state != cpu_Running)
+			fail("Unexpected state %d", state);
+	}
+	avr_terminate(avr);
+}
+
+static void
+run_deadlines(void)
+{
+	avr_t * avr = tests_init_avr_code("atmega2560", calling, sizeof(calling));
+	avr->idle_skip = 1;
+
+	// ends of runs at all sorts of places in the loop
+	for (int step = 1; avr->state == cpu_Running; step = step % 256 + 1) {
+		avr_cycle_count_t end = avr->cycle + step;
+		avr_run_until(avr, end, NULL, NULL);
+		if (avr->cycle > end + 5)
+			fail("Run to cycle %d went on to %d", (int)end, (int)avr->cycle);
+	}
+	if (avr->state != cpu_Done || avr->data[24] || avr->data[25])
+		fail("Loop ended in state %d, r25:r24 0x%02x%02x", avr->state,
+				avr->data[25], avr->data[24]);
+	avr_terminate(avr);
+}
+
+int main(int argc, char **argv) {
+	static run_t ref, skip;
+
+	tests_init(argc, argv);
+
+	run(0, &ref);
+	run(1, &skip);
+
+	if (ref.count < 50)
+		fail("Too few PORTB events (%d)", ref.count);
+	if (skip.count != ref.count)
+		fail("%d PORTB events, expected %d", skip.count, ref.count);
+	for (int i = 0; i < ref.count && i < EVENTS; i++)
+		if (skip.cycle[i] != ref.cycle[i] || skip.value[i] != ref.value[i])
+			fail("PORTB event %d at cycle %d value %d, "
+					"expected cycle %d value %d", i,
+					(int)skip.cycle[i], (int)skip.value[i],
+					(int)ref.cycle[i], (int)ref.value[i]);
+	if (skip.reads * 10 > ref.reads)
+		fail("Polling loop not skipped, %d reads (%d without skipping)",
+				skip.reads, ref.reads);
+	run_deadlines();
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Checks the interrupt priorities: all the vectors of the core are raised
+ * in reverse order while the interrupts are off, a few are cleared or
+ * disabled again, then the pending ones must run by increasing vector
+ * number, one after the other as each returns with reti. Clearing a vector
+ * that was never raised leaves the others alone, raising one that was
+ * never registered leaves the table and the hooks of its IRQs alone.
+ */
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+static const uint16_t firmware[] = {
+	[0]  = 0xc01f,	// rjmp main
+	[1 ... 31] = 0x9518,	// reti
+	[32] = 0xcfff,	// main: rjmp main
+};
+
+static int order[AVR_INT_MAX_VECTORS], count;
+
+static int stray_raised;
+
+static void
+stray_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	if (value)
+		stray_raised++;
+}
+
+static void
+running_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	if (value && count < AVR_INT_MAX_VECTORS)
+		order[count++] = value;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr_irq_register_notify(
+			avr_get_interrupt_irq(avr, AVR_INT_ANY) + AVR_INT_IRQ_RUNNING,
+			running_notify, NULL);
+
+	avr_int_table_p table = &avr->interrupts;
+	if (table->vector_count < 16)
+		fail("Only %d vectors", table->vector_count);
+	for (int i = 0; i < table->vector_count; i++) {
+		if (table->vector[i]->index != i)
+			fail("Vector %d has index %d", i, table->vector[i]->index);
+		if (i && table->vector[i]->vector < table->vector[i-1]->vector)
+			fail("Vectors not sorted at %d", i);
+	}
+
+	int expect[AVR_INT_MAX_VECTORS], expected = 0;
+	for (int i = table->vector_count - 1; i >= 0; i--) {
+		avr_int_vector_t * v = table->vector[i];
+		avr_regbit_set(avr, v->enable);
+		if (!avr_raise_interrupt(avr, v))
+			fail("Vector %d not raised", v->vector);
+	}
+	for (int i = 0; i < table->vector_count; i++) {
+		avr_int_vector_t * v = table->vector[i];
+		if (!avr_is_interrupt_pending(avr, v))
+			fail("Vector %d not pending", v->vector);
+		if (i % 5 == 1)
+			avr_clear_interrupt(avr, v);
+		else if (i % 5 == 3)
+			avr_regbit_clear(avr, v->enable);
+		else
+			expect[expected++] = v->vector;
+	}
+	// one that was never raised has no bit of its own to clear
+	avr_int_vector_t stray = { .vector = AVR_INT_MAX_VECTORS + 1 };
+	avr_clear_interrupt(avr, &stray);
+	if (!avr_is_interrupt_pending(avr, table->vector[0]) ||
+			!(table->pending & 1))
+		fail("Clearing a stray vector cleared vector %d",
+				table->vector[0]->vector);
+	// its module has set up its IRQs, and been hooked, but not registered it
+	stray.enable = (avr_regbit_t)AVR_IO_REGBIT(0x3e, 0);	// GPIOR0
+	avr_regbit_set(avr, stray.enable);
+	static const char * names[] = { ">stray.pending", ">stray.running" };
+	avr_init_irq(&avr->irq_pool, stray.irq, 0, AVR_INT_IRQ_COUNT, names);
+	avr_irq_register_notify(stray.irq + AVR_INT_IRQ_PENDING, stray_notify, NULL);
+	int vectors = table->vector_count;
+	for (int i = 0; i < 2; i++) {
+		avr_raise_interrupt(avr, &stray);
+		avr_clear_interrupt(avr, &stray);
+	}
+	if (stray_raised != 2)
+		fail("Stray vector hook ran %d times, not 2", stray_raised);
+	if (table->vector_count != vectors || table->vector[0]->index != 0)
+		fail("Raising a stray vector changed the table");
+	avr_regbit_clear(avr, stray.enable);
+	avr_sreg_set(avr, S_I, 1);
+
+	avr_run_cycles(avr, 1000);
+	if (count != expected)
+		fail("%d interrupts ran, expected %d", count, expected);
+	for (int i = 0; i < count; i++)
+		if (order[i] != expect[i])
+			fail("Interrupt %d was vector %d, expected %d",
+					i, order[i], expect[i]);
+	if (avr_has_pending_interrupts(avr))
+		fail("Interrupts still pending");
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Checks the IO registers shared by several handlers: more read and write
+ * handlers on one register than the old fixed tables allowed, duplicates,
+ * calling order, a handler registered by a handler, an observer reading
+ * a register after its peripheral, and the idle flag of the readers.
+ */
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+
+#define GPIOR0	0x3e
+#define GPIOR1	0x4a
+#define PINB	0x23
+
+static const uint16_t firmware[] = {
+	0xe50a,	// ldi r16, 0x5a
+	0xbb0e,	// out GPIOR0, r16
+	0xbb0e,	// out GPIOR0, r16
+	0xb31e,	// in r17, GPIOR0
+	0xb123,	// in r18, PINB
+	0xcfff,	// rjmp .
+};
+
+#define HANDLERS	12
+
+static char wrote[HANDLERS * 4], read[HANDLERS * 4];
+static int pinb_seen = -1;
+
+static void
+append(
+		char * s,
+		int n)
+{
+	strncat(s, (char []){ 'a' + n, 0 }, HANDLERS * 4 - strlen(s) - 1);
+}
+
+static void
+gpior_write(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	int n = (intptr_t)param;
+	append(wrote, n);
+	if (n == 0)
+		avr->data[addr] = v;
+	// only called from the next write
+	if (n == 3)
+		avr_register_io_write(avr, addr, gpior_write, (void*)(intptr_t)HANDLERS);
+}
+
+static uint8_t
+gpior_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	append(read, (intptr_t)param);
+	return avr->data[addr] + 1;
+}
+
+static uint8_t
+pinb_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	pinb_seen = avr->data[addr];
+	return avr->data[addr] | 0x80;
+}
+
+static uint8_t
+idle_read(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		void * param)
+{
+	return avr->data[addr];
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+
+	for (int i = 0; i < HANDLERS; i++) {
+		avr_register_io_write(avr, GPIOR0, gpior_write, (void*)(intptr_t)i);
+		avr_register_io_read(avr, GPIOR0, gpior_read, (void*)(intptr_t)i);
+		if (i != 5)
+			avr_register_io_read_idle(avr, GPIOR0);
+	}
+	avr_register_io_write(avr, GPIOR0, gpior_write, (void*)(intptr_t)0);
+	avr_register_io_read(avr, GPIOR0, gpior_read, (void*)(intptr_t)1);
+	avr_register_io_read(avr, PINB, pinb_read, NULL);
+	if (avr->io[AVR_DATA_TO_IO(GPIOR0)].r.idle)
+		fail("GPIOR0 readers idle, one of them isn't");
+
+	for (int i = 0; i < 3; i++) {
+		avr_register_io_read(avr, GPIOR1, idle_read, (void*)(intptr_t)i);
+		avr_register_io_read_idle(avr, GPIOR1);
+	}
+	if (!avr->io[AVR_DATA_TO_IO(GPIOR1)].r.idle)
+		fail("GPIOR1 readers not idle");
+
+	avr_raise_irq(
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0), 1);
+	avr_run_cycles(avr, 10);
+
+	if (strcmp(wrote, "abcdefghijkl" "abcdefghijklm"))
+		fail("Write handlers called '%s'", wrote);
+	if (strcmp(read, "abcdefghijkl"))
+		fail("Read handlers called '%s'", read);
+	if (avr->data[17] != 0x5a + HANDLERS)
+		fail("GPIOR0 read 0x%02x, expected 0x%02x",
+				avr->data[17], 0x5a + HANDLERS);
+	if (pinb_seen != 0x01 || avr->data[18] != 0x81)
+		fail("PINB observer saw 0x%02x, read 0x%02x", pinb_seen, avr->data[18]);
+
+	avr_terminate(avr);
+	// the dispatchers are freed
+	if (avr->io[AVR_DATA_TO_IO(GPIOR0)].r.c || avr->io[AVR_DATA_TO_IO(GPIOR0)].w.c)
+		fail("Dispatchers left on GPIOR0");
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Checks the deferred IRQ raises (avr_irq_pool_defer): an observer IRQ
+ * flagged IRQ_FLAG_DEFERRED and chained from a pin must see the same
+ * values, with the same cycle stamps, as when it is called synchronously,
+ * whatever the run quantum, including when the queue fills up.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+
+static const uint16_t firmware[] = {
+	0xef0f,		// ldi r16, 0xff
+	0xb904,		// out DDRB, r16
+	0x9a28,		// loop: sbi PORTB, 0
+	0x0000,		// nop
+	0x9828,		// cbi PORTB, 0
+	0xcffc,		// rjmp loop
+};
+
+#define RUN_CYCLES	20000
+
+typedef struct observer_t {
+	avr_t * avr;
+	int late;		// delivered after the cycle they happened on
+	tests_events_t events;	// stamped with the cycle they happened on
+} observer_t;
+
+static void
+observer_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	observer_t * e = param;
+	avr_cycle_count_t stamp = avr_irq_get_stamp(irq);
+
+	if (stamp > e->avr->cycle)
+		fail("Event stamped %d in the future, at cycle %d",
+				(int)stamp, (int)e->avr->cycle);
+	if (stamp < e->avr->cycle)
+		e->late++;
+	tests_events_record(&e->events, stamp, value);
+}
+
+static void
+run(
+		int defer,
+		avr_cycle_count_t quantum,
+		observer_t * e)
+{
+	static const char * names[] = { ">observer" };
+
+	memset(e, 0, sizeof(*e));
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr_set_run_quantum(avr, quantum);
+	if (defer && avr_irq_pool_defer(&avr->irq_pool, 1))
+		fail("Can't defer the IRQs");
+	e->avr = avr;
+
+	avr_irq_t * observer = avr_alloc_irq(&avr->irq_pool, 0, 1, names);
+	observer->flags |= IRQ_FLAG_DEFERRED;
+	avr_irq_register_notify(observer, observer_notify, e);
+	avr_connect_irq(
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0),
+			observer);
+
+	int state = avr_run_cycles(avr, RUN_CYCLES);
+	if (state != cpu_Running)
+		fail("Unexpected state %d", state);
+	// a raise still queued for an IRQ that goes away is dropped
+	if (defer) {
+		avr_raise_irq(observer, 3);
+		avr_free_irq(observer, 1);
+	}
+	avr_terminate(avr);
+}
+
+int main(int argc, char **argv) {
+	static observer_t ref, e;
+	static const avr_cycle_count_t quantums[] = { 1, 256, 100000 };
+	char name[32];
+
+	tests_init(argc, argv);
+
+	run(0, 256, &ref);
+	if (ref.events.count < 1000 || ref.events.count > TESTS_EVENTS)
+		fail("Unexpected number of events, %d", ref.events.count);
+	if (ref.late)
+		fail("%d events were late without deferring", ref.late);
+	for (int i = 0; i < sizeof(quantums) / sizeof(quantums[0]); i++) {
+		avr_cycle_count_t q = quantums[i];
+		run(1, q, &e);
+		snprintf(name, sizeof(name), "Quantum %d", (int)q);
+		tests_events_compare(name, &ref.events, &e.events);
+		if (q > 1 && e.late < e.events.count / 2)
+			fail("Quantum %d: only %d of %d events deferred",
+					(int)q, e.late, e.events.count);
+	}
+	tests_success();
+	return 0;
+}
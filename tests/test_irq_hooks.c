@@ -0,0 +1,134 @@
+/*
+ * Checks the IRQ hooks: duplicates, calling order, chained IRQs, and
+ * hooks registered or unregistered by a notify callback while the IRQ
+ * is being raised, enough of them to need more room in the hook array.
+ * Also checks that avr_raise_irq_bits() only skips the filtered IRQs
+ * that already have their bit.
+ */
+#include <string.h>
+#include "tests.h"
+#include "sim_irq.h"
+
+#define HOOKS	16
+
+static avr_irq_t * irq;		// 0 is raised, 1 is chained to it
+static int calls[HOOKS];
+static char order[HOOKS * 4];
+
+static void
+hook_notify(
+		struct avr_irq_t * i,
+		uint32_t value,
+		void * param)
+{
+	int n = (intptr_t)param;
+	calls[n]++;
+	strncat(order, (char []){ 'a' + n, 0 }, sizeof(order) - strlen(order) - 1);
+
+	switch (n) {
+		case 0:	// adds all the others
+			for (int k = 1; k < HOOKS; k++)
+				avr_irq_register_notify(i, hook_notify, (void*)(intptr_t)k);
+			break;
+		case 1:	// removes itself
+			avr_irq_unregister_notify(i, hook_notify, param);
+			break;
+		case 2:	// removes the next few, called after it
+			for (int k = 3; k < 6; k++)
+				avr_irq_unregister_notify(i, hook_notify, (void*)(intptr_t)k);
+			break;
+		case 6:	// raises again, the hooks called so far are busy
+			avr_raise_irq(i, !value);
+			break;
+	}
+}
+
+static void
+check_raise(
+		uint32_t value,
+		const char * expect)
+{
+	memset(calls, 0, sizeof(calls));
+	order[0] = 0;
+	avr_raise_irq(irq, value);
+	if (strcmp(order, expect))
+		fail("Raising %d, hooks called '%s', expected '%s'",
+				value, order, expect);
+}
+
+static void
+bits_notify(
+		struct avr_irq_t * i,
+		uint32_t value,
+		void * param)
+{
+	strncat(order, (char []){ '0' + i->irq, 0 }, sizeof(order) - strlen(order) - 1);
+}
+
+static void
+check_bits(
+		avr_irq_t * bits,
+		uint32_t value,
+		uint32_t mask,
+		const char * expect)
+{
+	order[0] = 0;
+	avr_raise_irq_bits(bits, value, mask);
+	if (strcmp(order, expect))
+		fail("Raising bits %02x/%02x, called '%s', expected '%s'",
+				value, mask, order, expect);
+}
+
+int main(int argc, char **argv) {
+	static const char * names[] = { "src", "dst" };
+
+	tests_init(argc, argv);
+
+	irq = avr_alloc_irq(NULL, 0, 2, names);
+	avr_irq_register_notify(irq + 1, hook_notify, (void*)(intptr_t)15);
+	avr_connect_irq(irq, irq + 1);
+	avr_connect_irq(irq, irq + 1);
+	avr_irq_register_notify(irq, hook_notify, (void*)(intptr_t)0);
+	avr_irq_register_notify(irq, hook_notify, (void*)(intptr_t)0);
+
+	// the new hooks are only called from the next raise
+	check_raise(1, "ap");
+	if (calls[0] != 1 || calls[15] != 1)
+		fail("Duplicate hooks were called");
+	// the latest registered first, and 'p' is also chained. 'g' raises
+	// again: only 'g' itself is busy then. In that raise 'c' removes 'd'
+	// to 'f' after they were called, so the outer raise skips them, and
+	// 'a' adds them back, with 'b'
+	check_raise(0, "ponmlkjihg" "ponmlkjihfedcbapcap");
+	// the dead ones are gone, the ones added back are called first now
+	for (int i = 0; i < 2; i++)
+		check_raise(i, "fedbponmlkjihg" "fedponmlkjihcap" "cap");
+
+	avr_unconnect_irq(irq, irq + 1);
+	for (int k = 0; k < HOOKS; k++)
+		avr_irq_unregister_notify(irq, hook_notify, (void*)(intptr_t)k);
+	check_raise(1, "");
+	avr_raise_irq(irq + 1, 0);
+	if (calls[15] != 1)
+		fail("Chained IRQ hook not called directly");
+
+	avr_free_irq(irq, 2);
+
+	// 0 to 5 filtered, 6 filtered and inverted, 7 not filtered
+	static const char * bit_names[] = { "0", "1", "2", "3", "4", "5", "6", "7" };
+	avr_irq_t * bits = avr_alloc_irq(NULL, 0, 8, bit_names);
+	for (int i = 0; i < 8; i++) {
+		if (i < 7)
+			bits[i].flags |= IRQ_FLAG_FILTERED;
+		avr_irq_register_notify(bits + i, bits_notify, NULL);
+	}
+	bits[6].flags |= IRQ_FLAG_NOT;
+	check_bits(bits, 0x00, 0xff, "01234567");	// first raise, all of them
+	check_bits(bits, 0x00, 0xff, "7");
+	check_bits(bits, 0x41, 0x0f, "0");
+	check_bits(bits, 0x40, 0xff, "067");
+	avr_free_irq(bits, 8);
+
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Checks the host sleep totals of the time policies: in real time the AVR
+ * time is all slept, not at all when fast, and scaled down when scaled,
+ * without losing what the scale doesn't divide from one sleep to the next.
+ */
+#include <stddef.h>
+#include "tests.h"
+#include "sim_avr.h"
+
+#define SLEEPS	10000
+#define CYCLES	37		// a sleep, in usecs at 1MHz
+
+static uint32_t
+sleep_total(
+		avr_t * avr,
+		uint8_t policy,
+		uint32_t scale)
+{
+	uint32_t total = 0;
+
+	avr_set_time_policy(avr, policy, scale);
+	for (int i = 0; i < SLEEPS; i++)
+		total += avr_pending_sleep_usec(avr, CYCLES);
+	return total;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", NULL, 0);
+	avr->frequency = 1000000;
+	uint32_t usec = SLEEPS * CYCLES;
+
+	uint32_t total = sleep_total(avr, AVR_TIME_REALTIME, 1);
+	if (total + avr->sleep_usec != usec || avr->sleep_usec > 200)
+		fail("Real time slept %u usecs, %u pending, of %u",
+				total, avr->sleep_usec, usec);
+
+	total = sleep_total(avr, AVR_TIME_FAST, 1);
+	if (total)
+		fail("Fast slept %u usecs", total);
+
+	static const uint32_t scales[] = { 2, 7, 1000 };
+	for (int i = 0; i < sizeof(scales) / sizeof(scales[0]); i++) {
+		uint32_t s = scales[i];
+		total = sleep_total(avr, AVR_TIME_SCALED, s);
+		if (total * s + avr->sleep_usec != usec || avr->sleep_usec > 201 * s)
+			fail("Scaled by %u slept %u usecs, %u pending, of %u",
+					s, total, avr->sleep_usec, usec);
+	}
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Checks the machine snapshots: a restored AVR runs on exactly as it did
+ * after the snapshot, with its interrupts, IO modules and cycle timers,
+ * as many times as it's restored; what changed in between (EEPROM, IRQ
+ * values, a timer setting, cycle timers) is put back; and the snapshot of
+ * another AVR is refused.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_snapshot.h"
+#include "avr_ioport.h"
+
+static const uint16_t firmware[] = {
+	[0] = 0xc01f,			// rjmp main
+	[16] = 0xc01f,			// TIMER0_OVF: rjmp isr
+	[32] = 0xe001,			// main: ldi r16, 1
+	0xbd05,					// out TCCR0B, r16
+	0x9300, 0x006e,			// sts TIMSK0, r16
+	0x9478,					// sei
+	0x9180, 0x0100,			// loop: lds r24, 0x100
+	0x9583,					// inc r24
+	0x9380, 0x0100,			// sts 0x100, r24
+	0xcffa,					// rjmp loop
+	[48] = 0x938f,			// isr: push r24
+	0xb78f,					// in r24, SREG
+	0x938f,					// push r24
+	0x9180, 0x0101,			// lds r24, 0x101
+	0x9583,					// inc r24
+	0x9380, 0x0101,			// sts 0x101, r24
+	0x918f,					// pop r24
+	0xbf8f,					// out SREG, r24
+	0x918f,					// pop r24
+	0x9518,					// reti
+};
+
+#define RUN_CYCLES	20000
+
+// as the core does for an OUT
+static void
+io_write(
+		avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v)
+{
+	avr->io[AVR_DATA_TO_IO(addr)].w.c(avr, addr, v,
+			avr->io[AVR_DATA_TO_IO(addr)].w.param);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr_t * other = tests_init_avr_code("atmega88", NULL, 0);
+	avr_cycle_timer_register(avr, 1000, tests_bench_timer, avr);
+	avr_irq_t * pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0);
+
+	avr_run_cycles(avr, 5001);
+	// save it in the middle of the timer interrupt
+	while (!avr->interrupts.running_ptr)
+		avr_run_cycles(avr, 1);
+	tests_set_eeprom_byte(avr, 0x11);
+	avr_snapshot_t * s = avr_snapshot_save(avr);
+	if (!s)
+		fail("Saving failed");
+	avr_cycle_count_t start = avr->cycle;
+
+	avr_run_cycles(avr, RUN_CYCLES);
+	avr_cycle_count_t end = avr->cycle;
+	avr_flashaddr_t pc = avr->pc;
+	uint8_t * data = malloc(avr->ramend + 1);
+	memcpy(data, avr->data, avr->ramend + 1);
+	if (!data[0x101] || !data[TESTS_BENCH_TIMER_COUNT])
+		fail("Interrupts (%d) or the timer (%d) didn't run", data[0x101],
+				data[TESTS_BENCH_TIMER_COUNT]);
+
+	for (int i = 0; i < 3; i++) {
+		// things the restore has to undo
+		tests_set_eeprom_byte(avr, 0x22);
+		io_write(avr, 0x45, 2);	// TCCR0B, timer at clk/8
+		avr_raise_irq(pin, 1);
+		avr_cycle_timer_register(avr, 10, tests_bench_timer, other);
+
+		if (avr_snapshot_restore(avr, s))
+			fail("Restoring failed");
+		if (avr->cycle != start)
+			fail("Restored at cycle %d, saved at %d", (int)avr->cycle, (int)start);
+		if (tests_eeprom_byte(avr) != 0x11)
+			fail("EEPROM not restored, 0x%02x", tests_eeprom_byte(avr));
+		if (pin->value != 0)
+			fail("IRQ value not restored");
+		if (avr_cycle_timer_status(avr, tests_bench_timer, other))
+			fail("Timer registered after the snapshot still there");
+		if (!avr_cycle_timer_status(avr, tests_bench_timer, avr))
+			fail("Timer registered before the snapshot gone");
+
+		avr_run_cycles(avr, RUN_CYCLES);
+		if (avr->cycle != end || avr->pc != pc)
+			fail("Run %d ended at cycle %d pc %04x, not %d pc %04x", i,
+					(int)avr->cycle, avr->pc, (int)end, pc);
+		for (int a = 0; a <= avr->ramend; a++)
+			if (avr->data[a] != data[a])
+				fail("Run %d: data 0x%04x is 0x%02x, not 0x%02x", i, a,
+						avr->data[a], data[a]);
+	}
+
+	if (!avr_snapshot_restore(other, s))
+		fail("Restored the snapshot of another AVR");
+	if (other->cycle)
+		fail("Refused snapshot changed the AVR");
+	avr_terminate(other);
+
+	avr_snapshot_free(s);
+	free(data);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
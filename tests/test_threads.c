@@ -0,0 +1,126 @@
+/*
+ * Runs a lot of AVRs at once on a few threads, each with its own firmware
+ * and its own logger, and checks they all end the way they do alone. Built
+ * with -fsanitize=thread, it finds the state the library still shares
+ * between them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+// adds K to r17 20000 times, then stops
+static const uint16_t firmware[] = {
+	0xe000,					// ldi r16, K
+	0x2711,					// eor r17, r17
+	0xec38,					// ldi r19, 200
+	0xe624,					// outer: ldi r18, 100
+	0x0f10,					// inner: add r17, r16
+	0x9310, 0x0100,			// sts 0x100, r17
+	0x952a,					// dec r18
+	0xf7d9,					// brne inner
+	0x953a,					// dec r19
+	0xf7c1,					// brne outer
+	0x94f8,					// cli
+	0x9588,					// sleep
+};
+
+#define JOBS	64
+#define WORKERS	8
+
+typedef struct job_t {
+	uint8_t		k;
+	int			logged;		// messages to its own logger
+	uint8_t		result;
+	avr_cycle_count_t cycle;
+} job_t;
+
+static job_t job[JOBS];
+static int next_job;
+static __thread job_t * current;	// of the thread, for the logger
+static char regname[256][8];
+
+static void
+job_logger(
+		avr_t * avr,
+		const int level,
+		const char * format,
+		va_list ap)
+{
+	current->logged++;
+}
+
+static void
+run_job(
+		job_t * j)
+{
+	uint16_t code[sizeof(firmware) / 2];
+	memcpy(code, firmware, sizeof(code));
+	code[0] |= ((j->k & 0xf0) << 4) | (j->k & 0x0f);
+
+	avr_t * avr = tests_init_avr_code("atmega88", code, sizeof(code));
+	current = j;
+	avr->logger = job_logger;
+	int state;
+	do
+		state = avr_run(avr);
+	while (state != cpu_Done && state != cpu_Crashed);
+	j->result = avr->data[0x100];
+	j->cycle = avr->cycle;
+	avr_terminate(avr);
+}
+
+static void *
+worker(
+		void * param)
+{
+	int i;
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < JOBS) {
+		run_job(&job[i]);
+		// as the traced cores print them
+		for (int r = 0; r < 256; r++)
+			if (strcmp(avr_regname(r), regname[r]))
+				fail("Register %d is %s, not %s", r, avr_regname(r), regname[r]);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	for (int i = 0; i < JOBS; i++)
+		job[i].k = i * 37 + 1;
+	for (int r = 0; r < 256; r++)
+		sprintf(regname[r], r < 32 ? "r%d" : "io:%02x", r);
+	strcpy(regname[R_XL], "XL"); strcpy(regname[R_XH], "XH");
+	strcpy(regname[R_YL], "YL"); strcpy(regname[R_YH], "YH");
+	strcpy(regname[R_ZL], "ZL"); strcpy(regname[R_ZH], "ZH");
+	strcpy(regname[R_SPL], "SPL"); strcpy(regname[R_SPH], "SPH");
+	strcpy(regname[R_SREG], "SREG");
+	// one alone first, as reference
+	job_t ref = { .k = job[0].k };
+	run_job(&ref);
+
+	pthread_t thread[WORKERS];
+	for (int i = 0; i < WORKERS; i++)
+		if (pthread_create(&thread[i], NULL, worker, NULL))
+			fail("Can't create a thread");
+	for (int i = 0; i < WORKERS; i++)
+		pthread_join(thread[i], NULL);
+
+	for (int i = 0; i < JOBS; i++) {
+		uint8_t expect = (20000 * job[i].k) & 0xff;
+		if (job[i].result != expect)
+			fail("AVR %d ended with %d, not %d", i, job[i].result, expect);
+		if (job[i].cycle != ref.cycle)
+			fail("AVR %d ended at cycle %d, not %d", i,
+					(int)job[i].cycle, (int)ref.cycle);
+		if (!job[i].logged)
+			fail("AVR %d didn't log to its own logger", i);
+	}
+	tests_success();
+	return 0;
+}
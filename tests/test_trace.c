@@ -0,0 +1,115 @@
+/*
+ * Checks the binary trace (avr_trace_start): one record per instruction,
+ * with the cycle, pc, opcode, SP, changed registers and data access all
+ * right, none missing even with the idle loop skipping asked for, and
+ * enough of them to go round the ring a few times. Another AVR runs the
+ * same firmware on the plain core meanwhile, and has to end up the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_trace.h"
+
+static const uint16_t firmware[] = {
+	0xe50a,			// ldi r16, 0x5a
+	0x9300, 0x0100,	// sts 0x0100, r16
+	0x9110, 0x0100,	// lds r17, 0x0100
+	0x931f,			// push r17
+	0x912f,			// pop r18
+	0xbb2e,			// out GPIOR0, r18
+	0xcfff,			// loop: rjmp loop
+};
+
+static const avr_trace_rec_t expect[] = {
+	{ .cycle = 0, .pc = 0x00, .opcode = 0xe50a, .sp = 0x4ff,
+		.touched = 1 << 16 },
+	{ .cycle = 1, .pc = 0x02, .opcode = 0x9300, .sp = 0x4ff,
+		.addr = 0x100, .value = 0x5a, .flags = AVR_TRACE_WRITE },
+	{ .cycle = 3, .pc = 0x06, .opcode = 0x9110, .sp = 0x4ff,
+		.touched = 1 << 17, .addr = 0x100, .value = 0x5a, .flags = AVR_TRACE_READ },
+	{ .cycle = 5, .pc = 0x0a, .opcode = 0x931f, .sp = 0x4fe,
+		.addr = 0x4ff, .value = 0x5a, .flags = AVR_TRACE_WRITE },
+	{ .cycle = 7, .pc = 0x0c, .opcode = 0x912f, .sp = 0x4ff,
+		.touched = 1 << 18, .addr = 0x4ff, .value = 0x5a, .flags = AVR_TRACE_READ },
+	{ .cycle = 9, .pc = 0x0e, .opcode = 0xbb2e, .sp = 0x4ff,
+		.addr = 0x3e, .value = 0x5a, .flags = AVR_TRACE_WRITE },
+	{ .cycle = 10, .pc = 0x10, .opcode = 0xcfff, .sp = 0x4ff },
+};
+#define EXPECT	(sizeof(expect) / sizeof(expect[0]))
+
+#define RUN_CYCLES	(AVR_TRACE_RING_SIZE * 8)
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char filename[] = "/tmp/simavr_trace_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1)
+		fail("Can't create a temporary file");
+	close(fd);
+
+	avr_t * avr = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	avr->idle_skip = 1;
+	avr_run_t run = avr->run;
+
+	avr_t * plain = tests_init_avr_code("atmega88", firmware, sizeof(firmware));
+	plain->idle_skip = 1;
+
+	if (avr_trace_start(avr, filename))
+		fail("Can't start tracing");
+	if (!avr_trace_start(avr, filename))
+		fail("Started tracing twice");
+	for (int i = 0; i < 8; i++) {
+		avr_run_cycles(avr, RUN_CYCLES / 8);
+		avr_run_cycles(plain, RUN_CYCLES / 8);
+	}
+	avr_cycle_count_t end = avr->cycle;
+	if (avr_trace_stop(avr))
+		fail("Writing the trace failed");
+	if (avr->run != run)
+		fail("Run callback changed");
+	if (plain->cycle != end || memcmp(plain->data, avr->data, 0x100))
+		fail("Plain core at cycle %d, traced one at %d, or registers differ",
+				(int)plain->cycle, (int)end);
+	avr_terminate(plain);
+
+	FILE * f = fopen(filename, "rb");
+	if (!f)
+		fail("Can't open the trace");
+	avr_trace_header_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+			memcmp(h.magic, AVR_TRACE_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_TRACE_VERSION ||
+			h.rec_size != sizeof(avr_trace_rec_t) ||
+			strcmp(h.mmcu, "atmega88"))
+		fail("Bad trace header");
+
+	avr_trace_rec_t r;
+	int count = 0;
+	avr_cycle_count_t cycle = 0;
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		avr_trace_rec_t e = expect[count < EXPECT ? count : EXPECT - 1];
+		if (count >= EXPECT)
+			e.cycle = cycle;
+		if (r.cycle != e.cycle || r.pc != e.pc || r.opcode != e.opcode ||
+				r.sp != e.sp || r.touched != e.touched || r.flags != e.flags ||
+				(r.flags && (r.addr != e.addr || r.value != e.value)))
+			fail("Record %d: cycle %d pc %04x op %04x sp %04x regs %08x "
+					"flags %d %04x=%02x", count, (int)r.cycle, r.pc, r.opcode,
+					r.sp, r.touched, r.flags, r.addr, r.value);
+		cycle = r.cycle + 2;
+		count++;
+	}
+	fclose(f);
+	unlink(filename);
+	if (cycle < end || count < RUN_CYCLES / 2)
+		fail("Only %d records, up to cycle %d of %d",
+				count, (int)cycle, (int)end);
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
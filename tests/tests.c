@@ -2,9 +2,10 @@
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
+#include "sim_time.h"
 #include "avr_uart.h"
+#include "avr_eeprom.h"
 #include <stdio.h>
-#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -45,58 +46,11 @@ void tests_init(int argc, char **argv) {
 	atexit(atexit_handler);
 }
 
-static avr_cycle_count_t
-cycle_timer_longjmp_cb(struct avr_t *avr, avr_cycle_count_t when, void *param) {
-	jmp_buf *jmp = param;
-	longjmp(*jmp, LJR_CYCLE_TIMER);
-	return 0;	// clear warning
-}
-
-static jmp_buf *special_deinit_jmpbuf = NULL;
-
-static void special_deinit_longjmp_cb(struct avr_t *avr, void *data) {
-	if (special_deinit_jmpbuf)
-		longjmp(*special_deinit_jmpbuf, LJR_SPECIAL_DEINIT);
-}
-
-static int my_avr_run(avr_t * avr)
-{
-	if (avr->state == cpu_Stopped)
-		return avr->state;
-
-	uint16_t new_pc = avr->pc;
-
-	if (avr->state == cpu_Running)
-		new_pc = avr_run_one(avr);
-
-	// run the cycle timers, get the suggested sleep time
-	// until the next timer is due
-	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
-
-	avr->pc = new_pc;
-
-	if (avr->state == cpu_Sleeping) {
-		if (!avr->sreg[S_I]) {
-			printf("simavr: sleeping with interrupts off, quitting gracefully\n");
-			avr_terminate(avr);
-			fail("Test case error: special_deinit() returned?");
-			exit(0);
-		}
-		/*
-		 * try to sleep for as long as we can (?)
-		 */
-		// uint32_t usec = avr_cycles_to_usec(avr, sleep);
-		// printf("sleep usec %d cycles %d\n", usec, sleep);
-		// usleep(usec);
-		avr->cycle += 1 + sleep;
-	}
-	// Interrupt servicing might change the PC too, during 'sleep'
-	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
-		avr_service_interrupts(avr);
-
-	// if we were stepping, use this state to inform remote gdb
-
-	return avr->state;
+/*
+ * The tests don't need to run in real time
+ */
+static void
+tests_sleep_cb(struct avr_t *avr, avr_cycle_count_t howLong) {
 }
 
 avr_t *tests_init_avr(const char *elfname) {
@@ -114,30 +68,71 @@ avr_t *tests_init_avr(const char *elfname) {
 	return avr;
 }
 
+avr_t *tests_init_avr_code(const char *mcu, const uint16_t *code, uint32_t size) {
+	avr_t *avr = avr_make_mcu_by_name(mcu);
+	if (!avr)
+		fail("Creating AVR failed.");
+	avr_init(avr);
+	if (code)
+		avr_loadcode(avr, (uint8_t *)code, size, 0);
+	return avr;
+}
+
+avr_cycle_count_t tests_bench_timer(avr_t *avr, avr_cycle_count_t when, void *param) {
+	((avr_t *)param)->data[TESTS_BENCH_TIMER_COUNT]++;
+	return when + 777;
+}
+
+uint8_t tests_eeprom_byte(avr_t *avr) {
+	uint8_t v;
+	avr_eeprom_desc_t d = { .ee = &v, .offset = 0, .size = 1 };
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d);
+	return v;
+}
+
+void tests_set_eeprom_byte(avr_t *avr, uint8_t v) {
+	avr_eeprom_desc_t d = { .ee = &v, .offset = 0, .size = 1 };
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &d);
+}
+
+void tests_events_record(tests_events_t *e, avr_cycle_count_t cycle, uint32_t value) {
+	if (e->count < TESTS_EVENTS) {
+		e->cycle[e->count] = cycle;
+		e->value[e->count] = value;
+	}
+	e->count++;
+}
+
+void tests_events_compare(const char *what, const tests_events_t *ref,
+			  const tests_events_t *e) {
+	if (ref->count > TESTS_EVENTS || e->count > TESTS_EVENTS)
+		fail("%s: too many events, %d and %d", what, ref->count, e->count);
+	if (e->count != ref->count)
+		fail("%s: %d events, not %d", what, e->count, ref->count);
+	for (int i = 0; i < e->count; i++)
+		if (e->cycle[i] != ref->cycle[i] || e->value[i] != ref->value[i])
+			fail("%s: event %d at cycle %d value %d, not at %d value %d",
+					what, i, (int)e->cycle[i], (int)e->value[i],
+					(int)ref->cycle[i], (int)ref->value[i]);
+}
+
 int tests_run_test(avr_t *avr, unsigned long run_usec) {
 	if (!avr)
 		fail("Internal test error: avr == NULL in run_test()");
-	// register a cycle timer to fire after 100 seconds (simulation time);
-	// assert that the simulation has not finished before that.
-	jmp_buf jmp;
-	special_deinit_jmpbuf = &jmp;
-	avr->custom.deinit = special_deinit_longjmp_cb;
-	avr_cycle_timer_register_usec(avr, run_usec,
-				      cycle_timer_longjmp_cb, &jmp);
-	int reason = setjmp(jmp);
+	// run for 'run_usec' (simulation time), or until the firmware
+	// stops by sleeping with interrupts off
+	avr->sleep = tests_sleep_cb;
+	int state = avr_run_until(avr,
+			avr->cycle + avr_usec_to_cycles(avr, run_usec), NULL, NULL);
 	tests_cycle_count = avr->cycle;
-	if (reason == 0) {
-		// setjmp() returned directly, run avr
-		while (1)
-			my_avr_run(avr);
-	} else if (reason == 1) {
-		// returned from longjmp(); cycle timer fired
-		return reason;
-	} else if (reason == 2) {
-		// returned from special deinit, avr stopped
-		return reason;
+	switch (state) {
+		case cpu_Running:
+		case cpu_Sleeping:
+			return LJR_CYCLE_TIMER;
+		case cpu_Done:
+			return LJR_SPECIAL_DEINIT;
 	}
-	fail("Error in test case: Should never reach this.");
+	fail("Error in test case: simulation stopped in state %d.", state);
 	return 0;
 }
 
@@ -4,9 +4,8 @@
 #include "sim_avr.h"
 
 enum tests_finish_reason {
-	LJR_CYCLE_TIMER = 1,
-	LJR_SPECIAL_DEINIT = 2,
-	// LJR_SLEEP_WITH_INT_OFF - LJR_SPECIAL_DEINIT happens...
+	LJR_CYCLE_TIMER = 1,	// ran for the whole time given
+	LJR_SPECIAL_DEINIT = 2,	// the firmware slept with interrupts off
 };
 
 #define ATMEGA48_UDR0 0xc6
@@ -19,6 +18,11 @@ void __attribute__ ((noreturn,format (printf, 3, 4)))
 _fail(const char *filename, int linenum, const char *fmt, ...);
 
 avr_t *tests_init_avr(const char *elfname);
+/*
+ * Makes an AVR and loads the hand assembled 'code' (if any) at address 0,
+ * for the tests that don't need avr-gcc to build their firmware.
+ */
+avr_t *tests_init_avr_code(const char *mcu, const uint16_t *code, uint32_t size);
 void tests_init(int argc, char **argv);
 void tests_success(void);
 
@@ -39,6 +43,32 @@ void tests_assert_cycles_at_most(unsigned long n);
 // the range is inclusive
 void tests_assert_cycles_between(unsigned long min, unsigned long max);
 
+/*
+ * A cycle timer of the test bench, every 777 cycles from when it's first
+ * registered it counts in the data space of the AVR given as 'param', at
+ * TESTS_BENCH_TIMER_COUNT. That param is part of the AVR, clones get the
+ * timer too.
+ */
+#define TESTS_BENCH_TIMER_COUNT	0x103
+avr_cycle_count_t tests_bench_timer(avr_t *avr, avr_cycle_count_t when, void *param);
+
+// the first byte of the EEPROM
+uint8_t tests_eeprom_byte(avr_t *avr);
+void tests_set_eeprom_byte(avr_t *avr, uint8_t v);
+
+// records what an IRQ did, to compare two runs
+#define TESTS_EVENTS	8192
+typedef struct tests_events_t {
+	int count;
+	avr_cycle_count_t cycle[TESTS_EVENTS];
+	uint32_t value[TESTS_EVENTS];
+} tests_events_t;
+
+void tests_events_record(tests_events_t *e, avr_cycle_count_t cycle, uint32_t value);
+// fails unless 'e' holds the same events as 'ref'
+void tests_events_compare(const char *what, const tests_events_t *ref,
+			  const tests_events_t *e);
+
 extern avr_cycle_count_t tests_cycle_count;
 extern int tests_disable_stdout;
 